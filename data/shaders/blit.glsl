@@ -17,7 +17,7 @@ varying lowp    vec4        v_color;
 #ifdef VERTEX_SHADER
 
 attribute highp     vec4    a_pos;
-attribute mediump   vec2    a_tex_pos;
+attribute highp     vec2    a_tex_pos;
 attribute lowp      vec3    a_color;
 
 void main()
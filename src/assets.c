@@ -8,7 +8,13 @@
  */
 
 #include "swe.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 static const int DEFAULT_DELAY = 60;
 
@@ -21,6 +27,16 @@ enum {
     FREE_DATA   = 1 << 10,
     LOGGED      = 1 << 11,
     CAN_RELEASE = 1 << 12,
+    MAPPED      = 1 << 13,
+};
+
+// Reference counted data of an asset, so that it can outlive the asset.
+struct asset_ref
+{
+    int             nb_refs;
+    void            *data;
+    int             size;
+    int             flags; // FREE_DATA or MAPPED if we own the data.
 };
 
 typedef struct asset asset_t;
@@ -36,6 +52,7 @@ struct asset
     int             size;
     int             last_used;
     int             delay;
+    asset_ref_t     *ref;
 };
 
 // Global map of all the assets.
@@ -47,11 +64,16 @@ static struct {
     char *alias;
 } g_alias[8] = {};
 
-// Only support a single custom handler for the moment.
+// Global list of the custom handlers.
 static struct {
     char *prefix;
-    void *(*fn)(const char *path, int *size, int *code);
-} g_handler = {};
+    void *user;
+    const void *(*fn)(void *user, const char *url, int *size, int *code,
+                      bool *free_data);
+} g_handlers[8] = {};
+
+// Total size of the local files we read into memory.
+static int64_t g_copied_bytes = 0;
 
 /*
  * Convenience function to log return code errors if needed.
@@ -75,6 +97,73 @@ static bool file_exists(const char *path)
     return false;
 }
 
+// Get the local path of a file url or path.  The file urls are percent
+// decoded, so that for example "file:///a%20b" gives "/a b".
+static void get_local_path(const char *url, char *out, int size)
+{
+    int i, c;
+    if (!str_startswith(url, "file://")) {
+        snprintf(out, size, "%s", url);
+        return;
+    }
+    url += strlen("file://");
+    for (i = 0; *url && i < size - 1; i++) {
+        if (    url[0] == '%' && isxdigit(url[1]) && isxdigit(url[2]) &&
+                sscanf(url + 1, "%2x", &c) == 1) {
+            out[i] = c;
+            url += 3;
+        } else {
+            out[i] = *url++;
+        }
+    }
+    out[i] = '\0';
+}
+
+// Test if an url is handled by a handler prefix.  The prefix has to be
+// followed by a '/', a '?' or the end of the url, so that a handler for
+// ".../DSS" doesn't catch ".../DSSColor".
+static bool url_has_prefix(const char *url, const char *prefix)
+{
+    int len = strlen(prefix);
+    if (strncmp(url, prefix, len) != 0) return false;
+    if (len && prefix[len - 1] == '/') return true;
+    return url[len] == '\0' || url[len] == '/' || url[len] == '?';
+}
+
+static void free_data(void *data, int size, int flags)
+{
+    if (flags & MAPPED) munmap(data, size);
+    else if (flags & FREE_DATA) free(data);
+}
+
+/*
+ * Memory map a local file.
+ *
+ * Like read_file, the data has to be followed by a zero byte, so that text
+ * files can directly be used as strings.  The end of the last page of a
+ * mapping is always filled with zeros, so we only map the files whose size
+ * is not a multiple of the page size.
+ */
+static void *map_file(const char *path, int *size)
+{
+    int fd;
+    struct stat st;
+    void *data;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) return NULL;
+    if (    fstat(fd, &st) || st.st_size == 0 || st.st_size > INT_MAX ||
+            st.st_size % sysconf(_SC_PAGESIZE) == 0) {
+        close(fd);
+        return NULL;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+    *size = st.st_size;
+    return data;
+}
+
 static asset_t *asset_get(const char *url, int flags)
 {
     asset_t *asset;
@@ -120,8 +209,9 @@ const void *asset_get_data2(const char *url, int flags, int *size, int *code)
 {
     asset_t *asset;
     int i, r, default_size, default_code;
-    char alias[1024];
+    char alias[1024], path[1024];
     const void *data = NULL;
+    bool own_data;
     (void)r;
     size = size ?: &default_size;
     code = code ?: &default_code;
@@ -150,14 +240,37 @@ const void *asset_get_data2(const char *url, int flags, int *size, int *code)
         assert(r == 0);
     }
 
-    // Special handler for local files.
-    if (!strchr(url, ':')) {
-        if (!file_exists(url)) {
+    // Check if we have a special handler for this asset.  This is done
+    // before checking local files, so that a handler can serve local urls
+    // without any file system access.
+    for (i = 0; !asset->data && i < ARRAY_SIZE(g_handlers); i++) {
+        if (!g_handlers[i].prefix) break;
+        if (!url_has_prefix(url, g_handlers[i].prefix)) continue;
+        own_data = true;
+        data = g_handlers[i].fn(g_handlers[i].user, url, size, code,
+                                &own_data);
+        asset->data = (void*)data;
+        asset->size = *size;
+        if (own_data) asset->flags |= FREE_DATA;
+        goto end;
+    }
+
+    // Special handler for local files.  We map them in memory, so that
+    // the data can be used without any copy.
+    if (!asset->data && (!strchr(url, ':') || str_startswith(url, "file://"))) {
+        get_local_path(url, path, sizeof(path));
+        if (!file_exists(path)) {
             *code = 404;
             goto end;
         }
-        asset->data = read_file(url, &asset->size);
-        asset->flags |= FREE_DATA;
+        asset->data = map_file(path, &asset->size);
+        if (asset->data) {
+            asset->flags |= MAPPED;
+        } else {
+            asset->data = read_file(path, &asset->size);
+            asset->flags |= FREE_DATA;
+            g_copied_bytes += asset->size;
+        }
     }
 
     if (asset->data) {
@@ -180,22 +293,15 @@ const void *asset_get_data2(const char *url, int flags, int *size, int *code)
         }
     }
 
-    // Check if we have a special handler for this asset.
-    if (g_handler.prefix && str_startswith(url, g_handler.prefix)) {
-        asset->data = g_handler.fn(url, &asset->size, code);
-        asset->flags |= FREE_DATA;
-        *size = asset->size;
-        data = asset->data;
-        goto end;
-    }
-
     if (!asset->request) {
         if (asset->delay) {
             asset->delay--;
             assert(*code == 0 && *size == 0);
             return NULL;
         }
-        asset->request = request_create(asset->url);
+        asset->request = request_create2(asset->url,
+                (flags & ASSET_STALE_WHILE_REVALIDATE) ?
+                REQUEST_STALE_WHILE_REVALIDATE : 0);
     }
     data = request_get_data(asset->request, size, code);
     if (*code && (flags & ASSET_USED_ONCE))
@@ -208,10 +314,18 @@ end:
 
 static void asset_release_(asset_t *asset)
 {
-    if (asset->flags & FREE_DATA) {
-        free(asset->data);
+    // If some references to the data are still alive, the last one will
+    // free it.
+    if (asset->ref) {
+        asset_unref(asset->ref);
+        asset->ref = NULL;
+    } else {
+        free_data(asset->data, asset->size, asset->flags);
+    }
+    if (asset->flags & (FREE_DATA | MAPPED)) {
         asset->data = NULL;
         asset->size = 0;
+        asset->flags &= ~(FREE_DATA | MAPPED);
     }
     if (asset->request)
         request_delete(asset->request);
@@ -271,15 +385,106 @@ void asset_release(const char *url)
     asset_release_(asset);
 }
 
+asset_ref_t *asset_ref(const char *url)
+{
+    asset_t *asset;
+    HASH_FIND_STR(g_assets, url, asset);
+    // Only the data we hold directly can be shared, not the requests data.
+    if (!asset || !asset->data) return NULL;
+    if (!asset->ref) {
+        asset->ref = calloc(1, sizeof(*asset->ref));
+        asset->ref->nb_refs = 1; // Reference of the asset itself.
+        asset->ref->data = asset->data;
+        asset->ref->size = asset->size;
+        asset->ref->flags = asset->flags & (FREE_DATA | MAPPED);
+    }
+    __atomic_fetch_add(&asset->ref->nb_refs, 1, __ATOMIC_RELAXED);
+    return asset->ref;
+}
+
+void asset_unref(asset_ref_t *ref)
+{
+    if (__atomic_sub_fetch(&ref->nb_refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    free_data(ref->data, ref->size, ref->flags);
+    free(ref);
+}
+
+int64_t asset_get_copied_bytes(void)
+{
+    return g_copied_bytes;
+}
+
 void asset_add_handler(
-        const char *prefix,
-        void *(*handler)(const char *path, int *size, int *code))
+        const char *prefix, void *user,
+        const void *(*handler)(void *user, const char *url,
+                               int *size, int *code, bool *free_data))
+{
+    int i;
+    for (i = 0; i < ARRAY_SIZE(g_handlers); i++) {
+        if (!g_handlers[i].prefix) break;
+    }
+    assert(i < ARRAY_SIZE(g_handlers));
+    g_handlers[i].prefix = strdup(prefix);
+    g_handlers[i].user = user;
+    g_handlers[i].fn = handler;
+}
+
+/******** TESTS ***********************************************************/
+
+#if COMPILE_TESTS
+
+static void test_assets_local_files(void)
+{
+    char path[] = "/tmp/swe_test_assetXXXXXX";
+    char url[64];
+    const char *data;
+    asset_ref_t *ref;
+    int fd, size, code;
+
+    fd = mkstemp(path);
+    assert(fd != -1);
+    assert(write(fd, "local data", 10) == 10);
+    close(fd);
+
+    // Local files are mapped and null terminated.
+    data = asset_get_data(path, &size, &code);
+    assert(code == 200 && size == 10 && strcmp(data, "local data") == 0);
+    // The data stays valid after the release while we hold a reference.
+    ref = asset_ref(path);
+    assert(ref);
+    asset_release(path);
+    assert(strcmp(data, "local data") == 0);
+    asset_unref(ref);
+
+    snprintf(url, sizeof(url), "file://%s", path);
+    data = asset_get_data(url, &size, &code);
+    assert(code == 200 && size == 10 && strcmp(data, "local data") == 0);
+    asset_release(url);
+
+    // File urls are percent encoded.
+    assert(rename(path, "/tmp/swe test asset") == 0);
+    data = asset_get_data("file:///tmp/swe%20test%20asset", &size, &code);
+    assert(code == 200 && size == 10 && strcmp(data, "local data") == 0);
+    asset_release("file:///tmp/swe%20test%20asset");
+    unlink("/tmp/swe test asset");
+}
+
+static void test_assets_handler_prefix(void)
 {
-    assert(!g_handler.prefix);
-    g_handler.prefix = strdup(prefix);
-    g_handler.fn = handler;
+    assert(url_has_prefix("https://x.org/DSS", "https://x.org/DSS"));
+    assert(url_has_prefix("https://x.org/DSS/properties",
+                          "https://x.org/DSS"));
+    assert(url_has_prefix("https://x.org/DSS?v=1", "https://x.org/DSS"));
+    assert(!url_has_prefix("https://x.org/DSSColor/properties",
+                           "https://x.org/DSS"));
+    assert(url_has_prefix("https://x.org/DSS/a", "https://x.org/DSS/"));
 }
 
+TEST_REGISTER(NULL, test_assets_local_files, TEST_AUTO);
+TEST_REGISTER(NULL, test_assets_handler_prefix, TEST_AUTO);
+
+#endif
+
 #include "assets/cities.txt.inl"
 #include "assets/font.inl"
 #include "assets/mpcorb.dat.inl"
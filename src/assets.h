@@ -8,6 +8,7 @@
  */
 
 #include <stdbool.h>
+#include <stdint.h>
 
 /*
  * File: assets.h
@@ -18,7 +19,7 @@
  * All assets are uniquely identified by a url, that can be either:
  * - A url to an online resource (https://something).
  * - A bundled data url (asset://something).
- * - A local filesytem path (/path/to/something).
+ * - A local filesytem path (/path/to/something or file:///path/to/something).
  *
  * The function <asset_get_data> return the data associated with an url
  * if available, and the function <asset_release> is a hint to the assets
@@ -36,11 +37,17 @@
  *   ASSET_ACCEPT_404   - Do not log error on a 404 return.
  *   ASSET_USED_ONCE    - Hint that the data can be release after it has
  *                        been read.
+ *   ASSET_STALE_WHILE_REVALIDATE - Return an expired cached copy of an
+ *                        online resource immediately, and check for a new
+ *                        version in the background.  If it changed, the
+ *                        asset data is replaced, and the new version is
+ *                        in the cache for the next time.
  */
 enum {
     ASSET_DELAY             = 1 << 0,
     ASSET_ACCEPT_404        = 1 << 1,
     ASSET_USED_ONCE         = 1 << 2,
+    ASSET_STALE_WHILE_REVALIDATE = 1 << 3,
 };
 
 /*
@@ -85,6 +92,45 @@ const void *asset_get_data2(const char *url, int flags, int *size, int *code);
  */
 void asset_release(const char *url);
 
+/*
+ * Type: asset_ref_t
+ * Reference to the data of an asset, see <asset_ref>.
+ */
+typedef struct asset_ref asset_ref_t;
+
+/*
+ * Function: asset_ref
+ * Get a reference to the data of an asset.
+ *
+ * The data returned by <asset_get_data> for this url then stays valid
+ * after the asset is released, until the reference is released with
+ * <asset_unref>.  This allows to use the data in a thread without copying
+ * it, for example for memory mapped local files.
+ *
+ * Return:
+ *   A reference to the asset data, or NULL if the data cannot be shared
+ *   (for example online resources).  In that case the caller has to copy
+ *   the data if it needs it after <asset_release>.
+ */
+asset_ref_t *asset_ref(const char *url);
+
+/*
+ * Function: asset_unref
+ * Release a reference returned by <asset_ref>.
+ *
+ * This is thread safe.
+ */
+void asset_unref(asset_ref_t *ref);
+
+/*
+ * Function: asset_get_copied_bytes
+ * Return the total number of bytes read from local files into memory.
+ *
+ * The local files are memory mapped when possible, so this only counts
+ * the files we had to read.
+ */
+int64_t asset_get_copied_bytes(void);
+
 /*
  * Macro: ASSET_ITER
  * Iter all the asset url that start with a given prefix.
@@ -125,8 +171,23 @@ void asset_set_alias(const char *base_url, const char *alias);
 
 /*
  * Function: asset_add_handler
- * Add a custrom asset handler for urls with a given prefix.
+ * Add a custom asset handler for urls with a given prefix.
+ *
+ * The handlers are checked before any other source, including the local
+ * files.
+ *
+ * Parameters:
+ *   prefix  - Urls starting with this prefix, followed by a '/', a '?' or
+ *             nothing, are passed to the handler.
+ *   user    - User data passed to the handler.
+ *   handler - Function that returns the data of an url, and sets its size
+ *             and return code.  By default the returned data is freed by
+ *             the asset manager when the asset is released.  The handler
+ *             can set free_data to false to return data it still owns
+ *             (for example a view into a memory mapped file), in which
+ *             case it has to stay valid for the whole program lifetime.
  */
 void asset_add_handler(
-        const char *prefix,
-        void *(*handler)(const char *path, int *size, int *code));
+        const char *prefix, void *user,
+        const void *(*handler)(void *user, const char *url,
+                               int *size, int *code, bool *free_data));
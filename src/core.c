@@ -53,6 +53,23 @@ static void core_on_utcoffset_changed(obj_t *obj, const attribute_t *attr)
     core->utc_offset = clamp(core->utc_offset, -24 * 60, +24 * 60);
 }
 
+static void core_on_net_changed(obj_t *obj, const attribute_t *attr)
+{
+    request_set_limits(core->net.max_connections,
+                       core->net.max_host_connections);
+    request_set_timeouts(core->net.connect_timeout, core->net.timeout);
+}
+
+static void core_on_workers_changed(obj_t *obj, const attribute_t *attr)
+{
+    worker_set_threads_count(core->workers.threads);
+}
+
+static void core_on_textures_changed(obj_t *obj, const attribute_t *attr)
+{
+    hips_set_compression(core->textures.compress);
+}
+
 static void add_progressbar(void *user, const char *id, const char *label,
                             int v, int total)
 {
@@ -263,6 +280,18 @@ static void core_set_default(void)
 
     core->telescope_auto = true;
     observer_update(core->observer, false);
+
+    core->net.max_connections = 16;
+    core->net.max_host_connections = 6;
+    core->net.connect_timeout = 15;
+    core->net.timeout = 0;
+    core_on_net_changed(&core->obj, NULL);
+
+    core->hips_upload.max_time = 4;
+    core->hips_upload.max_bytes = 8 * (1 << 20);
+    core->textures.max_memory = 512;
+    core->textures.compress = false;
+    core_on_textures_changed(&core->obj, NULL);
 }
 
 static void on_progressbar(const char *id)
@@ -305,6 +334,9 @@ void core_init(double win_w, double win_h, double pixel_scale)
     core->win_size[1] = win_h;
     core->win_pixels_scale = pixel_scale;
     obj_add_sub(&core->obj, "hints");
+    obj_add_sub(&core->obj, "network");
+    obj_add_sub(&core->obj, "hips_upload");
+    obj_add_sub(&core->obj, "textures");
     core->hints_mag_max = NAN;
 
     core->observer = (observer_t*)obj_create("observer", "observer",
@@ -328,6 +360,8 @@ void core_release(void)
     DL_FOREACH(core->obj.children, module) {
         if (module->klass->del) module->klass->del(module);
     }
+    arena_delete(core->frame_arena);
+    core->frame_arena = NULL;
     profile_release();
 }
 
@@ -380,6 +414,87 @@ static int core_update_direction(double dt)
     return 1;
 }
 
+// Track the view motion, so that we can predict the view of the next
+// frames.
+static void core_update_motion(double dt)
+{
+    double dir[3], speed[3], fov_speed;
+    // Smoothing factor of the speeds.
+    const double k = 0.5;
+
+    eraS2c(core->observer->azimuth, core->observer->altitude, dir);
+    if (dt > 0 && core->motion.fov) {
+        vec3_sub(dir, core->motion.dir, speed);
+        vec3_mul(1.0 / dt, speed, speed);
+        fov_speed = log(core->fov / core->motion.fov) / dt;
+        vec3_mix(core->motion.speed, speed, k, core->motion.speed);
+        core->motion.fov_speed = mix(core->motion.fov_speed, fov_speed, k);
+    }
+    vec3_copy(dir, core->motion.dir);
+    core->motion.fov = core->fov;
+}
+
+// Prefetch the tiles of the view predicted from the current motion.
+static void core_prefetch(void)
+{
+    // How far in the future we predict the view (sec).
+    const double t = 0.3;
+    double dir[3], k, radius;
+
+    vec3_addk(core->motion.dir, core->motion.speed, t, dir);
+    k = exp(core->motion.fov_speed * t);
+    // Nothing to do if the view doesn't move.
+    if (vec3_dist(dir, core->motion.dir) < 0.1 * DD2R && fabs(k - 1) < 0.05)
+        return;
+    radius = sqrt(core->fovx * core->fovx + core->fovy * core->fovy) / 2;
+    hips_prefetch(core->observer, dir, radius * k, k < 1);
+}
+
+// Update the network profiling data, dt is the time since the last call.
+static void update_http_stats(double dt)
+{
+    int64_t bytes;
+    double latency, throughput;
+    request_get_stats(NULL, &bytes, &latency);
+    throughput = dt > 0 ? (bytes - core->prof.http_bytes) / dt : 0;
+    core->prof.http_bytes = bytes;
+    if (throughput != core->prof.http_throughput) {
+        core->prof.http_throughput = throughput;
+        obj_changed(&core->obj, "http_throughput");
+    }
+    if (latency * 1000 != core->prof.http_latency) {
+        core->prof.http_latency = latency * 1000;
+        obj_changed(&core->obj, "http_latency");
+    }
+}
+
+// Enforce the textures GPU memory budget and update the textures profiling
+// data.  Must be called after the rendering.
+static void update_textures_stats(void)
+{
+    const char *names[TEX_CAT_COUNT] = {
+        [TEX_CAT_HIPS]      = "hips_texture_memory",
+        [TEX_CAT_LABEL]     = "label_texture_memory",
+        [TEX_CAT_PLANET]    = "planet_texture_memory",
+    };
+    double mem;
+    int i;
+
+    texture_end_frame(core->textures.max_memory * (1 << 20));
+    mem = (double)texture_get_memory(-1, NULL) / (1 << 20);
+    if (mem != core->prof.tex_memory) {
+        core->prof.tex_memory = mem;
+        obj_changed(&core->obj, "texture_memory");
+    }
+    for (i = 0; i < TEX_CAT_COUNT; i++) {
+        if (!names[i]) continue;
+        mem = (double)texture_get_memory(i, NULL) / (1 << 20);
+        if (mem == core->prof.tex_memory_cat[i]) continue;
+        core->prof.tex_memory_cat[i] = mem;
+        obj_changed(&core->obj, names[i]);
+    }
+}
+
 int core_update(double dt)
 {
     bool atm_visible;
@@ -428,6 +543,7 @@ int core_update(double dt)
         }
     }
 
+    core_update_motion(dt);
     return 0;
 }
 
@@ -477,6 +593,8 @@ int core_render(double win_w, double win_h, double pixel_scale)
     double t;
     bool cst_visible;
     double max_vmag;
+    int overflow, nb, mallocs;
+    int64_t copied;
 
     // Used to make sure some values are not touched during render.
     struct {
@@ -497,16 +615,20 @@ int core_render(double win_w, double win_h, double pixel_scale)
     if (core->prof.nb_frames++ >= 60) {
         core->prof.fps = core->prof.nb_frames / (t - core->prof.start_time);
         obj_changed(&core->obj, "fps");
+        update_http_stats(t - core->prof.start_time);
         core->prof.start_time = t;
         core->prof.nb_frames = 0;
     }
 
     if (!core->rend)
         core->rend = render_gl_create();
+    if (!core->frame_arena)
+        core->frame_arena = arena_create(4 * 1024 * 1024);
     core->win_size[0] = win_w;
     core->win_size[1] = win_h;
     core->win_pixels_scale = pixel_scale;
     labels_reset();
+    hips_begin_frame(core->observer);
 
     projection_init(&proj, core->proj, core->fovx, win_w, win_h);
 
@@ -543,6 +665,48 @@ int core_render(double win_w, double win_h, double pixel_scale)
 
     // Flush all rendering pipeline
     paint_finish(&painter);
+    core_prefetch();
+
+    nb = hips_process_uploads(core->hips_upload.max_time,
+                              core->hips_upload.max_bytes);
+    if (nb != core->prof.hips_upload_queue) {
+        core->prof.hips_upload_queue = nb;
+        obj_changed(&core->obj, "hips_upload_queue");
+    }
+    update_textures_stats();
+
+    arena_get_stats(core->frame_arena, &nb, &mallocs, NULL);
+    if (nb != core->prof.frame_allocs) {
+        core->prof.frame_allocs = nb;
+        obj_changed(&core->obj, "frame_allocs");
+    }
+    if (mallocs != core->prof.frame_mallocs) {
+        core->prof.frame_mallocs = mallocs;
+        obj_changed(&core->obj, "frame_mallocs");
+    }
+
+    copied = asset_get_copied_bytes() + hips_get_copied_bytes();
+    nb = copied - core->prof.copied_bytes;
+    core->prof.copied_bytes = copied;
+    if (nb != core->prof.frame_copied_bytes) {
+        core->prof.frame_copied_bytes = nb;
+        obj_changed(&core->obj, "frame_copied_bytes");
+    }
+
+    if (core->rend->stats.nb_draw_calls != core->prof.draw_calls) {
+        core->prof.draw_calls = core->rend->stats.nb_draw_calls;
+        obj_changed(&core->obj, "draw_calls");
+    }
+    if (core->rend->stats.nb_tex_binds != core->prof.tex_binds) {
+        core->prof.tex_binds = core->rend->stats.nb_tex_binds;
+        obj_changed(&core->obj, "texture_binds");
+    }
+
+    overflow = hips_get_cache_overflow();
+    if (overflow != core->prof.hips_cache_overflow) {
+        core->prof.hips_cache_overflow = overflow;
+        obj_changed(&core->obj, "hips_cache_overflow");
+    }
 
     // Do post render (e.g. for GUI)
     DL_FOREACH(core->obj.children, module) {
@@ -940,6 +1104,44 @@ static obj_klass_t core_klass = {
                  .sub = "hints"),
         PROPERTY("progressbars", "json", .fn = core_fn_progressbars),
         PROPERTY("fps", "f", MEMBER(core_t, prof.fps)),
+        PROPERTY("hips_cache_overflow", "d",
+                 MEMBER(core_t, prof.hips_cache_overflow)),
+        PROPERTY("http_throughput", "f", MEMBER(core_t, prof.http_throughput)),
+        PROPERTY("http_latency", "f", MEMBER(core_t, prof.http_latency)),
+        PROPERTY("draw_calls", "d", MEMBER(core_t, prof.draw_calls)),
+        PROPERTY("texture_binds", "d", MEMBER(core_t, prof.tex_binds)),
+        PROPERTY("hips_upload_queue", "d",
+                 MEMBER(core_t, prof.hips_upload_queue)),
+        PROPERTY("frame_allocs", "d", MEMBER(core_t, prof.frame_allocs)),
+        PROPERTY("frame_mallocs", "d", MEMBER(core_t, prof.frame_mallocs)),
+        PROPERTY("frame_copied_bytes", "d",
+                 MEMBER(core_t, prof.frame_copied_bytes)),
+        PROPERTY("texture_memory", "f", MEMBER(core_t, prof.tex_memory)),
+        PROPERTY("hips_texture_memory", "f",
+                 MEMBER(core_t, prof.tex_memory_cat[TEX_CAT_HIPS])),
+        PROPERTY("label_texture_memory", "f",
+                 MEMBER(core_t, prof.tex_memory_cat[TEX_CAT_LABEL])),
+        PROPERTY("planet_texture_memory", "f",
+                 MEMBER(core_t, prof.tex_memory_cat[TEX_CAT_PLANET])),
+        PROPERTY("max_time", "f", MEMBER(core_t, hips_upload.max_time),
+                 .sub = "hips_upload"),
+        PROPERTY("max_bytes", "d", MEMBER(core_t, hips_upload.max_bytes),
+                 .sub = "hips_upload"),
+        PROPERTY("max_memory", "f", MEMBER(core_t, textures.max_memory),
+                 .sub = "textures"),
+        PROPERTY("compress", "b", MEMBER(core_t, textures.compress),
+                 .sub = "textures", .on_changed = core_on_textures_changed),
+        PROPERTY("max_connections", "d", MEMBER(core_t, net.max_connections),
+                 .sub = "network", .on_changed = core_on_net_changed),
+        PROPERTY("max_host_connections", "d",
+                 MEMBER(core_t, net.max_host_connections),
+                 .sub = "network", .on_changed = core_on_net_changed),
+        PROPERTY("connect_timeout", "f", MEMBER(core_t, net.connect_timeout),
+                 .sub = "network", .on_changed = core_on_net_changed),
+        PROPERTY("timeout", "f", MEMBER(core_t, net.timeout),
+                 .sub = "network", .on_changed = core_on_net_changed),
+        PROPERTY("threads", "d", MEMBER(core_t, workers.threads),
+                 .sub = "workers", .on_changed = core_on_workers_changed),
         PROPERTY("clicks", "d", MEMBER(core_t, clicks)),
         PROPERTY("ignore_clicks", "b", MEMBER(core_t, ignore_clicks)),
         PROPERTY("zoom", "f", MEMBER(core_t, zoom)),
@@ -177,6 +177,9 @@ struct core
     bool            telescope_auto; // Auto adjust telescope.
 
     renderer_t      *rend;
+    // Memory for the data that only lives during a frame.  Reset by
+    // paint_finish.
+    arena_t         *frame_arena;
     int             proj;
     double          win_size[2];
     double          win_pixels_scale;
@@ -184,11 +187,54 @@ struct core
     obj_t           *hovered;
     bool            fast_mode; // Render as fast as possible.
 
+    // Network settings.
+    struct {
+        int         max_connections; // Max concurrent requests.
+        int         max_host_connections; // Max connections per host.
+        double      connect_timeout; // sec, zero for default.
+        double      timeout; // sec, zero for no limit.
+    } net;
+
+    // Tiles decoding thread pool.
+    struct {
+        int         threads; // Zero for the number of cores.
+    } workers;
+
+    // Per frame budget of the hips tiles textures uploads.
+    struct {
+        double      max_time; // ms, zero for no limit.
+        int         max_bytes; // Zero for no limit.
+    } hips_upload;
+
+    // GPU memory budget of the textures.
+    struct {
+        double      max_memory; // MB, zero for no limit.
+        bool        compress; // Compress the hips tiles textures.
+    } textures;
+
     // Profiling data.
     struct {
         double      start_time; // Start of measurement window (sec)
         int         nb_frames;  // Number of frames elapsed.
         double      fps;        // Averaged FPS counter.
+        // Bytes used by the hips tiles cache above its soft limit.
+        int         hips_cache_overflow;
+        int64_t     http_bytes; // Downloaded bytes at start of window.
+        double      http_throughput; // Download speed (bytes/sec).
+        double      http_latency; // Averaged time to first byte (ms).
+        int         draw_calls; // Draw calls of the last frame.
+        int         tex_binds;  // Texture binds of the last frame.
+        // Tiles textures uploads delayed to the next frames.
+        int         hips_upload_queue;
+        // GPU memory used by the textures (MB), total and per category.
+        double      tex_memory;
+        double      tex_memory_cat[TEX_CAT_COUNT];
+        // Frame arena allocations and mallocs of the last frame.
+        int         frame_allocs;
+        int         frame_mallocs;
+        // Assets data copied during the last frame (bytes), and in total.
+        int         frame_copied_bytes;
+        int64_t     copied_bytes;
     } prof;
 
     // Number of clicks so far.  This is just so that we can wait for clicks
@@ -222,6 +268,14 @@ struct core
     // Zoom movement. -1 to zoom out, +1 to zoom in.
     double zoom;
 
+    // View motion, used to prefetch the tiles of the predicted view.
+    struct {
+        double      dir[3];     // Last view direction (observed frame).
+        double      fov;        // Last fov.
+        double      speed[3];   // Smoothed direction derivative (/sec).
+        double      fov_speed;  // Smoothed log(fov) derivative (/sec).
+    } motion;
+
     // Auto computed from fov and screen aspect ratio.
     double fovx;
     double fovy;
@@ -16,6 +16,14 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 /* The stars tile file format is as follow:
  *
  * 4 bytes magic string:    "EPHE"
@@ -37,9 +45,12 @@
  *
  * Compressed data block:
  *   4 bytes: data size
- *   4 bytes: compressed data size
+ *   4 bytes: compressed data size (28 bits) | codec (4 high bits)
  *   n bytes: compressed data
  *
+ *   The codec is one of the EPH_CODEC values.  Older files always have it
+ *   set to zero (zlib).
+ *
  * Tabular data:
  *   4 bytes: flags (1: data is shuffled)
  *   4 bytes: row size in bytes
@@ -76,25 +87,77 @@ int eph_read_tile_header(const void *data, int data_size, int *data_ofs,
     return 0;
 }
 
-void *eph_read_compressed_block(const void *data, int data_size,
-                                int *data_ofs, int *size)
+// Scratch buffer for the shuffled tables data.  The tiles are parsed in the
+// loading threads, so we keep one per thread.
+static __thread uint8_t *g_scratch;
+static __thread int g_scratch_size;
+
+#ifdef HAVE_PTHREAD
+// Only used to release the scratch buffers when their thread exits.
+static pthread_key_t g_scratch_key;
+static pthread_once_t g_scratch_once = PTHREAD_ONCE_INIT;
+
+static void scratch_key_init(void)
 {
-    int comp_size;
+    pthread_key_create(&g_scratch_key, free);
+}
+#endif
+
+static uint8_t *get_scratch(int size)
+{
+    if (size > g_scratch_size) {
+        free(g_scratch);
+        g_scratch = malloc(size);
+        g_scratch_size = size;
+#ifdef HAVE_PTHREAD
+        pthread_once(&g_scratch_once, scratch_key_init);
+        pthread_setspecific(g_scratch_key, g_scratch);
+#endif
+    }
+    return g_scratch;
+}
+
+// Uncompress a data block, either into a new buffer, or into the thread
+// scratch buffer.
+static void *read_compressed_block(const void *data, int data_size,
+                                   int *data_ofs, int *size, bool scratch)
+{
+    uint32_t comp_size;
+    int codec, r = -1;
     void *ret;
     unsigned long lsize;
     data += *data_ofs;
     memcpy(size, data, 4);
     memcpy(&comp_size, data + 4, 4);
+    codec = comp_size >> 28;
+    comp_size &= (1 << 28) - 1;
     lsize = *size;
-    ret = malloc(lsize);
+    ret = scratch ? get_scratch(lsize) : malloc(lsize);
     *data_ofs += 8 + comp_size;
-    if (uncompress(ret, &lsize, data + 8, comp_size) != Z_OK) {
+    switch (codec) {
+    case EPH_CODEC_ZLIB:
+        r = uncompress(ret, &lsize, data + 8, comp_size) == Z_OK ? 0 : -1;
+        break;
+    case EPH_CODEC_LZ4:
+        r = lz4_decompress(data + 8, comp_size, ret, *size) == *size ? 0 : -1;
+        break;
+    default:
+        LOG_E("Unsupported codec: %d", codec);
+    }
+    if (r) {
         LOG_E("Cannot uncompress data");
+        if (!scratch) free(ret);
         return NULL;
     }
     return ret;
 }
 
+void *eph_read_compressed_block(const void *data, int data_size,
+                                int *data_ofs, int *size)
+{
+    return read_compressed_block(data, data_size, data_ofs, size, false);
+}
+
 int eph_load(const void *data, int data_size, void *user,
              int (*callback)(const char type[4],
                              const void *data, int size, void *user))
@@ -123,18 +186,89 @@ int eph_load(const void *data, int data_size, void *user,
     return 0;
 }
 
+#ifdef __SSE2__
+// Transpose a 16x16 bytes block.  Four rounds of interleaving the two
+// halves of the rows give the transposed block.
+static void transpose_block16(const uint8_t *src, int src_stride,
+                              uint8_t *dst, int dst_stride)
+{
+    __m128i a[16], b[16];
+    int i, round;
+    for (i = 0; i < 16; i++)
+        a[i] = _mm_loadu_si128((const __m128i*)(src + i * src_stride));
+    for (round = 0; round < 2; round++) {
+        for (i = 0; i < 8; i++) {
+            b[2 * i + 0] = _mm_unpacklo_epi8(a[i], a[i + 8]);
+            b[2 * i + 1] = _mm_unpackhi_epi8(a[i], a[i + 8]);
+        }
+        for (i = 0; i < 8; i++) {
+            a[2 * i + 0] = _mm_unpacklo_epi8(b[i], b[i + 8]);
+            a[2 * i + 1] = _mm_unpackhi_epi8(b[i], b[i + 8]);
+        }
+    }
+    for (i = 0; i < 16; i++)
+        _mm_storeu_si128((__m128i*)(dst + i * dst_stride), a[i]);
+}
+#endif
+
+/*
+ * Transpose a matrix of bytes.
+ *
+ * We work on blocks of 16x16 bytes, so that both the reads and the writes
+ * stay in a few cache lines.
+ */
+static void transpose_bytes(const uint8_t *src, uint8_t *dst,
+                            int nb_rows, int nb_cols)
+{
+    int r0, c0, r, c, r1, c1;
+    for (r0 = 0; r0 < nb_rows; r0 += 16) {
+        for (c0 = 0; c0 < nb_cols; c0 += 16) {
+            r1 = min(r0 + 16, nb_rows);
+            c1 = min(c0 + 16, nb_cols);
+#ifdef __SSE2__
+            if (r1 - r0 == 16 && c1 - c0 == 16) {
+                transpose_block16(src + r0 * nb_cols + c0, nb_cols,
+                                  dst + c0 * nb_rows + r0, nb_rows);
+                continue;
+            }
+#endif
+            for (r = r0; r < r1; r++)
+                for (c = c0; c < c1; c++)
+                    dst[c * nb_rows + r] = src[r * nb_cols + c];
+        }
+    }
+}
+
 // In place shuffle of the data bytes for optimized compression.
 void eph_shuffle_bytes(uint8_t *data, int nb, int size)
 {
-    int i, j;
-    uint8_t *buf = calloc(nb, size);
+    uint8_t *buf = get_scratch(nb * size);
     memcpy(buf, data, nb * size);
-    for (j = 0; j < size; j++) {
-        for (i = 0; i < nb; i++) {
-            data[j * nb + i] = buf[i * size + j];
-        }
+    transpose_bytes(buf, data, nb, size);
+}
+
+void eph_unshuffle_bytes(const uint8_t *src, uint8_t *dst, int nb, int size)
+{
+    transpose_bytes(src, dst, size, nb);
+}
+
+void *eph_read_table_data(const void *data, int data_size, int *data_ofs,
+                          int flags, int row_size, int nb_rows, int *size)
+{
+    uint8_t *buf, *ret;
+    if (!(flags & 1))
+        return eph_read_compressed_block(data, data_size, data_ofs, size);
+    // Uncompress into the scratch buffer, and unshuffle from there into
+    // the returned buffer.
+    buf = read_compressed_block(data, data_size, data_ofs, size, true);
+    if (!buf) return NULL;
+    if (*size != row_size * nb_rows) {
+        LOG_E("Wrong table data size");
+        return NULL;
     }
-    free(buf);
+    ret = malloc(*size);
+    eph_unshuffle_bytes(buf, ret, nb_rows, row_size);
+    return ret;
 }
 
 int eph_read_table_header(int version, const void *data, int data_size,
@@ -239,3 +373,363 @@ int eph_read_table_row(const void *data, int data_size, int *data_ofs,
     *data_ofs += columns[0].row_size;
     return 0;
 }
+
+int eph_read_table_columns(const void *data, int data_size, int *data_ofs,
+                           int nb_rows, int nb_columns,
+                           const eph_table_column_t *columns, ...)
+{
+    int i, r, row_size;
+    const uint8_t *src;
+    va_list ap;
+    void *out;
+    double factor;
+    float f;
+
+    assert(nb_columns > 0);
+    row_size = columns[0].row_size;
+    data += *data_ofs;
+    va_start(ap, columns);
+    for (i = 0; i < nb_columns; i++) {
+        out = va_arg(ap, void*);
+        if (!out) continue;
+        if (!columns[i].got) {
+            memset(out, 0, nb_rows * (columns[i].type == 'i' ? sizeof(int) :
+                                      columns[i].type == 's' ? columns[i].size :
+                                      8));
+            continue;
+        }
+        src = data + columns[i].start;
+        switch (columns[i].type) {
+        case 'i':
+            for (r = 0; r < nb_rows; r++)
+                memcpy((int*)out + r, src + r * row_size, 4);
+            break;
+        case 'f':
+            // All the units conversions are simple factors.
+            factor = eph_convert_f(columns[i].src_unit, columns[i].unit, 1.0);
+            for (r = 0; r < nb_rows; r++) {
+                memcpy(&f, src + r * row_size, 4);
+                ((double*)out)[r] = f * factor;
+            }
+            break;
+        case 'Q':
+            for (r = 0; r < nb_rows; r++)
+                memcpy((uint64_t*)out + r, src + r * row_size, 8);
+            break;
+        case 's':
+            for (r = 0; r < nb_rows; r++)
+                memcpy((char*)out + r * columns[i].size, src + r * row_size,
+                       columns[i].size);
+            break;
+        }
+    }
+    va_end(ap);
+    *data_ofs += nb_rows * row_size;
+    return 0;
+}
+
+/******** TESTS ***********************************************************/
+
+#if COMPILE_TESTS
+
+#include <time.h>
+
+// Create a table similar to a gaia tile, with a missing column.
+static void *test_create_table(int nb, eph_table_column_t *columns,
+                               int nb_columns, int *data_ofs)
+{
+    const int row_size = 8 + 4 + 4 * 4 + 16;
+    struct {
+        char name[4];
+        char type[4];
+        int unit;
+        int start;
+        int size;
+    } header_cols[] = {
+        {"gaia", "Q", 0,          0,  8},
+        {"hip",  "i", 0,          8,  4},
+        {"vmag", "f", EPH_VMAG,   12, 4},
+        {"ra",   "f", EPH_DEG,    16, 4},
+        {"de",   "f", EPH_DEG,    20, 4},
+        {"plx",  "f", EPH_ARCSEC, 24, 4},
+        {"ids",  "s", 0,          28, 16},
+    };
+    int header[4] = {0, row_size, ARRAY_SIZE(header_cols), nb};
+    int i, flags, size, ret_row_size;
+    uint8_t *data, *row;
+    uint64_t gaia;
+    float v;
+
+    size = sizeof(header) + sizeof(header_cols) + nb * row_size;
+    data = calloc(1, size);
+    memcpy(data, header, sizeof(header));
+    memcpy(data + sizeof(header), header_cols, sizeof(header_cols));
+    srand(0);
+    for (i = 0; i < nb; i++) {
+        row = data + sizeof(header) + sizeof(header_cols) + i * row_size;
+        gaia = 1000000 + i;
+        memcpy(row, &gaia, 8);
+        if (i % 10 == 0) memcpy(row + 8, &i, 4);
+        v = 5 + rand() % 1000 / 100.0;
+        memcpy(row + 12, &v, 4);
+        v = rand() % 36000 / 100.0;
+        memcpy(row + 16, &v, 4);
+        v = rand() % 18000 / 100.0 - 90;
+        memcpy(row + 20, &v, 4);
+        v = rand() % 1000 / 1000.0;
+        memcpy(row + 24, &v, 4);
+        if (i % 10 == 0) sprintf((char*)row + 28, "NAME %d", i);
+    }
+    *data_ofs = 0;
+    eph_read_table_header(3, data, size, data_ofs, &ret_row_size, &flags,
+                          nb_columns, columns);
+    return data;
+}
+
+static void test_eph_read_table_columns(void)
+{
+    const int nb = 1000;
+    eph_table_column_t columns[] = {
+        {"gaia", 'Q'},
+        {"hip",  'i'},
+        {"tyc",  'i'},
+        {"vmag", 'f', EPH_VMAG},
+        {"ra",   'f', EPH_RAD},
+        {"plx",  'f', EPH_ARCSEC},
+        {"ids",  's', .size=16},
+    };
+    int i, data_ofs, ofs, hip, tyc, hips[nb], tycs[nb];
+    uint64_t gaia, gaias[nb];
+    double vmag, ra, plx, vmags[nb], ras[nb], plxs[nb];
+    char ids[16], idss[nb][16];
+    void *data;
+
+    data = test_create_table(nb, columns, ARRAY_SIZE(columns), &data_ofs);
+    ofs = data_ofs;
+    eph_read_table_columns(data, 0, &ofs, nb, ARRAY_SIZE(columns), columns,
+                           gaias, hips, tycs, vmags, ras, plxs, idss);
+    assert(ofs == data_ofs + nb * columns[0].row_size);
+    for (i = 0; i < nb; i++) {
+        eph_read_table_row(data, 0, &data_ofs, ARRAY_SIZE(columns), columns,
+                           &gaia, &hip, &tyc, &vmag, &ra, &plx, ids);
+        assert(gaia == gaias[i] && hip == hips[i] && tyc == tycs[i]);
+        assert(tyc == 0);
+        assert(vmag == vmags[i]);
+        assert(fabs(ra - ras[i]) <= 1e-15 * fabs(ra));
+        assert(fabs(plx - plxs[i]) <= 1e-15 * fabs(plx));
+        assert(memcmp(ids, idss[i], 16) == 0);
+    }
+    free(data);
+}
+
+// Compare the number of rows per second we can read with the two APIs.
+static void bench_eph_read_table(void)
+{
+    const int nb = 200000, nb_iter = 10;
+    eph_table_column_t columns[] = {
+        {"gaia", 'Q'},
+        {"hip",  'i'},
+        {"vmag", 'f', EPH_VMAG},
+        {"ra",   'f', EPH_RAD},
+        {"de",   'f', EPH_RAD},
+        {"plx",  'f', EPH_ARCSEC},
+    };
+    int i, iter, data_ofs, ofs, *hip;
+    uint64_t *gaia;
+    double *vmag, *ra, *de, *plx;
+    void *data;
+    clock_t t_rows, t_cols;
+
+    data = test_create_table(nb, columns, ARRAY_SIZE(columns), &data_ofs);
+    gaia = malloc(nb * sizeof(*gaia));
+    hip = malloc(nb * sizeof(*hip));
+    vmag = malloc(nb * sizeof(*vmag));
+    ra = malloc(nb * sizeof(*ra));
+    de = malloc(nb * sizeof(*de));
+    plx = malloc(nb * sizeof(*plx));
+
+    t_rows = clock();
+    for (iter = 0; iter < nb_iter; iter++) {
+        ofs = data_ofs;
+        for (i = 0; i < nb; i++)
+            eph_read_table_row(data, 0, &ofs, ARRAY_SIZE(columns), columns,
+                               &gaia[i], &hip[i], &vmag[i], &ra[i], &de[i],
+                               &plx[i]);
+    }
+    t_rows = clock() - t_rows;
+
+    t_cols = clock();
+    for (iter = 0; iter < nb_iter; iter++) {
+        ofs = data_ofs;
+        eph_read_table_columns(data, 0, &ofs, nb, ARRAY_SIZE(columns),
+                               columns, gaia, hip, vmag, ra, de, plx);
+    }
+    t_cols = clock() - t_cols;
+
+    LOG_I("eph table read: rows: %.1f Mrows/s, columns: %.1f Mrows/s",
+          (double)nb * nb_iter / t_rows * CLOCKS_PER_SEC / 1e6,
+          (double)nb * nb_iter / t_cols * CLOCKS_PER_SEC / 1e6);
+    free(data);
+    free(gaia);
+    free(hip);
+    free(vmag);
+    free(ra);
+    free(de);
+    free(plx);
+}
+
+// Create a compressed block, as written by tools/eph.py.
+static void *test_create_block(const void *data, int size, int codec,
+                               int *block_size)
+{
+    uint8_t *ret;
+    uint32_t comp_size;
+    unsigned long lsize;
+
+    lsize = max(compressBound(size), lz4_compress_bound(size));
+    ret = malloc(8 + lsize);
+    if (codec == EPH_CODEC_ZLIB) {
+        compress(ret + 8, &lsize, data, size);
+        comp_size = lsize;
+    } else {
+        comp_size = lz4_compress(data, size, ret + 8);
+    }
+    *block_size = 8 + comp_size;
+    comp_size |= (uint32_t)codec << 28;
+    memcpy(ret, &size, 4);
+    memcpy(ret + 4, &comp_size, 4);
+    return ret;
+}
+
+static void test_eph_read_compressed_block(void)
+{
+    const int codecs[] = {EPH_CODEC_ZLIB, EPH_CODEC_LZ4};
+    uint8_t data[4096], *block, *out;
+    int i, block_size, size, data_ofs;
+
+    for (i = 0; i < sizeof(data); i++) data[i] = (i / 64) % 5;
+    for (i = 0; i < ARRAY_SIZE(codecs); i++) {
+        block = test_create_block(data, sizeof(data), codecs[i], &block_size);
+        data_ofs = 0;
+        out = eph_read_compressed_block(block, block_size, &data_ofs, &size);
+        assert(out && size == sizeof(data) && data_ofs == block_size);
+        assert(memcmp(out, data, size) == 0);
+        free(out);
+        free(block);
+    }
+}
+
+// Compare the decompression speed of the codecs on a shuffled gaia-like
+// tile.
+static void bench_eph_codecs(void)
+{
+    const int nb = 20000, nb_iter = 50;
+    const int codecs[] = {EPH_CODEC_ZLIB, EPH_CODEC_LZ4};
+    const char *names[] = {"zlib", "lz4"};
+    eph_table_column_t columns[] = {{"gaia", 'Q'}};
+    int i, iter, data_ofs, block_size, size, row_size;
+    uint8_t *data, *table, *block;
+    clock_t t;
+
+    data = test_create_table(nb, columns, ARRAY_SIZE(columns), &data_ofs);
+    table = data + data_ofs;
+    row_size = columns[0].row_size;
+    eph_shuffle_bytes(table, nb, row_size);
+    for (i = 0; i < ARRAY_SIZE(codecs); i++) {
+        block = test_create_block(table, nb * row_size, codecs[i],
+                                  &block_size);
+        t = clock();
+        for (iter = 0; iter < nb_iter; iter++) {
+            data_ofs = 0;
+            free(eph_read_compressed_block(block, block_size, &data_ofs,
+                                           &size));
+        }
+        t = clock() - t;
+        LOG_I("eph %s: ratio: %.2f, %.0f MB/s", names[i],
+              (double)nb * row_size / block_size,
+              (double)nb * row_size * nb_iter / t * CLOCKS_PER_SEC / 1e6);
+        free(block);
+    }
+    free(data);
+}
+
+// Previous implementation of the unshuffle, used as reference.
+static void test_unshuffle_ref(uint8_t *data, int nb, int size)
+{
+    int i, j;
+    uint8_t *buf = calloc(nb, size);
+    memcpy(buf, data, nb * size);
+    for (j = 0; j < nb; j++) {
+        for (i = 0; i < size; i++) {
+            data[j * size + i] = buf[i * nb + j];
+        }
+    }
+    free(buf);
+}
+
+static void test_eph_shuffle_bytes(void)
+{
+    const int sizes[][2] = {{1, 1}, {7, 3}, {16, 16}, {100, 20}, {1000, 76},
+                            {333, 300}};
+    int i, j, nb, size;
+    uint8_t *data, *shuffled, *out;
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        nb = sizes[i][0];
+        size = sizes[i][1];
+        data = malloc(nb * size);
+        shuffled = malloc(nb * size);
+        out = malloc(nb * size);
+        for (j = 0; j < nb * size; j++) data[j] = rand();
+        memcpy(shuffled, data, nb * size);
+        eph_shuffle_bytes(shuffled, nb, size);
+        eph_unshuffle_bytes(shuffled, out, nb, size);
+        assert(memcmp(data, out, nb * size) == 0);
+        test_unshuffle_ref(shuffled, nb, size);
+        assert(memcmp(data, shuffled, nb * size) == 0);
+        free(data);
+        free(shuffled);
+        free(out);
+    }
+}
+
+// Compare the unshuffle speed with the previous implementation, for
+// tables of 1MB.
+static void bench_eph_unshuffle(void)
+{
+    const int row_sizes[] = {20, 44, 76, 150, 300};
+    const int nb_iter = 20;
+    int i, iter, nb, size;
+    uint8_t *data, *out;
+    clock_t t_ref, t;
+
+    for (i = 0; i < ARRAY_SIZE(row_sizes); i++) {
+        size = row_sizes[i];
+        nb = (1 << 20) / size;
+        data = malloc(nb * size);
+        out = malloc(nb * size);
+        memset(data, 1, nb * size);
+        t_ref = clock();
+        for (iter = 0; iter < nb_iter; iter++)
+            test_unshuffle_ref(data, nb, size);
+        t_ref = clock() - t_ref;
+        t = clock();
+        for (iter = 0; iter < nb_iter; iter++)
+            eph_unshuffle_bytes(data, out, nb, size);
+        t = clock() - t;
+        LOG_I("eph unshuffle row size %3d: ref: %.0f MB/s, new: %.0f MB/s",
+              size, (double)nb * size * nb_iter / t_ref * CLOCKS_PER_SEC / 1e6,
+              (double)nb * size * nb_iter / t * CLOCKS_PER_SEC / 1e6);
+        free(data);
+        free(out);
+    }
+}
+
+TEST_REGISTER(NULL, test_eph_read_table_columns, TEST_AUTO);
+TEST_REGISTER(NULL, test_eph_shuffle_bytes, TEST_AUTO);
+TEST_REGISTER(NULL, test_eph_read_compressed_block, TEST_AUTO);
+TEST_REGISTER(NULL, bench_eph_read_table, 0);
+TEST_REGISTER(NULL, bench_eph_codecs, 0);
+TEST_REGISTER(NULL, bench_eph_unshuffle, 0);
+
+#endif
@@ -27,11 +27,57 @@ int eph_load(const void *data, int data_size, void *user,
 int eph_read_tile_header(const void *data, int data_size, int *data_ofs,
                          int *version, int *order, int *pix);
 
+/*
+ * Enum: EPH_CODEC
+ * Compression algorithms of the eph file data blocks.
+ *
+ * Warning: don't change those values since they are also set in the data
+ * files!
+ *
+ * EPH_CODEC_ZLIB - Default, best compression ratio.
+ * EPH_CODEC_LZ4  - LZ4 block format, bigger but much faster to uncompress.
+ */
+enum {
+    EPH_CODEC_ZLIB      = 0,
+    EPH_CODEC_LZ4       = 1,
+};
+
 void *eph_read_compressed_block(const void *data, int data_size,
                                 int *data_ofs, int *size);
 
 void eph_shuffle_bytes(uint8_t *data, int nb, int size);
 
+/*
+ * Function: eph_unshuffle_bytes
+ * Inverse of <eph_shuffle_bytes>, out of place.
+ *
+ * Parameters:
+ *   src  - Shuffled data: size planes of nb bytes.
+ *   dst  - Output buffer for nb items of size bytes.
+ *   nb   - Number of items.
+ *   size - Size of each item in bytes.
+ */
+void eph_unshuffle_bytes(const uint8_t *src, uint8_t *dst, int nb, int size);
+
+/*
+ * Function: eph_read_table_data
+ * Read the compressed data block of a table, and unshuffle it if needed.
+ *
+ * Parameters:
+ *   data      - The chunk data.
+ *   data_size - Size of the chunk data.
+ *   data_ofs  - Offset of the compressed block.  Moved past the block.
+ *   flags     - Table flags, as returned by <eph_read_table_header>.
+ *   row_size  - Table row size, as returned by <eph_read_table_header>.
+ *   nb_rows   - Table number of rows.
+ *   size      - Receive the size of the data.
+ *
+ * Return:
+ *   The table data, with the rows contiguous.  NULL in case of error.
+ */
+void *eph_read_table_data(const void *data, int data_size, int *data_ofs,
+                          int flags, int row_size, int nb_rows, int *size);
+
 /*
  * Enum: EPH_UNIT
  * Represent the different unit we can use for eph file data.
@@ -75,4 +121,28 @@ int eph_read_table_row(const void *data, int data_size, int *data_ofs,
                        int nb_columns, const eph_table_column_t *columns,
                        ...);
 
+/*
+ * Function: eph_read_table_columns
+ * Read several rows of a table at once, one column at a time.
+ *
+ * This is the same as calling <eph_read_table_row> for each row, except
+ * that the values are written into one array per column, and that the
+ * units conversion is only resolved once per column.
+ *
+ * Parameters:
+ *   data       - The table data, not shuffled.
+ *   data_size  - Size of the data.
+ *   data_ofs   - Offset of the first row in the data.  Moved past the
+ *                last row read.
+ *   nb_rows    - Number of rows to read.
+ *   nb_columns - Number of columns.
+ *   columns    - The columns, as passed to <eph_read_table_header>.
+ *   ...        - For each column, an array of nb_rows values: int for 'i',
+ *                double for 'f', uint64_t for 'Q', and char[size] for 's'.
+ *                Can be NULL to skip a column.
+ */
+int eph_read_table_columns(const void *data, int data_size, int *data_ofs,
+                           int nb_rows, int nb_columns,
+                           const eph_table_column_t *columns, ...);
+
 #endif // EPH_FILE_H
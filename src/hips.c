@@ -10,15 +10,46 @@
 #include "swe.h"
 #include "ini.h"
 #include <string.h>
+#include <unistd.h>
 
 // Should be good enough...
 #define URL_MAX_SIZE 4096
 
 // Size of the cache allocated to all the hips tiles.
-// Note: we get into trouble if the tiles visible on screen actually use
-// more space than that.  We could use a more clever cache that can grow
-// past its limit if the items are still in use!
+// This is a soft limit: the tiles used during the current frame are pinned
+// in the cache, so that it can grow past CACHE_SIZE if the tiles visible on
+// screen need more space.  Above CACHE_HARD_SIZE the pinned tiles can get
+// evicted as well.
 #define CACHE_SIZE (256 * (1 << 20))
+#define CACHE_HARD_SIZE (1024 * (1 << 20))
+
+// Min time between two increases of the rendered order of a survey (sec).
+// During a fast zoom in, this way we show the lower order tiles first, and
+// don't fetch the high order tiles that would only be visible for a few
+// frames.  It is the same as the tiles fade in duration.
+#define ZOOM_ORDER_DELAY 0.25
+
+// Max number of tiles downloads scheduled at the same time.
+#define MAX_LOADS 16
+
+// Max number of tiles prefetched per survey and per frame, and priority
+// offset of the prefetched tiles, so that they are always loaded after the
+// tiles we actually render.
+#define MAX_PREFETCH 64
+#define PREFETCH_PRIORITY 100
+
+// Min time between two saves of the coverage of a survey (sec).
+#define COVERAGE_SAVE_DELAY 10
+
+// Max number of missing tiles we remember per survey.
+#define COVERAGE_MAX_MISSING (1 << 16)
+
+// Size of the atlas pages used for the tiles textures.  A page holds
+// 16 tiles of 512px.  Tiles bigger than half a page don't use the atlas.
+#define ATLAS_PAGE_SIZE 2048
+
+// Max number of atlases (one per tiles size and format).
+#define MAX_ATLASES 8
 
 // Flags of the tiles:
 enum {
@@ -36,24 +67,36 @@ enum {
     (TILE_NO_CHILD_0 | TILE_NO_CHILD_1 | TILE_NO_CHILD_2 | TILE_NO_CHILD_3)
 
 typedef struct tile tile_t;
+
+// Loader to parse the image of a tile in a thread.
+typedef struct tile_loader tile_loader_t;
+struct tile_loader {
+    worker_t        worker;
+    tile_loader_t   *prev, *next; // List of all the loaders.
+    tile_t          *tile;
+    const void      *data;
+    int             size;
+    asset_ref_t     *ref; // Reference to the asset data, if not copied.
+    int             flags; // Flags of the request, passed to create_tile.
+    const void      *result; // Data returned by create_tile.
+    int             cost;
+    int             transparency;
+    int             frame; // Last frame the tile was requested.
+};
+
 struct tile {
     struct {
         int order;
         int pix;
     } pos;
     hips_t      *hips;
-    fader_t     fader;
+    fader_t     fader; // Fade in of the tile texture over its parent.
+    double      fade_time; // Last update of the fader, zero if not started.
+    int         shift; // Decode shift of the data, see HIPS_DECODE_SHIFT.
     int         flags;
+    int         frame; // Last frame the tile was pinned.
     const void  *data;
-
-    // Loader to parse the image in a thread.
-    struct {
-        worker_t worker;
-        tile_t *tile;
-        void *data;
-        int size;
-        int cost;
-    } *loader;
+    tile_loader_t *loader;
 };
 
 /*
@@ -73,13 +116,128 @@ typedef struct {
 typedef struct {
     void        *img;
     int         w, h, bpp;
+    bool        compressed; // Set if img contains BC1 data.
     texture_t   *tex;
     texture_t   *allsky_tex;
+    int         upload_frame; // Last frame the upload was queued.
 } img_tile_t;
 
+/*
+ * Type: upload_t
+ * A tile texture waiting to be uploaded to the GPU.
+ *
+ * The textures of the tiles are not created as soon as the tiles are
+ * rendered: the uploads are queued during the frame and done after the
+ * rendering by <hips_process_uploads>, highest priority first, within a
+ * time and bytes budget.  Until then the parent tiles are rendered instead.
+ */
+typedef struct {
+    hips_t          *hips;
+    img_tile_t      *tile;
+    int             flags;
+    double          priority; // Lower values are uploaded first.
+} upload_t;
+
+/*
+ * Type: load_t
+ * A tile download waiting to be scheduled.
+ *
+ * The tiles requested for rendering are not downloaded immediately.  At
+ * the beginning of each frame we sort all the tiles requested during the
+ * previous frame by priority, and only start the first MAX_LOADS ones.
+ * The downloads of the tiles that were not requested anymore are canceled.
+ */
+typedef struct {
+    UT_hash_handle  hh;
+    tile_key_t      key;
+    char            *url;
+    double          priority; // Lower values are loaded first.
+    int             frame; // Last frame the tile was requested.
+    bool            started;
+} load_t;
+
+/*
+ * Type: missing_t
+ * A tile that we know doesn't exist, identified by its healpix nuniq value.
+ */
+typedef struct {
+    UT_hash_handle  hh;
+    uint64_t        nuniq;
+} missing_t;
+
+// States of the coverage of a survey.
+enum {
+    COVERAGE_INIT = 0,
+    COVERAGE_LOADING, // Waiting for the MOC file.
+    COVERAGE_READY,
+};
+
+// Flags of the saved coverage file.
+enum {
+    COVERAGE_HAS_MOC    = 1 << 0,
+    COVERAGE_NO_MOC     = 1 << 1, // The survey doesn't have a MOC.
+};
+
+/*
+ * Type: coverage_header_t
+ * Header of the local file where we save the coverage of a survey.  It is
+ * followed by the MOC ranges, and then the nuniq values of the tiles we
+ * found out don't exist, oldest first.
+ */
+typedef struct {
+    char        magic[4]; // "HCOV"
+    uint32_t    version;
+    uint32_t    flags;
+    uint32_t    nb_ranges;
+    uint32_t    nb_missing;
+    uint32_t    reserved;
+    double      release_date;
+} coverage_header_t;
+
 // Gobal cache for all the tiles.
 static cache_t *g_cache = NULL;
 
+static void create_cache(void)
+{
+    g_cache = cache_create(CACHE_SIZE);
+    cache_set_hard_size(g_cache, CACHE_HARD_SIZE);
+}
+
+// Current frame generation, used to pin the rendered tiles in the cache.
+static int g_frame = 1;
+// Time of the current frame (sec), used for the tiles faders.
+static double g_frame_time = 0;
+
+// All the pending tiles downloads, and all the tiles being parsed.
+static load_t *g_loads = NULL;
+static tile_loader_t *g_loaders = NULL;
+
+// Total size of the tiles data copied for the loaders.
+static int64_t g_copied_bytes = 0;
+
+// View direction in ICRS and observed frames, updated at each frame.
+static double g_view_dir[2][3] = {{1, 0, 0}, {1, 0, 0}};
+
+// List of all the created surveys.
+static hips_t *g_hips = NULL;
+
+// Set to compress the tiles textures, see <hips_set_compression>.
+static bool g_compress = false;
+
+// Tiles textures uploads queued during the current frame.
+static struct {
+    upload_t    *queue;
+    int         nb;
+    int         capacity;
+} g_uploads;
+
+// Atlases of the tiles textures, shared by all the surveys.  The slots are
+// released when the tiles get evicted from the cache.
+static struct {
+    int             w, h, bpp;
+    texture_atlas_t *atlas;
+} g_atlases[MAX_ATLASES];
+
 struct hips {
     char        *url;
     char        *service_url;
@@ -102,6 +260,30 @@ struct hips {
     int order;
     int order_min;
     int tile_width;
+    double importance; // Scale the tiles loading priority.
+
+    // Coverage of the survey, so that we don't request the tiles that
+    // don't exist.
+    struct {
+        int         state;
+        int         flags; // Union of COVERAGE_HAS_MOC and COVERAGE_NO_MOC.
+        moc_t       *moc;
+        missing_t   *missing; // Hash table, in insertion order.
+        bool        dirty; // Need to be saved.
+        double      save_time;
+    } coverage;
+
+    // Last frame we rendered some tiles, and max order of those tiles.
+    int pin_frame;
+    int pin_order;
+
+    // Current rendered order, and time of its last change.
+    struct {
+        int     order;
+        double  time;
+    } zoom;
+
+    hips_t *next; // Link in the list of all the surveys.
 
     // The settings as passed in the create function.
     hips_settings_t settings;
@@ -109,9 +291,12 @@ struct hips {
 
 
 static const void *create_img_tile(
-        void *user, int order, int pix, void *src, int size,
+        void *user, int order, int pix, void *src, int size, int flags,
         int *cost, int *transparency);
 static int delete_img_tile(void *tile);
+static tile_t *hips_get_tile_(hips_t *hips, int order, int pix, int flags,
+                              int *code);
+static void upgrade_tile(hips_t *hips, tile_t *tile, int flags);
 
 hips_t *hips_create(const char *url, double release_date,
                     const hips_settings_t *settings)
@@ -120,9 +305,18 @@ hips_t *hips_create(const char *url, double release_date,
         .create_tile = create_img_tile,
         .delete_tile = delete_img_tile,
     };
-    hips_t *hips = calloc(1, sizeof(*hips));
+    hips_t *hips = calloc(1, sizeof(*hips)), *other;
     if (!settings) settings = &default_settings;
 
+    // Local single file archives are served from the mapped file, using
+    // the archive path as base url.  Only open each archive once.
+    if (str_endswith(url, ".hipsa") && !strstr(url, "://")) {
+        LL_FOREACH(g_hips, other) {
+            if (strcmp(other->url, url) == 0) break;
+        }
+        if (!other) hips_archive_open(url, url);
+    }
+
     hips->settings = *settings;
     hips->url = strdup(url);
     hips->service_url = strdup(url);
@@ -130,7 +324,9 @@ hips_t *hips_create(const char *url, double release_date,
     hips->order_min = 3;
     hips->release_date = release_date;
     hips->frame = FRAME_ASTROM;
+    hips->importance = 1.0;
     hips->hash = crc64(0, url, strlen(url)) & 0xffffffff;
+    LL_PREPEND(g_hips, hips);
     return hips;
 }
 
@@ -139,6 +335,12 @@ void hips_set_frame(hips_t *hips, int frame)
     hips->frame = frame;
 }
 
+void hips_set_importance(hips_t *hips, double importance)
+{
+    assert(importance > 0);
+    hips->importance = importance;
+}
+
 // Get the url for a given file in the survey.
 // Automatically add ?v=<release_date> for online surveys.
 static const char *get_url_for(const hips_t *hips, char *buf,
@@ -209,7 +411,8 @@ static int parse_properties(hips_t *hips)
     char url[URL_MAX_SIZE];
     int code;
     get_url_for(hips, url, "properties");
-    data = asset_get_data2(url, ASSET_USED_ONCE, NULL, &code);
+    data = asset_get_data2(url, ASSET_USED_ONCE | ASSET_STALE_WHILE_REVALIDATE,
+                           NULL, &code);
     if (!data && code) {
         LOG_E("Cannot get hips properties file at '%s': %d", url, code);
         return -1;
@@ -220,6 +423,165 @@ static int parse_properties(hips_t *hips)
     return 0;
 }
 
+static void get_coverage_path(const hips_t *hips, char *buf, int size)
+{
+    snprintf(buf, size, "%s/.cache/hips/%08x.cov",
+             sys_get_user_dir(), hips->hash);
+}
+
+static void add_missing_nuniq(hips_t *hips, uint64_t nuniq)
+{
+    missing_t *missing;
+    HASH_FIND(hh, hips->coverage.missing, &nuniq, sizeof(nuniq), missing);
+    if (missing) return;
+    // Forget the oldest missing tile if we reached the limit.
+    if (HASH_COUNT(hips->coverage.missing) >= COVERAGE_MAX_MISSING) {
+        missing = hips->coverage.missing;
+        HASH_DEL(hips->coverage.missing, missing);
+        free(missing);
+    }
+    missing = calloc(1, sizeof(*missing));
+    missing->nuniq = nuniq;
+    HASH_ADD(hh, hips->coverage.missing, nuniq, sizeof(missing->nuniq),
+             missing);
+    hips->coverage.dirty = true;
+}
+
+// Remember that a tile doesn't exist.
+static void add_missing(hips_t *hips, int order, int pix)
+{
+    add_missing_nuniq(hips, (4ULL << (2 * order)) + pix);
+}
+
+// Remember the children of a tile flagged with TILE_NO_CHILD_x.
+static void add_missing_children(hips_t *hips, int order, int pix, int flags)
+{
+    int i;
+    if (order < 0 || (hips->order && order >= hips->order)) return;
+    for (i = 0; i < 4; i++) {
+        if (flags & (TILE_NO_CHILD_0 << i))
+            add_missing(hips, order + 1, pix * 4 + i);
+    }
+}
+
+// Test if a tile might exist, without doing any I/O.
+static bool tile_may_exist(hips_t *hips, int order, int pix)
+{
+    missing_t *missing;
+    uint64_t nuniq = (4ULL << (2 * order)) + pix;
+    if (hips->coverage.moc && !moc_intersects(hips->coverage.moc, order, pix))
+        return false;
+    HASH_FIND(hh, hips->coverage.missing, &nuniq, sizeof(nuniq), missing);
+    return !missing;
+}
+
+// Load the coverage saved from a previous session.
+static void load_coverage(hips_t *hips)
+{
+    char path[1024];
+    coverage_header_t header;
+    const uint64_t *values;
+    uint8_t *data;
+    int size, i;
+
+    get_coverage_path(hips, path, sizeof(path));
+    data = read_file(path, &size);
+    if (!data) return;
+    if (size < sizeof(header)) goto end;
+    memcpy(&header, data, sizeof(header));
+    if (    memcmp(header.magic, "HCOV", 4) != 0 || header.version != 1 ||
+            header.release_date != hips->release_date ||
+            size != sizeof(header) +
+                    ((int64_t)header.nb_ranges * 2 + header.nb_missing) * 8)
+        goto end;
+    values = (const uint64_t*)(data + sizeof(header));
+    if (header.flags & COVERAGE_HAS_MOC) {
+        hips->coverage.moc = moc_create();
+        for (i = 0; i < header.nb_ranges; i++)
+            moc_add_range(hips->coverage.moc, values[i * 2],
+                          values[i * 2 + 1]);
+    }
+    values += header.nb_ranges * 2;
+    for (i = 0; i < header.nb_missing; i++)
+        add_missing_nuniq(hips, values[i]);
+    hips->coverage.flags = header.flags;
+    hips->coverage.dirty = false;
+end:
+    free(data);
+}
+
+static void save_coverage(hips_t *hips)
+{
+    char path[1024], tmp_path[1024 + 4];
+    coverage_header_t header = {
+        .magic = "HCOV",
+        .version = 1,
+        .flags = hips->coverage.flags,
+        .release_date = hips->release_date,
+    };
+    const uint64_t (*ranges)[2] = NULL;
+    missing_t *missing, *tmp;
+    FILE *file;
+
+    hips->coverage.dirty = false;
+    hips->coverage.save_time = sys_get_unix_time();
+    if (hips->coverage.moc)
+        header.nb_ranges = moc_get_ranges(hips->coverage.moc, &ranges);
+    header.nb_missing = HASH_COUNT(hips->coverage.missing);
+
+    // Write into a temporary file first, so that we never get a partially
+    // written file.
+    get_coverage_path(hips, path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    sys_make_dir(path);
+    file = fopen(tmp_path, "wb");
+    if (!file) return;
+    fwrite(&header, sizeof(header), 1, file);
+    if (ranges) fwrite(ranges, sizeof(*ranges), header.nb_ranges, file);
+    HASH_ITER(hh, hips->coverage.missing, missing, tmp)
+        fwrite(&missing->nuniq, sizeof(missing->nuniq), 1, file);
+    if (fclose(file) || rename(tmp_path, path)) {
+        LOG_W("Cannot save hips coverage %s", path);
+        unlink(tmp_path);
+    }
+}
+
+// Get the coverage of the survey, first from the saved file, then from the
+// MOC file of the survey if we don't have it yet.
+static void update_coverage(hips_t *hips)
+{
+    char url[URL_MAX_SIZE];
+    const void *data;
+    int size, code;
+
+    if (hips->coverage.state == COVERAGE_READY) return;
+    if (hips->coverage.state == COVERAGE_INIT) {
+        hips->coverage.state = COVERAGE_LOADING;
+        load_coverage(hips);
+        if (hips->coverage.flags) {
+            hips->coverage.state = COVERAGE_READY;
+            return;
+        }
+    }
+    get_url_for(hips, url, "Moc.fits");
+    data = asset_get_data2(url, ASSET_USED_ONCE | ASSET_ACCEPT_404,
+                           &size, &code);
+    if (!code) return; // Still loading.
+    hips->coverage.state = COVERAGE_READY;
+    if (data) {
+        hips->coverage.moc = moc_create();
+        if (moc_parse_fits(hips->coverage.moc, data, size)) {
+            LOG_W("Cannot parse hips MOC %s", url);
+            moc_delete(hips->coverage.moc);
+            hips->coverage.moc = NULL;
+        }
+    }
+    // Only remember that there is no MOC if the server told us so.
+    if (hips->coverage.moc) hips->coverage.flags |= COVERAGE_HAS_MOC;
+    else if (code == 404) hips->coverage.flags |= COVERAGE_NO_MOC;
+    hips->coverage.dirty = true;
+}
+
 void get_child_uv_mat(int i, const double m[3][3], double out[3][3])
 {
     double tmp[3][3];
@@ -229,17 +591,39 @@ void get_child_uv_mat(int i, const double m[3][3], double out[3][3])
     mat3_copy(tmp, out);
 }
 
+// Release the tile data of a loader, once it has been parsed.
+static void loader_release_data(tile_loader_t *loader)
+{
+    if (loader->ref) asset_unref(loader->ref);
+    else free((void*)loader->data);
+    loader->ref = NULL;
+    loader->data = NULL;
+}
+
+static void loader_delete(tile_loader_t *loader)
+{
+    DL_DELETE(g_loaders, loader);
+    loader_release_data(loader);
+    free(loader);
+}
+
 // Used by the cache.
 static int del_tile(void *data)
 {
     tile_t *tile = data;
-    // XXX: why the worker_is_running?
+    // We cannot delete a tile while its worker is still queued or running.
     if (tile->loader && worker_is_running(&tile->loader->worker))
         return CACHE_KEEP;
+    // Don't evict the tiles used in the current frame, unless we reached
+    // the hard limit of the cache.
+    if (    tile->frame == g_frame &&
+            cache_get_current_size(g_cache) < CACHE_HARD_SIZE)
+        return CACHE_KEEP;
     if (tile->data) {
         if (tile->hips->settings.delete_tile(tile->data) == CACHE_KEEP)
             return CACHE_KEEP;
     }
+    if (tile->loader) loader_delete(tile->loader);
     free(tile);
     return 0;
 }
@@ -258,35 +642,171 @@ static bool img_is_transparent(
     return true;
 }
 
+static void iterator_push(hips_iterator_t *iter, int order, int pix)
+{
+    int i, capacity, mask = iter->capacity - 1;
+    typeof(iter->nodes) nodes;
+
+    if (iter->size == iter->capacity) {
+        capacity = iter->capacity ? iter->capacity * 2 : 256;
+        nodes = malloc(capacity * sizeof(*nodes));
+        for (i = 0; i < iter->size; i++)
+            nodes[i] = iter->nodes[(iter->start + i) & mask];
+        free(iter->nodes);
+        iter->nodes = nodes;
+        iter->capacity = capacity;
+        iter->start = 0;
+        mask = capacity - 1;
+    }
+    i = (iter->start + iter->size++) & mask;
+    iter->nodes[i].order = order;
+    iter->nodes[i].pix = pix;
+}
+
+void hips_iterator_init(hips_iterator_t *iter, int mode)
+{
+    int i;
+    iter->mode = mode;
+    iter->start = 0;
+    iter->size = 0;
+    // In depth first mode we pop from the back, so push in reverse order.
+    for (i = 0; i < 12; i++)
+        iterator_push(iter, 0, mode == HIPS_ITER_DFS ? 11 - i : i);
+}
+
+bool hips_iterator_next(hips_iterator_t *iter, int *order, int *pix)
+{
+    int i;
+    if (!iter->size) return false;
+    if (iter->mode == HIPS_ITER_DFS) {
+        i = (iter->start + iter->size - 1) & (iter->capacity - 1);
+    } else {
+        i = iter->start;
+        iter->start = (iter->start + 1) & (iter->capacity - 1);
+    }
+    iter->size--;
+    *order = iter->nodes[i].order;
+    *pix = iter->nodes[i].pix;
+    return true;
+}
+
+void hips_iterator_push_children(hips_iterator_t *iter, int order, int pix)
+{
+    int i;
+    for (i = 0; i < 4; i++) {
+        iterator_push(iter, order + 1, pix * 4 +
+                      (iter->mode == HIPS_ITER_DFS ? 3 - i : i));
+    }
+}
+
+void hips_iterator_release(hips_iterator_t *iter)
+{
+    free(iter->nodes);
+    memset(iter, 0, sizeof(*iter));
+}
+
 int hips_traverse(void *user, int callback(int order, int pix, void *user))
 {
-    typedef struct {
-        int order;
-        int pix;
-    } node_t;
-    node_t queue[1024];
-    const int n = ARRAY_SIZE(queue);
-    int start = 0, size = 12, r, i;
-    int order, pix;
-    // Enqueue the first 12 pix at order 0.
-    for (i = 0; i < 12; i++) {queue[i] = (node_t){0, i};}
-    while (size) {
-        order = queue[start % n].order;
-        pix = queue[start % n].pix;
-        start++;
-        size--;
+    hips_iterator_t iter = {};
+    int order, pix, r = 0;
+
+    hips_iterator_init(&iter, HIPS_ITER_BFS);
+    while (hips_iterator_next(&iter, &order, &pix)) {
         r = callback(order, pix, user);
-        if (r < 0) return r;
-        if (r == 1) {
-            // Enqueue the 4 children tiles.
-            if (size + 4 >= n) return -1; // No more space.
-            for (i = 0; i < 4; i++) {
-                queue[(start + size) % n] = (node_t){order + 1, pix * 4 + i};
-                size++;
-            }
+        if (r < 0) break;
+        if (r == 1) hips_iterator_push_children(&iter, order, pix);
+    }
+    hips_iterator_release(&iter);
+    return min(r, 0);
+}
+
+// Create the texture of a tile, in an atlas page if possible.
+static texture_t *create_tile_texture(const hips_t *hips,
+                                      const img_tile_t *tile, int flags)
+{
+    texture_t *tex;
+    int i;
+    // The atlas pages are not compressed.
+    if (tile->compressed) {
+        tex = texture_from_bc1(tile->img, tile->w, tile->h, 0);
+        texture_set_owner(tex, TEX_CAT_HIPS, hips);
+        return tex;
+    }
+    if (    !(flags & HIPS_USE_ATLAS) ||
+            tile->w > ATLAS_PAGE_SIZE / 2 || tile->h > ATLAS_PAGE_SIZE / 2)
+        goto no_atlas;
+    for (i = 0; i < MAX_ATLASES; i++) {
+        if (!g_atlases[i].atlas) {
+            g_atlases[i].w = tile->w;
+            g_atlases[i].h = tile->h;
+            g_atlases[i].bpp = tile->bpp;
+            g_atlases[i].atlas = texture_atlas_create(
+                    ATLAS_PAGE_SIZE, tile->w, tile->h, tile->bpp);
+            texture_atlas_set_owner(g_atlases[i].atlas, TEX_CAT_HIPS, NULL);
         }
+        if (    g_atlases[i].w == tile->w && g_atlases[i].h == tile->h &&
+                g_atlases[i].bpp == tile->bpp)
+            return texture_atlas_add(g_atlases[i].atlas, tile->img);
     }
-    return 0;
+
+no_atlas:
+    tex = texture_from_data(tile->img, tile->w, tile->h, tile->bpp,
+                            0, 0, tile->w, tile->h, 0);
+    texture_set_owner(tex, TEX_CAT_HIPS, hips);
+    return tex;
+}
+
+static double get_tile_priority(const hips_t *hips, int order, int pix);
+
+static void queue_upload(hips_t *hips, img_tile_t *tile,
+                         int order, int pix, int flags)
+{
+    upload_t *upload;
+    if (tile->upload_frame == g_frame) return;
+    tile->upload_frame = g_frame;
+    if (g_uploads.nb == g_uploads.capacity) {
+        g_uploads.capacity = g_uploads.capacity ? g_uploads.capacity * 2 : 64;
+        g_uploads.queue = realloc(g_uploads.queue,
+                g_uploads.capacity * sizeof(*g_uploads.queue));
+    }
+    upload = &g_uploads.queue[g_uploads.nb++];
+    upload->hips = hips;
+    upload->tile = tile;
+    upload->flags = flags;
+    upload->priority = get_tile_priority(hips, order, pix);
+}
+
+// Return whether the texture of a tile is ready, and if not queue its
+// upload.
+static bool tile_has_texture(hips_t *hips, img_tile_t *tile,
+                             int order, int pix, int flags)
+{
+    if (!tile) return false;
+    if (tile->tex) return true;
+    if (tile->img) queue_upload(hips, tile, order, pix, flags);
+    return false;
+}
+
+// Update the fader of a tile which texture is ready, and return its value.
+// The fader starts the first time we see the texture.
+static double update_tile_fader(tile_t *tile)
+{
+    if (!tile->fade_time) {
+        fader_init(&tile->fader, false);
+        tile->fader.target = true;
+    } else {
+        fader_update(&tile->fader, g_frame_time - tile->fade_time);
+    }
+    tile->fade_time = g_frame_time;
+    return tile->fader.value;
+}
+
+// Mark the fade in of a tile as done.  Used for the tiles rendered as a
+// fallback for their children, so that they don't fade in later on.
+static void finish_tile_fader(tile_t *tile)
+{
+    fader_init(&tile->fader, true);
+    tile->fade_time = g_frame_time;
 }
 
 // Get the texture for a given hips tile.
@@ -305,6 +825,8 @@ texture_t *hips_get_tile_texture(
     PROFILE(hips_get_tile_texture, PROFILE_AGGREGATE)
     texture_t *tex;
     img_tile_t *tile, *render_tile;
+    tile_t *render_t;
+    bool skip = flags & HIPS_PARENT_ONLY;
     const double UV_OUT[4][2] = {{0, 0}, {0, 1}, {1, 0}, {1, 1}};
     const double UV_IN [4][2] = {{0, 0}, {1, 0}, {0, 1}, {1, 1}};
     double mat[3][3];
@@ -325,36 +847,37 @@ texture_t *hips_get_tile_texture(
     // If the texture is not ready yet, we still set the values, so that
     // the caller can render a fallback color instead.
     if (!hips_is_ready(hips)) return NULL;
+    if (skip && order <= hips->order_min) return NULL;
 
-    tile = hips_get_tile(hips, order, pix, flags, &code);
+    render_t = hips_get_tile_(hips, order, pix, flags, &code);
+    tile = render_t ? render_t->data : NULL;
     if (!tile && code && code != 598) { // The tile doesn't exists
         if (loading_complete) *loading_complete = true;
         return NULL;
     }
-
-    // If the tile is not loaded yet, we try to use a parent tile texture
-    // instead.
+    // Decode the tile again if it was decoded at a lower resolution than
+    // we need now.
+    if (    tile && !skip && !(flags & HIPS_FORCE_USE_ALLSKY) &&
+            HIPS_GET_DECODE_SHIFT(flags) < render_t->shift)
+        upgrade_tile(hips, render_t, flags);
+
+    // If the tile is not loaded or its texture not uploaded yet, we try to
+    // use a parent tile texture instead.
     render_tile = tile;
-    while (!(render_tile) && (order > hips->order_min)) {
+    while ((skip || !tile_has_texture(hips, render_tile, order, pix, flags))
+            && (order > hips->order_min)) {
+        skip = false;
         mat3_set_identity(mat);
         get_child_uv_mat(pix % 4, mat, mat);
         if (uv) for (i = 0; i < 4; i++) mat3_mul_vec2(mat, uv[i], uv[i]);
         order -= 1;
         pix /= 4;
-        render_tile = hips_get_tile(hips, order, pix, flags, &code);
+        render_t = hips_get_tile_(hips, order, pix, flags, &code);
+        render_tile = render_t ? render_t->data : NULL;
     }
     if (!render_tile) return NULL;
     if (loading_complete && tile == render_tile) *loading_complete = true;
 
-    // Create texture if needed.
-    if (render_tile->img && !render_tile->tex) {
-        render_tile->tex = texture_from_data(render_tile->img,
-                render_tile->w, render_tile->h, render_tile->bpp,
-                0, 0, render_tile->w, render_tile->h, 0);
-        free(render_tile->img);
-        render_tile->img = NULL;
-    }
-
     // Create allsky texture if needed.
     if (    (flags & HIPS_FORCE_USE_ALLSKY) &&
             order == hips->order_min &&
@@ -368,6 +891,7 @@ texture_t *hips_get_tile_texture(
                 hips->allsky.data, hips->allsky.w, hips->allsky.h,
                 hips->allsky.bpp,
                 x, y, hips->allsky.w / nbw, hips->allsky.w / nbw, 0);
+        texture_set_owner(render_tile->allsky_tex, TEX_CAT_HIPS, hips);
     }
 
     tex = render_tile->tex ?: render_tile->allsky_tex;
@@ -377,27 +901,53 @@ texture_t *hips_get_tile_texture(
     if (split)
         *split = (flags & HIPS_FORCE_USE_ALLSKY) ? 4 : max(4, 12 >> order);
     if (fade) *fade = 1.0;
+    // Only the requested tile fades in, the parent tiles used as fallback
+    // are rendered fully opaque.
+    if (render_tile->tex && render_tile == tile) {
+        if (update_tile_fader(render_t) < 1.0 && fade &&
+                (flags & HIPS_FADE_IN))
+            *fade = render_t->fader.value;
+    } else if (render_tile->tex) {
+        finish_tile_fader(render_t);
+    }
     return tex;
 }
 
+// Tiles counters for the progressbar.
+typedef struct {
+    int nb_tot;
+    int nb_loaded;
+} render_stats_t;
+
 static int render_visitor(hips_t *hips, const painter_t *painter_,
                           int order, int pix, int flags, void *user)
 {
-    int *nb_tot = USER_GET(user, 0);
-    int *nb_loaded = USER_GET(user, 1);
+    render_stats_t *stats = user;
     painter_t painter = *painter_;
-    texture_t *tex;
-    projection_t proj;
-    int split;
+    texture_t *tex, *parent_tex;
+    projection_t proj, parent_proj;
+    int split, parent_split;
     bool loaded;
-    double fade, uv[4][2];
+    double fade, uv[4][2], parent_uv[4][2];
 
-    flags |= HIPS_LOAD_IN_THREAD;
-    (*nb_tot)++;
+    flags |= HIPS_LOAD_IN_THREAD | HIPS_USE_ATLAS | HIPS_FADE_IN;
+    if (g_compress && texture_bc1_supported()) flags |= HIPS_COMPRESS;
+    stats->nb_tot++;
     tex = hips_get_tile_texture(hips, order, pix, flags,
                                 uv, &proj, &split, &fade, &loaded);
-    if (loaded) (*nb_loaded)++;
+    if (loaded) stats->nb_loaded++;
     if (!tex) return 0;
+    // While the texture fades in, we render the parent texture under it.
+    // Since the parent tile is pinned in the cache, it stays available
+    // until the end of the fade.
+    if (fade < 1.0) {
+        parent_tex = hips_get_tile_texture(
+                hips, order, pix, flags | HIPS_PARENT_ONLY,
+                parent_uv, &parent_proj, &parent_split, NULL, NULL);
+        if (parent_tex)
+            paint_quad(&painter, hips->frame, parent_tex, NULL, parent_uv,
+                       &parent_proj, parent_split);
+    }
     painter.color[3] *= fade;
     paint_quad(&painter, hips->frame, tex, NULL, uv, &proj, split);
     return 0;
@@ -407,33 +957,12 @@ static int render_visitor(hips_t *hips, const painter_t *painter_,
 int hips_render(hips_t *hips, const painter_t *painter, double angle)
 {
     PROFILE(hips_render, 0);
-    int nb_tot = 0, nb_loaded = 0;
+    render_stats_t stats = {};
     if (painter->color[3] == 0.0) return 0;
     if (!hips_is_ready(hips)) return 0;
-    hips_render_traverse(hips, painter, angle,
-                         USER_PASS(&nb_tot, &nb_loaded),
-                         render_visitor);
-    progressbar_report(hips->url, hips->label, nb_loaded, nb_tot, -1);
-    return 0;
-}
-
-static int render_traverse_visitor(int order, int pix, void *user)
-{
-    PROFILE(render_traverse_visitor, PROFILE_AGGREGATE);
-    hips_t *hips = USER_GET(user, 0);
-    const painter_t *painter = USER_GET(user, 1);
-    int render_order = *(int*)USER_GET(user, 2);
-    int flags = *(int*)USER_GET(user, 3);
-    int (*callback)(
-        hips_t *hips, const painter_t *painter,
-        int order, int pix, int flags, void *user) = USER_GET(user, 4);
-    const bool outside = !(flags & HIPS_EXTERIOR);
-    user = USER_GET(user, 5);
-    // Early exit if the tile is clipped.
-    if (painter_is_tile_clipped(painter, hips->frame, order, pix, outside))
-        return 0;
-    if (order < render_order) return 1; // Keep going.
-    callback(hips, painter, order, pix, flags, user);
+    hips_render_traverse(hips, painter, angle, &stats, render_visitor);
+    progressbar_report(hips->url, hips->label,
+                       stats.nb_loaded, stats.nb_tot, -1);
     return 0;
 }
 
@@ -484,13 +1013,16 @@ static bool hips_update(hips_t *hips)
         if (!hips->properties) return false;
         init_label(hips);
     }
+    // The coverage is loaded in parallel, we don't need to wait for it.
+    update_coverage(hips);
 
     // Get the allsky before anything else if available.
     if (!hips->allsky.not_available && !hips->allsky.data) {
         asprintf(&url, "%s/Norder%d/Allsky.%s?v=%d", hips->service_url,
                  hips->order_min, hips->ext,
                  (int)hips->release_date);
-        data = asset_get_data2(url, ASSET_USED_ONCE, &size, &code);
+        data = asset_get_data2(url, ASSET_USED_ONCE |
+                               ASSET_STALE_WHILE_REVALIDATE, &size, &code);
         if (code && !data) hips->allsky.not_available = true;
         if (data) {
             hips->allsky.data = img_read_from_mem(data, size,
@@ -518,10 +1050,13 @@ int hips_render_traverse(
         int (*callback)(hips_t *hips, const painter_t *painter,
                         int order, int pix, int flags, void *user))
 {
-    int render_order;
+    // Only used from the main thread, so we can keep the same iterator.
+    static hips_iterator_t iter = {};
+    int render_order, order, pix, shift;
     double pix_per_rad;
     double w, px; // Size in pixel of the total survey.
     int flags = 0;
+    bool outside;
     hips_update(hips);
     // XXX: is that the proper way to compute it??
     pix_per_rad = painter->fb_size[0] / atan(painter->proj->scaling[0]) / 2;
@@ -534,10 +1069,41 @@ int hips_render_traverse(
     // we don't download too much data.
     if (render_order < -5 && hips->allsky.data)
         flags |= HIPS_FORCE_USE_ALLSKY;
+    // If the tiles are rendered smaller than their size, we can decode them
+    // at a lower resolution.  Only webp images support it.
+    if (strcmp(hips->ext, "webp") == 0) {
+        shift = clamp(hips->order_min - render_order, 0, 3);
+        flags |= HIPS_DECODE_SHIFT(shift);
+    }
     render_order = clamp(render_order, hips->order_min, hips->order);
-    // XXX: would be nice to have a non callback API for hips_traverse!
-    hips_traverse(USER_PASS(hips, painter, &render_order, &flags,
-                            callback, user), render_traverse_visitor);
+    // Only go one order higher at a time during a zoom in, see
+    // ZOOM_ORDER_DELAY.
+    if (hips->zoom.time && render_order > hips->zoom.order) {
+        if (g_frame_time - hips->zoom.time < ZOOM_ORDER_DELAY)
+            render_order = hips->zoom.order;
+        else
+            render_order = hips->zoom.order + 1;
+    }
+    if (!hips->zoom.time || render_order != hips->zoom.order) {
+        hips->zoom.order = render_order;
+        hips->zoom.time = g_frame_time;
+    }
+    // Make sure the tiles we render stay in the cache for this frame.
+    flags |= HIPS_PIN;
+    outside = !(flags & HIPS_EXTERIOR);
+
+    hips_iterator_init(&iter, HIPS_ITER_BFS);
+    while (hips_iterator_next(&iter, &order, &pix)) {
+        // Skip if the tile is clipped.
+        if (painter_is_tile_clipped(painter, hips->frame, order, pix,
+                                    outside))
+            continue;
+        if (order < render_order) { // Keep going.
+            hips_iterator_push_children(&iter, order, pix);
+            continue;
+        }
+        callback(hips, painter, order, pix, flags, user);
+    }
     return 0;
 }
 
@@ -583,21 +1149,172 @@ next:
     return nb;
 }
 
+// The result is only set to the tile from the main thread, so that we can
+// keep using the current data of a tile while we decode it again.
 static int load_tile_worker(worker_t *worker)
 {
-    int transparency = 0;
-    typeof(((tile_t*)0)->loader) loader = (void*)worker;
+    tile_loader_t *loader = (void*)worker;
     tile_t *tile = loader->tile;
     hips_t *hips = tile->hips;
-    tile->data = hips->settings.create_tile(
+    loader->result = hips->settings.create_tile(
                     hips->settings.user, tile->pos.order, tile->pos.pix,
-                    loader->data, loader->size, &loader->cost, &transparency);
-    if (!tile->data) tile->flags |= TILE_LOAD_ERROR;
-    tile->flags |= (transparency * TILE_NO_CHILD_0);
-    free(loader->data);
+                    (void*)loader->data, loader->size, loader->flags,
+                    &loader->cost, &loader->transparency);
+    loader_release_data(loader);
     return 0;
 }
 
+// Must be called before the asset is released.
+static void add_loader(tile_t *tile, const char *url, const void *data,
+                       int size, int flags)
+{
+    void *copy;
+    tile->loader = calloc(1, sizeof(*tile->loader));
+    worker_init(&tile->loader->worker, load_tile_worker);
+    // Keep a reference to the asset data if possible (for example for
+    // local files), otherwise we need a copy.
+    tile->loader->ref = asset_ref(url);
+    if (tile->loader->ref) {
+        tile->loader->data = data;
+    } else {
+        copy = malloc(size);
+        memcpy(copy, data, size);
+        tile->loader->data = copy;
+        g_copied_bytes += size;
+    }
+    tile->loader->size = size;
+    tile->loader->flags = flags;
+    tile->loader->tile = tile;
+    tile->loader->frame = g_frame;
+    DL_APPEND(g_loaders, tile->loader);
+}
+
+// Set the result of a finished loader to its tile.
+static void finish_loader(tile_t *tile, const tile_key_t *key)
+{
+    tile_loader_t *loader = tile->loader;
+    hips_t *hips = tile->hips;
+
+    // Sharper version of the tile data.  If the decoding failed we keep
+    // the current one.
+    if (tile->data && loader->result) {
+        hips->settings.delete_tile((void*)tile->data);
+        tile->data = NULL;
+    }
+    if (!tile->data) {
+        tile->data = loader->result;
+        if (!tile->data) tile->flags |= TILE_LOAD_ERROR;
+        tile->flags |= (loader->transparency * TILE_NO_CHILD_0);
+        cache_set_cost(g_cache, key, sizeof(*key), loader->cost);
+    }
+    tile->shift = HIPS_GET_DECODE_SHIFT(loader->flags);
+    add_missing_children(hips, key->order, key->pix, tile->flags);
+    loader_delete(loader);
+    tile->loader = NULL;
+}
+
+// Decode a tile again at a higher resolution.  We keep using the current
+// data until the new one is ready.
+static void upgrade_tile(hips_t *hips, tile_t *tile, int flags)
+{
+    char url[URL_MAX_SIZE];
+    const void *data;
+    int size, code, order = tile->pos.order, pix = tile->pos.pix;
+
+    if (tile->loader) return;
+    get_url_for(hips, url, "Norder%d/Dir%d/Npix%d.%s",
+                order, (pix / 10000) * 10000, pix, hips->ext);
+    data = asset_get_data2(url, ASSET_ACCEPT_404, &size, &code);
+    if (!data) return; // Still loading, or error.
+    add_loader(tile, url, data, size,
+               flags & (HIPS_DECODE_SHIFT_MASK | HIPS_COMPRESS));
+    asset_release(url);
+}
+
+// Compute the loading priority of a tile.  Lower values are loaded first.
+// We load the low orders first, since they are needed before their
+// children, then the tiles closer to the center of the screen.
+static double get_tile_priority(const hips_t *hips, int order, int pix)
+{
+    double pos[3], sep;
+    const double *view;
+    healpix_pix2vec(1 << order, pix, pos);
+    view = g_view_dir[hips->frame == FRAME_OBSERVED ? 1 : 0];
+    sep = acos(clamp(vec3_dot(pos, view), -1.0, 1.0));
+    return (order + sep / M_PI) / hips->importance;
+}
+
+// Get or create the scheduled download of a tile.
+static load_t *get_load(hips_t *hips, const tile_key_t *key,
+                        const char *url, int flags)
+{
+    load_t *load;
+    double priority;
+
+    priority = get_tile_priority(hips, key->order, key->pix);
+    if (flags & HIPS_PREFETCH) priority += PREFETCH_PRIORITY;
+    HASH_FIND(hh, g_loads, key, sizeof(*key), load);
+    if (!load) {
+        load = calloc(1, sizeof(*load));
+        load->key = *key;
+        load->url = strdup(url);
+        HASH_ADD(hh, g_loads, key, sizeof(load->key), load);
+    }
+    // Keep the highest priority if the tile is requested several times
+    // during the same frame.
+    if (load->frame != g_frame || priority < load->priority)
+        load->priority = priority;
+    load->frame = g_frame;
+    return load;
+}
+
+static void remove_load(const tile_key_t *key)
+{
+    load_t *load;
+    HASH_FIND(hh, g_loads, key, sizeof(*key), load);
+    if (!load) return;
+    HASH_DEL(g_loads, load);
+    free(load->url);
+    free(load);
+}
+
+static int load_cmp(void *a, void *b)
+{
+    return cmp(((load_t*)a)->priority, ((load_t*)b)->priority);
+}
+
+// Called at the beginning of each frame to cancel all the work on the
+// tiles that have not been requested during the last frame, and start the
+// downloads with the highest priority.
+static void schedule_loads(void)
+{
+    load_t *load, *tmp;
+    tile_loader_t *loader;
+    int nb_started = 0;
+
+    HASH_ITER(hh, g_loads, load, tmp) {
+        if (load->frame == g_frame) {
+            if (load->started) nb_started++;
+            continue;
+        }
+        if (load->started) asset_release(load->url);
+        remove_load(&load->key);
+    }
+
+    HASH_SORT(g_loads, load_cmp);
+    HASH_ITER(hh, g_loads, load, tmp) {
+        if (nb_started >= MAX_LOADS) break;
+        if (load->started) continue;
+        load->started = true;
+        nb_started++;
+    }
+
+    // The canceled workers get queued again if we need them later.
+    DL_FOREACH(g_loaders, loader) {
+        if (loader->frame != g_frame) worker_cancel(&loader->worker);
+    }
+}
+
 static tile_t *hips_get_tile_(hips_t *hips, int order, int pix, int flags,
                               int *code)
 {
@@ -613,15 +1330,23 @@ static tile_t *hips_get_tile_(hips_t *hips, int order, int pix, int flags,
     assert(order >= 0);
     *code = 0;
 
-    if (!g_cache) g_cache = cache_create(CACHE_SIZE);
+    if ((flags & HIPS_PIN) && key.order >= 0) {
+        if (hips->pin_frame != g_frame) hips->pin_order = order;
+        hips->pin_frame = g_frame;
+        hips->pin_order = max(hips->pin_order, order);
+    }
+
+    if (!g_cache) create_cache();
     tile = cache_get(g_cache, &key, sizeof(key));
+    if (tile && (flags & HIPS_PIN)) tile->frame = g_frame;
 
-    // Got a tile but it is still loading.
+    // Got a tile but it is still loading, or decoded again.
     if (tile && tile->loader) {
-        if (!worker_iter(&tile->loader->worker)) return NULL;
-        cache_set_cost(g_cache, &key, sizeof(key), tile->loader->cost);
-        free(tile->loader);
-        tile->loader = NULL;
+        tile->loader->frame = g_frame;
+        if (worker_iter(&tile->loader->worker))
+            finish_loader(tile, &key);
+        else if (!tile->data)
+            return NULL;
     }
     if (tile) {
         *code = 200;
@@ -637,8 +1362,14 @@ static tile_t *hips_get_tile_(hips_t *hips, int order, int pix, int flags,
     }
 
     // Skip if we already know that this tile doesn't exists.
+    if (!tile_may_exist(hips, order, pix)) {
+        *code = 404;
+        return NULL;
+    }
     if (order > hips->order_min) {
-        parent = hips_get_tile_(hips, order - 1, pix / 4, 0, &parent_code);
+        parent = hips_get_tile_(hips, order - 1, pix / 4,
+                                flags & (HIPS_PIN | HIPS_PREFETCH),
+                                &parent_code);
         if (!parent) return NULL; // Always get parent first.
         if (parent->flags & (TILE_NO_CHILD_0 << (pix % 4))) {
             *code = 404;
@@ -647,14 +1378,23 @@ static tile_t *hips_get_tile_(hips_t *hips, int order, int pix, int flags,
     }
     get_url_for(hips, url, "Norder%d/Dir%d/Npix%d.%s",
                 order, (pix / 10000) * 10000, pix, hips->ext);
-    asset_flags = ASSET_ACCEPT_404;
-    if (order > 0) asset_flags |= ASSET_DELAY;
+    // An outdated tile is better than nothing while we check it.
+    asset_flags = ASSET_ACCEPT_404 | ASSET_STALE_WHILE_REVALIDATE;
+    // The tiles requested for rendering or prefetched go through the
+    // scheduler, the other ones are directly loaded after a delay.
+    if (flags & (HIPS_PIN | HIPS_PREFETCH)) {
+        if (!get_load(hips, &key, url, flags)->started) return NULL;
+    } else if (order > 0) {
+        asset_flags |= ASSET_DELAY;
+    }
     data = asset_get_data2(url, asset_flags, &size, code);
     if (!(*code)) return NULL; // Still loading the file.
+    remove_load(&key);
 
     // If the tile doesn't exists, mark it in the parent tile so that we
     // won't have to search for it again.
     if ((*code) == 404) {
+        add_missing(hips, order, pix);
         if (order > hips->order_min) {
             parent = hips_get_tile_(hips, order - 1, pix / 4, 0, &parent_code);
             if (parent) parent->flags |= (TILE_NO_CHILD_0 << (pix % 4));
@@ -674,26 +1414,24 @@ static tile_t *hips_get_tile_(hips_t *hips, int order, int pix, int flags,
     tile->pos.order = order;
     tile->pos.pix = pix;
     tile->hips = hips;
+    tile->shift = HIPS_GET_DECODE_SHIFT(flags);
+    if (flags & HIPS_PIN) tile->frame = g_frame;
     cache_add(g_cache, &key, sizeof(key), tile, sizeof(*tile) + cost,
               del_tile);
 
     if (!(flags & HIPS_LOAD_IN_THREAD)) {
         tile->data = hips->settings.create_tile(
-                hips->settings.user, order, pix, data, size,
+                hips->settings.user, order, pix, data, size, flags,
                 &cost, &transparency);
         tile->flags |= (transparency * TILE_NO_CHILD_0);
+        add_missing_children(hips, order, pix, tile->flags);
         if (!tile->data) {
             LOG_W("Cannot parse tile %s", url);
             tile->flags |= TILE_LOAD_ERROR;
         }
         asset_release(url);
     } else {
-        tile->loader = calloc(1, sizeof(*tile->loader));
-        worker_init(&tile->loader->worker, load_tile_worker);
-        tile->loader->data = malloc(size);
-        tile->loader->size = size;
-        tile->loader->tile = tile;
-        memcpy(tile->loader->data, data, size);
+        add_loader(tile, url, data, size, flags);
         asset_release(url);
         *code = 0;
         return NULL;
@@ -718,13 +1456,14 @@ const void *hips_add_manual_tile(hips_t *hips, int order, int pix,
     tile_t *tile;
     tile_key_t key = {hips->hash, order, pix};
 
-    if (!g_cache) g_cache = cache_create(CACHE_SIZE);
+    if (!g_cache) create_cache();
     tile = cache_get(g_cache, &key, sizeof(key));
     assert(!tile);
 
     assert(hips->settings.create_tile);
     tile_data = hips->settings.create_tile(
-            hips->settings.user, order, pix, data, size, &cost, &transparency);
+            hips->settings.user, order, pix, data, size, 0,
+            &cost, &transparency);
     assert(tile_data);
 
     tile = calloc(1, sizeof(*tile));
@@ -743,7 +1482,7 @@ const void *hips_add_manual_tile(hips_t *hips, int order, int pix,
  * Default tile support for images surveys
  */
 static const void *create_img_tile(
-        void *user, int order, int pix, void *data, int size,
+        void *user, int order, int pix, void *data, int size, int flags,
         int *cost, int *transparency)
 {
     void *img;
@@ -756,7 +1495,8 @@ static const void *create_img_tile(
         return tile;
     }
 
-    img = img_read_from_mem(data, size, &w, &h, &bpp);
+    img = img_read_from_mem_scaled(data, size, HIPS_GET_DECODE_SHIFT(flags),
+                                   &w, &h, &bpp);
     if (!img) {
         LOG_W("Cannot parse img");
         return NULL;
@@ -774,18 +1514,156 @@ static const void *create_img_tile(
         }
     }
     *cost = w * h * bpp;
+
+    // BC1 only has one bit of alpha, so we only compress the opaque tiles.
+    if (    (flags & HIPS_COMPRESS) && bpp == 3 &&
+            w >= 4 && h >= 4 && !(w & (w - 1)) && !(h & (h - 1))) {
+        tile->img = malloc(bc1_get_size(w, h));
+        bc1_encode(img, w, h, bpp, tile->img);
+        tile->compressed = true;
+        free(img);
+        *cost = bc1_get_size(w, h);
+    }
     return tile;
 }
 
 static int delete_img_tile(void *tile_)
 {
     img_tile_t *tile = tile_;
+    int i;
+    if (tile->upload_frame == g_frame) {
+        for (i = 0; i < g_uploads.nb; i++) {
+            if (g_uploads.queue[i].tile != tile) continue;
+            g_uploads.queue[i] = g_uploads.queue[--g_uploads.nb];
+            break;
+        }
+    }
     texture_release(tile->tex);
     texture_release(tile->allsky_tex);
     free(tile);
     return 0;
 }
 
+void hips_begin_frame(const observer_t *obs)
+{
+    double dir[3];
+    hips_t *hips;
+    // Compute the view direction, used for the tiles loading priority.
+    eraS2c(obs->azimuth, obs->altitude, dir);
+    vec3_copy(dir, g_view_dir[1]);
+    mat3_mul_vec3(obs->rh2i, dir, g_view_dir[0]);
+    schedule_loads();
+    g_frame++;
+    g_frame_time = sys_get_unix_time();
+    // The tiles pinned by the last frame can be evicted again.
+    if (g_cache) cache_retry_cleanup(g_cache);
+    // The uploads not done at the previous frame are queued again if the
+    // tiles are still visible.
+    g_uploads.nb = 0;
+
+    // Save the coverage we learned.
+    LL_FOREACH(g_hips, hips) {
+        if (    hips->coverage.dirty && sys_get_unix_time() >
+                hips->coverage.save_time + COVERAGE_SAVE_DELAY)
+            save_coverage(hips);
+    }
+}
+
+typedef struct {
+    hips_t  *hips;
+    int     order;
+    int     nb;
+    double  dir[2][3]; // Predicted direction in ICRS and observed frames.
+    double  radius;
+} prefetch_t;
+
+static int prefetch_visitor(int order, int pix, void *user)
+{
+    prefetch_t *d = user;
+    double pos[3], sep;
+    int code;
+
+    healpix_pix2vec(1 << order, pix, pos);
+    sep = eraSepp(pos, d->dir[d->hips->frame == FRAME_OBSERVED ? 1 : 0]);
+    // Rough bounding radius of the tile.
+    if (sep > d->radius + 1.5 / (1 << order)) return 0;
+    if (order < d->order) return 1;
+    if (d->nb++ >= MAX_PREFETCH) return -1;
+    hips_get_tile_(d->hips, order, pix, HIPS_PREFETCH | HIPS_LOAD_IN_THREAD,
+                   &code);
+    return 0;
+}
+
+void hips_prefetch(const observer_t *obs, const double dir[3],
+                   double radius, bool zoom_in)
+{
+    prefetch_t d = {.radius = radius};
+    hips_t *hips;
+
+    vec3_normalize(dir, d.dir[1]);
+    mat3_mul_vec3(obs->rh2i, d.dir[1], d.dir[0]);
+    LL_FOREACH(g_hips, hips) {
+        // Only prefetch the surveys rendered during this frame.
+        if (hips->pin_frame != g_frame) continue;
+        d.hips = hips;
+        d.order = hips->pin_order;
+        if (zoom_in) d.order = min(d.order + 1, max(hips->order, 0));
+        d.nb = 0;
+        hips_traverse(&d, prefetch_visitor);
+    }
+}
+
+int64_t hips_get_copied_bytes(void)
+{
+    return g_copied_bytes;
+}
+
+int hips_get_cache_overflow(void)
+{
+    if (!g_cache) return 0;
+    return max(0, cache_get_current_size(g_cache) - CACHE_SIZE);
+}
+
+static int upload_cmp(const void *a, const void *b)
+{
+    const upload_t *ua = a, *ub = b;
+    return cmp(ua->priority, ub->priority);
+}
+
+void hips_set_compression(bool enabled)
+{
+    g_compress = enabled;
+}
+
+int hips_process_uploads(double max_time, int max_bytes)
+{
+    PROFILE(hips_process_uploads, 0);
+    double start = sys_get_unix_time();
+    int i, size, bytes = 0, nb;
+    img_tile_t *tile;
+
+    qsort(g_uploads.queue, g_uploads.nb, sizeof(*g_uploads.queue),
+          upload_cmp);
+    // We always do at least one upload, so that a tile bigger than the
+    // budget still gets uploaded.
+    for (i = 0; i < g_uploads.nb; i++) {
+        tile = g_uploads.queue[i].tile;
+        size = tile->compressed ? bc1_get_size(tile->w, tile->h) :
+                                  tile->w * tile->h * tile->bpp;
+        if (i && max_bytes && bytes + size > max_bytes) break;
+        if (i && max_time &&
+                (sys_get_unix_time() - start) * 1000 > max_time) break;
+        bytes += size;
+        tile->tex = create_tile_texture(g_uploads.queue[i].hips, tile,
+                                        g_uploads.queue[i].flags);
+        free(tile->img);
+        tile->img = NULL;
+    }
+    nb = g_uploads.nb - i;
+    g_uploads.nb = 0;
+    return nb;
+}
+
 /*
  * Function: hips_parse_date
  * Parse a date in the format supported for HiPS property files
@@ -805,3 +1683,58 @@ double hips_parse_date(const char *str)
     eraDtf2d("UTC", iy, im, id, ihr, imn, 0, &d1, &d2);
     return d1 - DJM0 + d2;
 }
+
+/******** TESTS ***********************************************************/
+
+#if COMPILE_TESTS
+
+static void test_hips_iterator(void)
+{
+    hips_iterator_t iter = {};
+    int order, pix, nb = 0, last_order = 0;
+
+    // Full breadth first traversal up to order 4: more tiles than the
+    // initial queue size.
+    hips_iterator_init(&iter, HIPS_ITER_BFS);
+    while (hips_iterator_next(&iter, &order, &pix)) {
+        assert(order >= last_order);
+        last_order = order;
+        nb++;
+        if (order < 4) hips_iterator_push_children(&iter, order, pix);
+    }
+    assert(nb == 12 * (1 + 4 + 16 + 64 + 256));
+
+    // Depth first: the first tiles are the first children of pix 0.
+    hips_iterator_init(&iter, HIPS_ITER_DFS);
+    nb = 0;
+    while (hips_iterator_next(&iter, &order, &pix)) {
+        assert(pix == 0 && order == nb);
+        if (++nb == 5) break; // Early exit.
+        hips_iterator_push_children(&iter, order, pix);
+    }
+    hips_iterator_release(&iter);
+}
+
+static void test_hips_missing_tiles(void)
+{
+    hips_t hips = {};
+    missing_t *missing, *tmp;
+    int i;
+
+    // Once the limit is reached, the oldest tiles are forgotten.
+    for (i = 0; i < COVERAGE_MAX_MISSING + 10; i++)
+        add_missing(&hips, 8, i);
+    assert(HASH_COUNT(hips.coverage.missing) == COVERAGE_MAX_MISSING);
+    assert(tile_may_exist(&hips, 8, 9));
+    assert(!tile_may_exist(&hips, 8, 10));
+    assert(!tile_may_exist(&hips, 8, COVERAGE_MAX_MISSING + 9));
+    HASH_ITER(hh, hips.coverage.missing, missing, tmp) {
+        HASH_DEL(hips.coverage.missing, missing);
+        free(missing);
+    }
+}
+
+TEST_REGISTER(NULL, test_hips_iterator, TEST_AUTO);
+TEST_REGISTER(NULL, test_hips_missing_tiles, TEST_AUTO);
+
+#endif
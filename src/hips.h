@@ -27,8 +27,31 @@ enum {
     HIPS_FORCE_USE_ALLSKY       = 1 << 1,
     HIPS_LOAD_IN_THREAD         = 1 << 2,
     HIPS_CACHED_ONLY            = 1 << 3,
+    HIPS_PIN                    = 1 << 4,
+    HIPS_PREFETCH               = 1 << 5,
+    // Store the tiles textures in shared atlas pages so that the renderer
+    // can batch them.  Not supported by the planet shader.
+    HIPS_USE_ATLAS              = 1 << 6,
+    // Return a fade value smaller than one while a tile texture fades in
+    // after it became ready.  The caller should render the parent texture
+    // (see HIPS_PARENT_ONLY) under it.
+    HIPS_FADE_IN                = 1 << 7,
+    // Only return the texture of a parent tile.
+    HIPS_PARENT_ONLY            = 1 << 8,
+    // Two bits for the decode shift of the image tiles, see
+    // HIPS_DECODE_SHIFT.
+    HIPS_DECODE_SHIFT_MASK      = 3 << 9,
+    // Compress the opaque image tiles to BC1 in the loading threads.  The
+    // compressed tiles don't use the atlas.
+    HIPS_COMPRESS               = 1 << 11,
 };
 
+// Decode the webp image tiles at 1/2, 1/4 or 1/8 of their resolution, for
+// a shift of 1, 2 or 3.  A tile decoded at a lower resolution than needed is
+// decoded again when we request its texture.
+#define HIPS_DECODE_SHIFT(shift) ((shift) << 9)
+#define HIPS_GET_DECODE_SHIFT(flags) (((flags) & HIPS_DECODE_SHIFT_MASK) >> 9)
+
 /*
  * Type: hips_settings
  * Structure passed to hips_create for custom type surveys.
@@ -38,6 +61,8 @@ enum {
  *                 The returned pointer is handled by the hips survey, and
  *                 can be anything.  This is called every time the survey
  *                 load a tile that is not in the cache.  See note [1]
+ *                 The flags are the <HIPS_FLAGS> of the request that
+ *                 created the tile.
  *   delete_tile - function used to delete the data returned by create_tile.
  *   user        - pointer passed to create_tile.
  *
@@ -48,7 +73,8 @@ enum {
  */
 typedef struct hips_settings {
     const void *(*create_tile)(void *user, int order, int pix, void *data,
-                               int size, int *cost, int *transparency);
+                               int size, int flags,
+                               int *cost, int *transparency);
     int (*delete_tile)(void *tile);
     void *user;
 } hips_settings_t;
@@ -58,7 +84,8 @@ typedef struct hips_settings {
  * Create a new hips survey.
  *
  * Parameters:
- *   url          - URL to the root of the survey.
+ *   url          - URL to the root of the survey, or path to a local
+ *                  archive file (.hipsa) created by <hips_archive_pack>.
  *   release_date - If known, release date in utc.  Otherwise 0.
  */
 hips_t *hips_create(const char *url, double release_date,
@@ -75,7 +102,10 @@ hips_t *hips_create(const char *url, double release_date,
  *   hips   - a hips survey.
  *   order  - order of the tile.
  *   pix    - pix of the tile.
- *   flags  - unused for the moment.
+ *   flags  - union of <HIPS_FLAGS>.  If HIPS_PIN is set, the tile won't be
+ *            evicted from the cache until the next call to
+ *            <hips_begin_frame>, and its download is scheduled by
+ *            priority.
  *   code   - get the return code of the tile loading.
  *
  * Return:
@@ -108,7 +138,7 @@ bool hips_is_ready(hips_t *hips);
 
 /*
  * Function: hips_traverse
- * Depth first traversal of healpix grid.
+ * Breadth first traversal of healpix grid.
  *
  * The callback should return:
  *   1 to keep going deeper into the tile.
@@ -117,11 +147,83 @@ bool hips_is_ready(hips_t *hips);
  *
  * Return:
  *   0 if the traverse finished.
- *   -1 if we reach the traverse limite.
  *   -v if the callback returned a negative value -v.
  */
 int hips_traverse(void *user, int callback(int order, int pix, void *user));
 
+enum {
+    HIPS_ITER_BFS = 0,
+    HIPS_ITER_DFS = 1,
+};
+
+/*
+ * Type: hips_iterator_t
+ * Iterator over the healpix grid tiles.
+ *
+ * This is a non callback alternative to <hips_traverse>.  The iterator
+ * starts with the 12 tiles of order 0, and we add the children of a tile
+ * with <hips_iterator_push_children> to go deeper.  We can stop the
+ * iteration at any time.
+ *
+ * The queue grows as needed, and is kept between calls to
+ * <hips_iterator_init>, so that an iterator reused at each frame doesn't
+ * allocate any memory.
+ *
+ * Example:
+ *
+ *   static hips_iterator_t iter = {};
+ *   int order, pix;
+ *   hips_iterator_init(&iter, HIPS_ITER_BFS);
+ *   while (hips_iterator_next(&iter, &order, &pix)) {
+ *       if (is_clipped(order, pix)) continue;
+ *       hips_iterator_push_children(&iter, order, pix);
+ *   }
+ */
+typedef struct hips_iterator {
+    struct {
+        int order;
+        int pix;
+    } *nodes;
+    int start;
+    int size;
+    int capacity; // Always a power of two.
+    int mode; // HIPS_ITER_BFS or HIPS_ITER_DFS.
+} hips_iterator_t;
+
+/*
+ * Function: hips_iterator_init
+ * Reset an iterator to the 12 tiles of order 0.
+ *
+ * The iterator must be zero initialized before the first call.
+ *
+ * Parameters:
+ *   iter - The iterator.
+ *   mode - HIPS_ITER_BFS for breadth first or HIPS_ITER_DFS for depth first
+ *          iteration.
+ */
+void hips_iterator_init(hips_iterator_t *iter, int mode);
+
+/*
+ * Function: hips_iterator_next
+ * Get the next tile of an iterator.
+ *
+ * Return:
+ *   false if there are no more tiles.
+ */
+bool hips_iterator_next(hips_iterator_t *iter, int *order, int *pix);
+
+/*
+ * Function: hips_iterator_push_children
+ * Add the four children of a tile to an iterator.
+ */
+void hips_iterator_push_children(hips_iterator_t *iter, int order, int pix);
+
+/*
+ * Function: hips_iterator_release
+ * Free the memory used by an iterator.
+ */
+void hips_iterator_release(hips_iterator_t *iter);
+
 /*
  * Function: hips_get_tile_texture
  * Get the texture for a given hips tile.
@@ -131,7 +233,7 @@ int hips_traverse(void *user, int callback(int order, int pix, void *user));
  *   uv      - The uv coordinates of the texture.
  *   proj    - An heapix projector already setup for the tile.
  *   split   - Recommended spliting of the texture when we render it.
- *   fade    - Recommended fade alpha.
+ *   fade    - Recommended fade alpha, see HIPS_FADE_IN.
  *   loading_complete - set to true if the tile is totally loaded.
  *
  * Return:
@@ -164,6 +266,17 @@ int hips_parse_hipslist(
  */
 void hips_set_frame(hips_t *hips, int frame);
 
+/*
+ * Function: hips_set_importance
+ * Set the importance of a survey when we schedule the tiles loading.
+ *
+ * Parameters:
+ *   hips       - A hips survey.
+ *   importance - Positive value, default to 1.  Tiles of surveys with a
+ *                higher importance get loaded sooner.
+ */
+void hips_set_importance(hips_t *hips, double importance);
+
 /*
  * Function: hips_set_label
  * Set the label for a hips survey
@@ -192,6 +305,9 @@ int hips_render(hips_t *hips, const painter_t *painter, double angle);
  * Similar to hips_render, but instead of actually rendering the tiles
  *  we call a callback function.  This can be used when we need better
  *  control on the rendering.
+ *
+ * The flags passed to the callback include HIPS_PIN, so that the tiles
+ * used for the rendering stay in the cache until the next frame.
  */
 int hips_render_traverse(hips_t *hips, const painter_t *painter,
                          double angle, void *user,
@@ -199,6 +315,120 @@ int hips_render_traverse(hips_t *hips, const painter_t *painter,
                                       int order, int pix, int flags,
                                       void *user));
 
+/*
+ * Function: hips_begin_frame
+ * Must be called at the beginning of each frame.
+ *
+ * This unpins all the tiles that were pinned during the previous frame, and
+ * schedules the tiles loading:
+ *
+ * - The downloads and parsing of the tiles that were not requested during
+ *   the previous frame are canceled.
+ * - The pending downloads are sorted by order, distance to the view
+ *   direction and survey importance, and only the first ones are started.
+ *
+ * Parameters:
+ *   obs    - The observer used for the rendering.
+ */
+void hips_begin_frame(const observer_t *obs);
+
+/*
+ * Function: hips_prefetch
+ * Warm the tiles cache for a predicted view.
+ *
+ * Must be called after the rendering.  For each survey rendered during the
+ * frame, this schedules the loading of the tiles covering the predicted
+ * view at the same order as the rendered ones, with a lower priority than
+ * the rendered tiles.
+ *
+ * Parameters:
+ *   obs     - The observer used for the rendering.
+ *   dir     - Predicted view direction in observed frame.
+ *   radius  - Angular radius of the predicted view (rad).
+ *   zoom_in - If set, prefetch the next order instead.
+ */
+void hips_prefetch(const observer_t *obs, const double dir[3],
+                   double radius, bool zoom_in);
+
+/*
+ * Function: hips_get_copied_bytes
+ * Return the total number of bytes of tiles data copied for the loading
+ * threads.
+ *
+ * The data of the local files is used directly, so this only counts the
+ * online tiles.
+ */
+int64_t hips_get_copied_bytes(void);
+
+/*
+ * Function: hips_get_cache_overflow
+ * Return how much the tiles cache is above its soft limit (in bytes).
+ *
+ * A non zero value means that the tiles used for the last frame didn't
+ * fit in the cache budget.
+ */
+int hips_get_cache_overflow(void);
+
+/*
+ * Function: hips_set_compression
+ * Enable the BC1 compression of the rendered tiles textures.
+ *
+ * The compression is only used if the OpenGL context supports it.  Six
+ * times more opaque tiles fit in the same GPU memory, at the cost of some
+ * quality and of the encoding time in the loading threads.
+ */
+void hips_set_compression(bool enabled);
+
+/*
+ * Function: hips_process_uploads
+ * Upload the queued tiles textures to the GPU.
+ *
+ * Must be called after the rendering.  The textures of the tiles are not
+ * created when the tiles are first rendered: the uploads are queued, and
+ * the parent tiles are rendered until they are done.  This function does
+ * the queued uploads, highest priority first, until the time or bytes
+ * budget is reached.  The remaining uploads are queued again at the next
+ * frame if the tiles are still visible.
+ *
+ * Parameters:
+ *   max_time  - Time budget in ms, zero for no limit.
+ *   max_bytes - Bytes budget, zero for no limit.
+ *
+ * Return:
+ *   The number of uploads that didn't fit in the budget.
+ */
+int hips_process_uploads(double max_time, int max_bytes);
+
+/*
+ * Function: hips_archive_open
+ * Serve a hips survey from a single file archive.
+ *
+ * The archive is memory mapped, and all the requests to urls starting with
+ * the base url are directly answered from it, without any copy or file
+ * system access.  The archives can be created with <hips_archive_pack>.
+ *
+ * Parameters:
+ *   path     - Path to the archive file.
+ *   base_url - Url of the survey served by the archive.
+ *
+ * Return:
+ *   0 on success.
+ */
+int hips_archive_open(const char *path, const char *base_url);
+
+/*
+ * Function: hips_archive_pack
+ * Pack a local hips survey directory into a single file archive.
+ *
+ * Parameters:
+ *   dir  - Root directory of the survey (containing the properties file).
+ *   path - Path of the created archive file.
+ *
+ * Return:
+ *   0 on success.
+ */
+int hips_archive_pack(const char *dir, const char *path);
+
 /*
  * Function: hips_parse_date
  * Parse a date in the format supported for HiPS property files
@@ -0,0 +1,436 @@
+/* Stellarium Web Engine - Copyright (c) 2018 - Noctua Software Ltd
+ *
+ * This program is licensed under the terms of the GNU AGPL v3, or
+ * alternatively under a commercial licence.
+ *
+ * The terms of the AGPL v3 license can be found in the main directory of this
+ * repository.
+ */
+
+/*
+ * Single file archive of a hips survey.
+ *
+ * The file is made of:
+ *
+ * - A header.
+ * - The index of all the tiles, sorted by NUNIQ value.
+ * - The index of all the other files of the survey (properties, allsky...).
+ * - The data of all the tiles and files.  Each blob is followed by a zero
+ *   byte so that text files can directly be used as strings.
+ *
+ * All the values are stored in little endian.  The archive is memory
+ * mapped, and the tiles data is directly returned to the assets manager,
+ * without any copy or system call.
+ */
+
+#include "swe.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ARCHIVE_MAGIC "SWEHIPSA"
+#define ARCHIVE_VERSION 1
+
+typedef struct {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    nb_tiles;
+    uint32_t    nb_files;
+    uint32_t    reserved;
+    uint64_t    tiles_offset; // Offset of the tiles index.
+    uint64_t    files_offset; // Offset of the files index.
+} header_t;
+
+typedef struct {
+    uint64_t    nuniq;
+    uint64_t    offset;
+    uint32_t    size;
+    char        ext[12]; // Tile file extension (jpg, png, webp...).
+} tile_entry_t;
+
+typedef struct {
+    char        name[112]; // Path relative to the survey root.
+    uint64_t    offset;
+    uint32_t    size;
+    uint32_t    reserved;
+} file_entry_t;
+
+typedef struct {
+    const uint8_t       *data; // Mapped file.
+    const header_t      *header;
+    const tile_entry_t  *tiles;
+    const file_entry_t  *files;
+    char                *base_url;
+} archive_t;
+
+static uint64_t get_nuniq(int order, int pix)
+{
+    return 4 * (1ULL << (2 * order)) + pix;
+}
+
+// Parse the path of a tile relative to the survey root.
+static bool parse_tile_path(const char *path, int *order, int *pix,
+                            const char **ext)
+{
+    int n = 0;
+    if (sscanf(path, "Norder%d/Dir%*d/Npix%d.%n", order, pix, &n) != 2)
+        return false;
+    if (n == 0 || strlen(path + n) >= sizeof(((tile_entry_t*)0)->ext))
+        return false;
+    *ext = path + n;
+    return true;
+}
+
+static const tile_entry_t *find_tile(const archive_t *archive, int order,
+                                     int pix, const char *ext)
+{
+    const tile_entry_t *tiles = archive->tiles;
+    uint64_t nuniq = get_nuniq(order, pix);
+    int i = 0, j = archive->header->nb_tiles, m;
+
+    // Binary search of the first tile with this nuniq value.
+    while (i < j) {
+        m = (i + j) / 2;
+        if (tiles[m].nuniq < nuniq) i = m + 1;
+        else j = m;
+    }
+    // There might be several tiles with different formats.
+    for (; i < archive->header->nb_tiles && tiles[i].nuniq == nuniq; i++) {
+        if (strncmp(tiles[i].ext, ext, sizeof(tiles[i].ext)) == 0)
+            return &tiles[i];
+    }
+    return NULL;
+}
+
+static const void *archive_handler(void *user, const char *url,
+                                   int *size, int *code, bool *free_data)
+{
+    const archive_t *archive = user;
+    const tile_entry_t *tile;
+    const file_entry_t *file;
+    char path[1024];
+    const char *ext;
+    int i, order, pix;
+
+    *free_data = false;
+    *size = 0;
+    *code = 404;
+    snprintf(path, sizeof(path), "%s", url + strlen(archive->base_url));
+    if (strchr(path, '?')) *strchr(path, '?') = '\0';
+    if (path[0] != '/') return NULL;
+
+    if (parse_tile_path(path + 1, &order, &pix, &ext)) {
+        tile = find_tile(archive, order, pix, ext);
+        if (!tile) return NULL;
+        *code = 200;
+        *size = tile->size;
+        return archive->data + tile->offset;
+    }
+
+    for (i = 0; i < archive->header->nb_files; i++) {
+        file = &archive->files[i];
+        if (strncmp(file->name, path + 1, sizeof(file->name)) != 0)
+            continue;
+        *code = 200;
+        *size = file->size;
+        return archive->data + file->offset;
+    }
+    return NULL;
+}
+
+// Check that a blob and its zero byte are inside the file.
+static bool blob_is_valid(uint64_t offset, uint32_t size, uint64_t file_size)
+{
+    return offset < file_size && (uint64_t)size + 1 <= file_size - offset;
+}
+
+int hips_archive_open(const char *path, const char *base_url)
+{
+    int fd;
+    struct stat st;
+    void *data;
+    archive_t *archive;
+    const header_t *header;
+    const tile_entry_t *tiles;
+    const file_entry_t *files;
+    uint64_t i, j;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        LOG_E("Cannot open hips archive %s", path);
+        return -1;
+    }
+    if (fstat(fd, &st) || st.st_size < sizeof(header_t)) {
+        LOG_E("Cannot read hips archive %s", path);
+        close(fd);
+        return -1;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        LOG_E("Cannot map hips archive %s", path);
+        return -1;
+    }
+    header = data;
+    // Compare the counts to the space left in the file, so that a
+    // corrupted header cannot overflow the computation.
+    if (memcmp(header->magic, ARCHIVE_MAGIC, 8) != 0 ||
+            header->version != ARCHIVE_VERSION ||
+            header->tiles_offset > st.st_size ||
+            header->nb_tiles > (st.st_size - header->tiles_offset) /
+                               sizeof(tile_entry_t) ||
+            header->files_offset > st.st_size ||
+            header->nb_files > (st.st_size - header->files_offset) /
+                               sizeof(file_entry_t)) {
+        LOG_E("Wrong hips archive format %s", path);
+        munmap(data, st.st_size);
+        return -1;
+    }
+    // Make sure all the data, including the zero byte after each blob, is
+    // inside the file, so that a truncated archive cannot make us read
+    // outside the mapping.
+    tiles = data + header->tiles_offset;
+    files = data + header->files_offset;
+    for (i = 0; i < header->nb_tiles; i++) {
+        if (!blob_is_valid(tiles[i].offset, tiles[i].size, st.st_size))
+            break;
+    }
+    for (j = 0; j < header->nb_files; j++) {
+        if (!blob_is_valid(files[j].offset, files[j].size, st.st_size))
+            break;
+    }
+    if (i < header->nb_tiles || j < header->nb_files) {
+        LOG_E("Corrupted hips archive %s", path);
+        munmap(data, st.st_size);
+        return -1;
+    }
+
+    // The archive is never released, since the assets manager can keep
+    // pointers to its data.
+    archive = calloc(1, sizeof(*archive));
+    archive->data = data;
+    archive->header = header;
+    archive->tiles = tiles;
+    archive->files = files;
+    archive->base_url = strdup(base_url);
+    asset_add_handler(base_url, archive, archive_handler);
+    return 0;
+}
+
+/******** Packer **********************************************************/
+
+typedef struct {
+    char            *path; // Path relative to the survey root.
+    uint32_t        size;
+    bool            is_tile;
+    int             order;
+    int             pix;
+    const char      *ext;
+} pack_entry_t;
+
+static int list_files(const char *root, const char *rel, UT_array *entries)
+{
+    DIR *dir;
+    struct dirent *dirent;
+    struct stat st;
+    char *path, *child;
+    pack_entry_t entry;
+    int r = 0;
+
+    asprintf(&path, "%s/%s", root, rel);
+    dir = opendir(path);
+    free(path);
+    if (!dir) return -1;
+    while (r == 0 && (dirent = readdir(dir))) {
+        if (dirent->d_name[0] == '.') continue;
+        if (*rel) asprintf(&child, "%s/%s", rel, dirent->d_name);
+        else asprintf(&child, "%s", dirent->d_name);
+        asprintf(&path, "%s/%s", root, child);
+        r = stat(path, &st);
+        free(path);
+        if (r == 0 && S_ISDIR(st.st_mode)) {
+            r = list_files(root, child, entries);
+            free(child);
+            continue;
+        }
+        if (r != 0 || !S_ISREG(st.st_mode)) {
+            free(child);
+            continue;
+        }
+        memset(&entry, 0, sizeof(entry));
+        entry.path = child;
+        entry.size = st.st_size;
+        entry.is_tile = parse_tile_path(child, &entry.order, &entry.pix,
+                                        &entry.ext);
+        if (!entry.is_tile &&
+                strlen(child) >= sizeof(((file_entry_t*)0)->name)) {
+            LOG_W("Skip file with too long name: %s", child);
+            free(child);
+            continue;
+        }
+        utarray_push_back(entries, &entry);
+    }
+    closedir(dir);
+    return r;
+}
+
+static int entry_cmp(const void *a_, const void *b_)
+{
+    const pack_entry_t *a = a_, *b = b_;
+    if (a->is_tile != b->is_tile) return a->is_tile ? -1 : 1;
+    if (!a->is_tile) return strcmp(a->path, b->path);
+    return cmp(get_nuniq(a->order, a->pix), get_nuniq(b->order, b->pix)) ?:
+           strcmp(a->ext, b->ext);
+}
+
+static void entry_dtor(void *entry)
+{
+    free(((pack_entry_t*)entry)->path);
+}
+
+int hips_archive_pack(const char *dir, const char *path)
+{
+    const UT_icd entry_icd = {sizeof(pack_entry_t), NULL, NULL, entry_dtor};
+    UT_array *entries;
+    pack_entry_t *entry;
+    header_t header = {ARCHIVE_MAGIC, ARCHIVE_VERSION};
+    tile_entry_t tile;
+    file_entry_t file;
+    uint64_t offset;
+    char *file_path;
+    void *data;
+    FILE *out;
+    int size, r = -1;
+
+    utarray_new(entries, &entry_icd);
+    if (list_files(dir, "", entries)) {
+        LOG_E("Cannot read hips directory %s", dir);
+        goto end;
+    }
+    utarray_sort(entries, entry_cmp);
+    for (entry = NULL; (entry = (void*)utarray_next(entries, entry)); ) {
+        if (entry->is_tile) header.nb_tiles++;
+        else header.nb_files++;
+    }
+    header.tiles_offset = sizeof(header);
+    header.files_offset = header.tiles_offset +
+                          header.nb_tiles * sizeof(tile_entry_t);
+
+    out = fopen(path, "wb");
+    if (!out) {
+        LOG_E("Cannot create %s", path);
+        goto end;
+    }
+    fwrite(&header, sizeof(header), 1, out);
+
+    // Write the indexes.
+    offset = header.files_offset + header.nb_files * sizeof(file_entry_t);
+    for (entry = NULL; (entry = (void*)utarray_next(entries, entry)); ) {
+        if (entry->is_tile) {
+            memset(&tile, 0, sizeof(tile));
+            tile.nuniq = get_nuniq(entry->order, entry->pix);
+            tile.offset = offset;
+            tile.size = entry->size;
+            strncpy(tile.ext, entry->ext, sizeof(tile.ext) - 1);
+            fwrite(&tile, sizeof(tile), 1, out);
+        } else {
+            memset(&file, 0, sizeof(file));
+            strncpy(file.name, entry->path, sizeof(file.name) - 1);
+            file.offset = offset;
+            file.size = entry->size;
+            fwrite(&file, sizeof(file), 1, out);
+        }
+        offset += entry->size + 1;
+    }
+
+    // Write the data.
+    for (entry = NULL; (entry = (void*)utarray_next(entries, entry)); ) {
+        asprintf(&file_path, "%s/%s", dir, entry->path);
+        data = read_file(file_path, &size);
+        free(file_path);
+        if (!data || size != entry->size) {
+            LOG_E("Cannot read %s", entry->path);
+            free(data);
+            fclose(out);
+            goto end;
+        }
+        fwrite(data, size + 1, 1, out); // read_file adds a zero byte.
+        free(data);
+    }
+    r = ferror(out) ? -1 : 0;
+    fclose(out);
+    LOG_I("Packed %d tiles and %d files into %s",
+          header.nb_tiles, header.nb_files, path);
+end:
+    utarray_free(entries);
+    return r;
+}
+
+/******** TESTS ***********************************************************/
+
+#if COMPILE_TESTS
+
+static void test_write_file(const char *dir, const char *name,
+                            const char *data)
+{
+    char *path;
+    FILE *file;
+    asprintf(&path, "%s/%s", dir, name);
+    sys_make_dir(path);
+    file = fopen(path, "w");
+    assert(file);
+    fputs(data, file);
+    fclose(file);
+    free(path);
+}
+
+static void test_hips_archive(void)
+{
+    char dir[] = "/tmp/swe_test_archiveXXXXXX";
+    char *path, *cmd;
+    const char *data;
+    const char *base = "https://test.archive/survey";
+    int size, code;
+
+    assert(mkdtemp(dir));
+    test_write_file(dir, "properties", "hips_order = 3");
+    test_write_file(dir, "Norder3/Dir0/Npix5.jpg", "tile 3 5");
+    test_write_file(dir, "Norder3/Dir0/Npix2.jpg", "tile 3 2");
+    test_write_file(dir, "Norder3/Dir0/Npix2.png", "tile 3 2 png");
+    test_write_file(dir, "Norder4/Dir0/Npix1.jpg", "tile 4 1");
+    asprintf(&path, "%s.hipsa", dir);
+    assert(hips_archive_pack(dir, path) == 0);
+    assert(hips_archive_open(path, base) == 0);
+
+    data = asset_get_data(
+            "https://test.archive/survey/properties", &size, &code);
+    assert(code == 200 && size == 14 && strcmp(data, "hips_order = 3") == 0);
+    data = asset_get_data(
+            "https://test.archive/survey/Norder3/Dir0/Npix2.png?v=1",
+            &size, &code);
+    assert(code == 200 && strcmp(data, "tile 3 2 png") == 0);
+    data = asset_get_data(
+            "https://test.archive/survey/Norder4/Dir0/Npix1.jpg",
+            &size, &code);
+    assert(code == 200 && strcmp(data, "tile 4 1") == 0);
+    data = asset_get_data2(
+            "https://test.archive/survey/Norder4/Dir0/Npix2.jpg",
+            ASSET_ACCEPT_404, &size, &code);
+    assert(code == 404 && !data);
+
+    // A truncated archive is rejected.
+    assert(truncate(path, 300) == 0);
+    assert(hips_archive_open(path, "https://test.archive/truncated") == -1);
+
+    asprintf(&cmd, "rm -rf %s %s", dir, path);
+    if (system(cmd) != 0) LOG_W("Cannot remove %s", dir);
+    free(cmd);
+    free(path);
+}
+
+TEST_REGISTER(NULL, test_hips_archive, TEST_AUTO);
+
+#endif
@@ -32,6 +32,7 @@ typedef struct
     char *tests_filter;
     bool calendar;
     bool dump;
+    bool pack_hips;
     bool gen_doc;
     char *args[3];
 } args_t;
@@ -44,6 +45,7 @@ static char doc[] = "A virtual planetarium";
 static char args_doc[] = "";
 #define OPT_RUN_TESTS 1
 #define OPT_GEN_DOC 2
+#define OPT_PACK_HIPS 3
 static struct argp_option options[] = {
 
 #if COMPILE_TESTS
@@ -52,6 +54,8 @@ static struct argp_option options[] = {
 #endif
     {"calendar", 'c', NULL, 0, "print events calendar"},
     {"dump", 'd', NULL, 0, "dump catalog file as json"},
+    {"pack-hips", OPT_PACK_HIPS, NULL, 0,
+                            "pack a hips survey directory into a single file"},
     {"gen-doc", OPT_GEN_DOC, NULL, 0, "print doc for the defined classes"},
     { 0 }
 };
@@ -75,6 +79,9 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
     case 'd':
         args->dump = true;
         break;
+    case OPT_PACK_HIPS:
+        args->pack_hips = true;
+        break;
     case ARGP_KEY_ARG:
         if (state->arg_num >= 3)
             argp_usage (state);
@@ -155,6 +162,13 @@ int main(int argc, char **argv)
         dump_catalog(args.args[0]);
         return 0;
     }
+    if (args.pack_hips) {
+        if (!args.args[0] || !args.args[1]) {
+            LOG_E("pack-hips SURVEY_DIR ARCHIVE_FILE");
+            return -1;
+        }
+        return hips_archive_pack(args.args[0], args.args[1]);
+    }
     if (args.gen_doc) {
         swe_gen_doc();
         return 0;
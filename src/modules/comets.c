@@ -235,7 +235,8 @@ static int comets_update(obj_t *obj, const observer_t *obs, double dt)
     const int update_nb = 32;
 
     if (!comets->parsed) {
-        data = asset_get_data(URL, &size, &code);
+        data = asset_get_data2(URL, ASSET_STALE_WHILE_REVALIDATE,
+                               &size, &code);
         if (!code) return 0; // Still loading.
         comets->parsed = true;
         if (!data) {
@@ -195,8 +195,9 @@ static int on_file_tile_loaded(const char type[4],
     tile_t *tile;
     dso_data_t *s;
     int nb, i, j, version, data_ofs = 0, flags, row_size, order, pix;
-    char ids[256] = {};
-    double bmag, temp_mag;
+    uint64_t *nsid;
+    char (*types)[4], (*snam)[64], (*ids)[256];
+    double *vmag, *bmag, *ra, *de, *smax, *smin, *angl, temp_mag;
     void *tile_data;
     const double DAM2R = DD2R / 60.0; // arcmin to rad.
     eph_table_column_t columns[] = {
@@ -224,12 +225,10 @@ static int on_file_tile_loaded(const char type[4],
         *(tile_t**)user = NULL;
         return -1;
     }
-    tile_data = eph_read_compressed_block(data, size, &data_ofs, &size);
+    tile_data = eph_read_table_data(data, size, &data_ofs, flags, row_size,
+                                    nb, &size);
     if (!tile_data) return -1;
     data_ofs = 0;
-    if (flags & 1) {
-        eph_shuffle_bytes(tile_data + data_ofs, row_size, nb);
-    }
 
     tile = calloc(1, sizeof(*tile));
     tile->mag_min = DBL_MAX;
@@ -238,26 +237,41 @@ static int on_file_tile_loaded(const char type[4],
 
     tile->sources = calloc(tile->nb, sizeof(*tile->sources));
 
+    nsid = malloc(nb * sizeof(*nsid));
+    types = malloc(nb * sizeof(*types));
+    vmag = malloc(nb * sizeof(*vmag));
+    bmag = malloc(nb * sizeof(*bmag));
+    ra = malloc(nb * sizeof(*ra));
+    de = malloc(nb * sizeof(*de));
+    smax = malloc(nb * sizeof(*smax));
+    smin = malloc(nb * sizeof(*smin));
+    angl = malloc(nb * sizeof(*angl));
+    snam = malloc(nb * sizeof(*snam));
+    ids = malloc(nb * sizeof(*ids));
+    eph_read_table_columns(tile_data, size, &data_ofs, nb,
+                           ARRAY_SIZE(columns), columns,
+                           nsid, types, vmag, bmag, ra, de, smax, smin, angl,
+                           snam, ids);
+
     for (i = 0; i < tile->nb; i++) {
         s = &tile->sources[i];
-        eph_read_table_row(tile_data, size, &data_ofs,
-                           ARRAY_SIZE(columns), columns,
-                           &s->id.nsid, s->type,
-                           &s->vmag, &bmag, &s->ra, &s->de,
-                           &s->smax, &s->smin, &s->angle,
-                           s->short_name, ids);
+        s->id.nsid = nsid[i];
+        memcpy(s->type, types[i], 4);
+        memcpy(s->short_name, snam[i], 64);
+        s->vmag = vmag[i];
         assert(s->id.nsid);
-        s->ra *= DD2R;
-        s->de *= DD2R;
-        s->smax *= DAM2R;
-        s->smin *= DAM2R;
+        s->ra = ra[i] * DD2R;
+        s->de = de[i] * DD2R;
+        s->smax = smax[i] * DAM2R;
+        s->smin = smin[i] * DAM2R;
+        s->angle = angl[i];
         if (!s->smin && s->smax) {
             s->smin = s->smax;
             s->angle = NAN;
         }
         s->angle *= DD2R;
         // For the moment use bmag as fallback vmag value
-        if (isnan(s->vmag)) s->vmag = bmag;
+        if (isnan(s->vmag)) s->vmag = bmag[i];
         strip_type(s->type);
         temp_mag = isnan(s->vmag) ? DSO_DEFAULT_VMAG : s->vmag;
         tile->mag_min = min(tile->mag_min, temp_mag);
@@ -265,19 +279,31 @@ static int on_file_tile_loaded(const char type[4],
         s->id.oid = make_oid(s);
 
         // Turn '|' separated ids into '\0' separated values.
-        if (*ids) {
-            s->names = calloc(1, 2 + strlen(ids));
-            for (j = 0; ids[j]; j++)
-                s->names[j] = ids[j] != '|' ? ids[j] : '\0';
+        if (*ids[i]) {
+            s->names = calloc(1, 2 + strnlen(ids[i], 256));
+            for (j = 0; j < 256 && ids[i][j]; j++)
+                s->names[j] = ids[i][j] != '|' ? ids[i][j] : '\0';
         }
     }
+    free(nsid);
+    free(types);
+    free(vmag);
+    free(bmag);
+    free(ra);
+    free(de);
+    free(smax);
+    free(smin);
+    free(angl);
+    free(snam);
+    free(ids);
     free(tile_data);
     *(tile_t**)user = tile;
     return 0;
 }
 
 static const void *dsos_create_tile(void *user, int order, int pix, void *data,
-                                    int size, int *cost, int *transparency)
+                                    int size, int flags,
+                                    int *cost, int *transparency)
 {
     tile_t *tile;
     eph_load(data, size, &tile, on_file_tile_loaded);
@@ -295,12 +321,11 @@ static int dsos_init(obj_t *obj, json_value *args)
 }
 
 // Exactly the same that stars.c get_tile function...
-static tile_t *get_tile(dsos_t *dsos, int order, int pix, bool load,
+static tile_t *get_tile(dsos_t *dsos, int order, int pix, int flags,
                         bool *loading_complete)
 {
-    int code, flags = 0;
+    int code;
     tile_t *tile;
-    if (!load) flags |= HIPS_CACHED_ONLY;
     tile = hips_get_tile(dsos->survey, order, pix, flags, &code);
     if (loading_complete) *loading_complete = (code != 0);
     return tile;
@@ -529,32 +554,30 @@ static int dso_render_pointer(const obj_t *obj, const painter_t *painter)
     return 0;
 }
 
-static int render_visitor(int order, int pix, void *user)
+// Render a single tile, and return whether we should render its children.
+static bool render_tile(dsos_t *dsos, const painter_t *painter,
+                        int order, int pix, int *nb_tot, int *nb_loaded)
 {
-    dsos_t *dsos = USER_GET(user, 0);
-    painter_t painter = *(const painter_t*)USER_GET(user, 1);
-    int *nb_tot = USER_GET(user, 2);
-    int *nb_loaded = USER_GET(user, 3);
     tile_t *tile;
     int i;
     bool loaded;
 
     // Early exit if the tile is clipped.
-    if (painter_is_tile_clipped(&painter, FRAME_ICRF, order, pix, true))
-        return 0;
+    if (painter_is_tile_clipped(painter, FRAME_ICRF, order, pix, true))
+        return false;
 
     (*nb_tot)++;
-    tile = get_tile(dsos, order, pix, true, &loaded);
+    tile = get_tile(dsos, order, pix, HIPS_PIN, &loaded);
     if (loaded) (*nb_loaded)++;
 
-    if (!tile) return 0;
-    if (tile->mag_min > painter.mag_max) return 0;
+    if (!tile) return false;
+    if (tile->mag_min > painter->mag_max) return false;
 
     for (i = 0; i < tile->nb; i++) {
-        dso_render_from_data(&tile->sources[i], NULL, &painter);
+        dso_render_from_data(&tile->sources[i], NULL, painter);
     }
-    if (tile->mag_max > painter.mag_max) return 0;
-    return 1;
+    if (tile->mag_max > painter->mag_max) return false;
+    return true;
 }
 
 static int dsos_update(obj_t *obj, const observer_t *obs, double dt)
@@ -567,13 +590,18 @@ static int dsos_render(const obj_t *obj, const painter_t *painter_)
 {
     PROFILE(dsos_render, 0);
     dsos_t *dsos = (dsos_t*)obj;
-    int nb_tot = 0, nb_loaded = 0;
+    // Only used from the main thread, so we can keep the same iterator.
+    static hips_iterator_t iter = {};
+    int order, pix, nb_tot = 0, nb_loaded = 0;
     painter_t painter = *painter_;
     if (!dsos->survey) return 0;
     painter.color[3] *= dsos->visible.value;
     if (painter.color[3] == 0) return 0;
-    hips_traverse(USER_PASS(dsos, &painter, &nb_tot, &nb_loaded),
-                  render_visitor);
+    hips_iterator_init(&iter, HIPS_ITER_BFS);
+    while (hips_iterator_next(&iter, &order, &pix)) {
+        if (render_tile(dsos, &painter, order, pix, &nb_tot, &nb_loaded))
+            hips_iterator_push_children(&iter, order, pix);
+    }
     progressbar_report("DSO", "DSO", nb_loaded, nb_tot, -1);
     return 0;
 }
@@ -588,7 +616,7 @@ static int dsos_get_visitor(int order, int pix, void *user)
         uint64_t    n;
     } *d = user;
     tile_t *tile;
-    tile = get_tile(d->dsos, order, pix, false, NULL);
+    tile = get_tile(d->dsos, order, pix, HIPS_CACHED_ONLY, NULL);
     if (!tile) return 0;
     for (i = 0; i < tile->nb; i++) {
         if (    (d->cat == 0 && tile->sources[i].id.m    == d->n) ||
@@ -669,7 +697,7 @@ static int dsos_list(const obj_t *obj, observer_t *obs,
     // Get tile from hint (as nuniq).
     order = log2(hint / 4) / 2;
     pix = hint - 4 * (1 << (2 * (order)));
-    tile = get_tile(dsos, order, pix, true, NULL);
+    tile = get_tile(dsos, order, pix, 0, NULL);
     if (!tile) return 0;
     for (i = 0; i < tile->nb; i++) {
         if (!f) continue;
@@ -696,6 +724,7 @@ static int dsos_add_data_source(
     if (!args_type || strcmp(args_type, "dso")) return 1;
     if (dsos->survey) return 1; // Already present.
     dsos->survey = hips_create(url, 0, &survey_settings);
+    hips_set_importance(dsos->survey, 2.0);
     return 0;
 }
 
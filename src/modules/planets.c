@@ -1017,6 +1017,7 @@ static int planets_init(obj_t *obj, json_value *args)
         p = planet_get_by_name(planets, name);
         if (!p) continue;
         p->rings.tex = texture_from_url(path, TF_LAZY_LOAD);
+        texture_set_owner(p->rings.tex, TEX_CAT_PLANET, p);
     }
     regfree(&reg);
 
@@ -1024,6 +1025,8 @@ static int planets_init(obj_t *obj, json_value *args)
         texture_from_url("asset://textures/earth_shadow.png", TF_LAZY_LOAD);
     planets->halo_tex =
         texture_from_url("asset://textures/halo.png", TF_LAZY_LOAD);
+    texture_set_owner(planets->earth_shadow_tex, TEX_CAT_PLANET, planets);
+    texture_set_owner(planets->halo_tex, TEX_CAT_PLANET, planets);
 
     return 0;
 }
@@ -10,6 +10,7 @@
 #include "swe.h"
 #include "ini.h"
 #include <regex.h>
+#include <unistd.h>
 #include <zlib.h>
 
 #define URL_MAX_SIZE 4096
@@ -23,6 +24,45 @@ enum {
 // Min mag to start loading the gaia survey.
 static const double GAIA_MIN_MAG = 8.0;
 
+// Min time between two saves of the stars ids index (sec).
+#define INDEX_SAVE_DELAY 10
+
+// Max number of entries in the stars ids index.
+#define INDEX_MAX_NB (1 << 18)
+
+// Flags of the tiles.
+enum {
+    TILE_INDEXED = 1 << 0, // The stars ids have been added to the index.
+};
+
+/*
+ * Type: index_entry_t
+ * Location of a star in the surveys, from one of its ids.
+ *
+ * The key is the star catalog oid (HIP or TYC), or the HD number as an
+ * oid.  We don't index the gaia only stars, there are far too many of
+ * them.
+ */
+typedef struct {
+    uint64_t    key;    // Zero for an empty slot.
+    uint32_t    pix;
+    uint16_t    row;
+    uint8_t     survey;
+    uint8_t     order;
+} index_entry_t;
+
+/*
+ * Type: index_header_t
+ * Header of the local file where we save the stars ids index.  It is
+ * followed by the entries, new entries are appended at the end of the
+ * file, and the last one wins.
+ */
+typedef struct {
+    char        magic[4]; // "SIDX"
+    uint32_t    version;
+    uint32_t    urls_hash[2]; // crc32 of the surveys urls.
+} index_header_t;
+
 typedef struct stars stars_t;
 typedef struct {
     uint64_t oid;
@@ -69,12 +109,50 @@ struct stars {
         double  min_vmag; // Don't render stars below this mag.
     } surveys[2];
 
+    // Index of the catalog ids of the stars we loaded so far, so that we
+    // can find a star without searching all the tiles.  Open addressing
+    // hash table with linear probing.  It is independent from the tiles
+    // cache and saved locally, so it survives the tiles eviction and the
+    // sessions.
+    struct {
+        index_entry_t *entries;
+        int         capacity; // Power of two.
+        int         nb;
+        bool        loaded;
+        // New entries not saved yet.
+        index_entry_t *pending;
+        int         nb_pending;
+        int         pending_capacity;
+        double      save_time;
+    } index;
+
     bool            visible;
 };
 
+/*
+ * Type: star_extra_t
+ * Catalog ids and names of a star in a tile.
+ *
+ * Most of the stars (all the gaia only ones) don't have any, so we only
+ * store them for the stars that need it.
+ */
+typedef struct {
+    int         index;  // Index of the star in the tile.
+    uint64_t    gaia;   // Gaia source id (0 if none).
+    uint32_t    tyc;    // Tycho2 id.
+    int         hip;    // HIP number.
+    int         hd;     // HD number.
+    // List of extra names, separated by '\0', terminated by two '\0'.
+    char        *names;
+} star_extra_t;
+
 /*
  * Type: tile_t
  * Custom tile structure for the stars hips survey.
+ *
+ * The stars are stored as columns, sorted by vmag.  The render loop only
+ * reads the hot columns (position, vmag, bv and oid).  The other values
+ * are only needed to create the star objects, see <tile_get_star>.
  */
 typedef struct tile {
     int         flags;
@@ -82,9 +160,32 @@ typedef struct tile {
     double      mag_max;
     double      illuminance; // Totall illuminance (lux).
     int         nb;
-    star_data_t *sources;
+
+    // Hot columns.
+    float       (*pos)[3];  // Normalized astrometric direction.
+    int16_t     *vmag;      // Visual magnitude (millimag).
+    int16_t     *bv;        // B-V color index (thousandths).
+    uint64_t    *oid;
+
+    // Cold columns.
+    float       (*pm)[3];   // RA, Dec proper motions (rad/year), plx (arcsec).
+    int         nb_extras;
+    star_extra_t *extras;   // Sorted by index.
 } tile_t;
 
+// Return the ids and names of a star in a tile, or NULL if it has none.
+static const star_extra_t *tile_get_extra(const tile_t *tile, int index)
+{
+    int lo = 0, hi = tile->nb_extras - 1, mid;
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if (tile->extras[mid].index == index) return &tile->extras[mid];
+        if (tile->extras[mid].index < index) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return NULL;
+}
+
 static double illuminance_for_vmag(double vmag)
 {
     /*
@@ -114,6 +215,42 @@ static void compute_pv(double ra, double de,
     }
 }
 
+// Unpack the ids and names of a star of a tile.
+static void tile_get_ids(const tile_t *tile, int i, star_data_t *s)
+{
+    const star_extra_t *extra = tile_get_extra(tile, i);
+    memset(s, 0, sizeof(*s));
+    s->oid = tile->oid[i];
+    // Without any extra ids, the oid is the gaia id.
+    s->gaia = s->oid;
+    if (extra) {
+        s->gaia = extra->gaia;
+        s->tyc = extra->tyc;
+        s->hip = extra->hip;
+        s->hd = extra->hd;
+        s->names = extra->names;
+    }
+}
+
+// Unpack a star of a tile.
+static void tile_get_star(const tile_t *tile, int i, star_data_t *s)
+{
+    double pos[3] = {tile->pos[i][0], tile->pos[i][1], tile->pos[i][2]};
+    double ra, de;
+
+    tile_get_ids(tile, i, s);
+    s->vmag = tile->vmag[i] / 1000.0;
+    s->bv = tile->bv[i] / 1000.0;
+    s->illuminance = illuminance_for_vmag(s->vmag);
+    eraC2s(pos, &ra, &de);
+    s->ra = eraAnp(ra);
+    s->de = de;
+    s->pra = tile->pm[i][0];
+    s->pde = tile->pm[i][1];
+    s->plx = tile->pm[i][2];
+    compute_pv(s->ra, s->de, s->pra, s->pde, s->plx, s);
+}
+
 // Get the pix number from a gaia source id at a given level.
 static int gaia_index_to_pix(int order, uint64_t id)
 {
@@ -161,7 +298,8 @@ static int star_update(obj_t *obj, const observer_t *obs, double dt)
     return 0;
 }
 
-static void star_render_name(const painter_t *painter, const star_data_t *s,
+static void star_render_name(const painter_t *painter, uint64_t oid,
+                             int hip, int hd,
                              const double pos[3], double size, double vmag,
                              double color[3])
 {
@@ -172,20 +310,20 @@ static void star_render_name(const painter_t *painter, const star_data_t *s,
     const char *name = NULL;
     char tmp[8];
     double label_color[4] = {color[0], color[1], color[2], 0.5};
-    if (!s->hip) return;
+    if (!hip) return;
 
-    name = identifiers_get(s->oid, "NAME");
+    name = identifiers_get(oid, "NAME");
     if (name) {
         labels_add(sys_translate("star", name),
-                   pos, size, 13, label_color, 0, ANCHOR_AROUND, -vmag, s->oid);
+                   pos, size, 13, label_color, 0, ANCHOR_AROUND, -vmag, oid);
         return;
     }
     if (painter->flags & PAINTER_SHOW_BAYER_LABELS) {
-        bayer_get(s->hd, NULL, &bayer, &bayer_n);
+        bayer_get(hd, NULL, &bayer, &bayer_n);
         if (bayer) {
             sprintf(tmp, "%s%.*d", greek[bayer - 1], bayer_n ? 1 : 0, bayer_n);
             labels_add(tmp, pos, size, 13, label_color, 0,
-                       ANCHOR_AROUND, -vmag, s->oid);
+                       ANCHOR_AROUND, -vmag, oid);
         }
     }
 }
@@ -226,7 +364,8 @@ static int star_render(const obj_t *obj, const painter_t *painter_)
                           true, p, p);
         if (project(painter.proj,
                     PROJ_ALREADY_NORMALIZED | PROJ_TO_WINDOW_SPACE, 2, p, p))
-            star_render_name(&painter, s, p, size, s->vmag, color);
+            star_render_name(&painter, s->oid, s->hip, s->hd,
+                             p, size, s->vmag, color);
     }
     return 0;
 }
@@ -292,8 +431,13 @@ static int del_tile(void *data)
 {
     int i;
     tile_t *tile = data;
-    for (i = 0; i < tile->nb; i++) free(tile->sources[i].names);
-    free(tile->sources);
+    for (i = 0; i < tile->nb_extras; i++) free(tile->extras[i].names);
+    free(tile->pos);
+    free(tile->vmag);
+    free(tile->bv);
+    free(tile->oid);
+    free(tile->pm);
+    free(tile->extras);
     free(tile);
     return 0;
 }
@@ -303,17 +447,71 @@ static int star_data_cmp(const void *a, const void *b)
     return cmp(((const star_data_t*)a)->vmag, ((const star_data_t*)b)->vmag);
 }
 
+// Store the stars into the tile columns.
+static void tile_set_stars(tile_t *tile, const star_data_t *sources, int nb)
+{
+    int i, j;
+    const star_data_t *s;
+    star_extra_t *extra;
+
+    tile->nb = nb;
+    tile->pos = malloc(nb * sizeof(*tile->pos));
+    tile->vmag = malloc(nb * sizeof(*tile->vmag));
+    tile->bv = malloc(nb * sizeof(*tile->bv));
+    tile->oid = malloc(nb * sizeof(*tile->oid));
+    tile->pm = malloc(nb * sizeof(*tile->pm));
+    for (i = 0; i < nb; i++) {
+        s = &sources[i];
+        for (j = 0; j < 3; j++) tile->pos[i][j] = s->pos[j];
+        tile->vmag[i] = round(s->vmag * 1000);
+        tile->bv[i] = round(clamp(s->bv, -32.0, 32.0) * 1000);
+        tile->oid[i] = s->oid;
+        tile->pm[i][0] = s->pra;
+        tile->pm[i][1] = s->pde;
+        tile->pm[i][2] = s->plx;
+        if (!s->hip && !s->hd && !s->tyc && !s->names) continue;
+        tile->extras = realloc(tile->extras,
+                (tile->nb_extras + 1) * sizeof(*tile->extras));
+        extra = &tile->extras[tile->nb_extras++];
+        extra->index = i;
+        extra->gaia = s->gaia;
+        extra->tyc = s->tyc;
+        extra->hip = s->hip;
+        extra->hd = s->hd;
+        extra->names = s->names; // Take ownership.
+    }
+}
+
+// Return the memory used by a tile, for the cache.
+static int tile_get_cost(const tile_t *tile)
+{
+    const int star_size = sizeof(*tile->pos) + sizeof(*tile->vmag) +
+                          sizeof(*tile->bv) + sizeof(*tile->oid) +
+                          sizeof(*tile->pm);
+    int i, ret;
+    ret = sizeof(*tile) + tile->nb * star_size +
+          tile->nb_extras * sizeof(*tile->extras);
+    for (i = 0; i < tile->nb_extras; i++) {
+        if (tile->extras[i].names)
+            ret += strlen(tile->extras[i].names) + 2;
+    }
+    return ret;
+}
+
 static int on_file_tile_loaded(const char type[4],
                                const void *data, int size, void *user)
 {
-    int version, nb, data_ofs = 0, row_size, flags, i, j, order, pix;
-    double vmag, ra, de, pra, pde, plx, bv;
-    char ids[256] = {};
+    int version, nb, data_ofs = 0, row_size, flags, i, j, order, pix, n = 0;
+    int *hip, *hd, *tyc;
+    uint64_t *gaia;
+    double *vmag, *ra, *de, *pra, *pde, *plx, *bv;
+    char *ids;
+    const char *row_ids;
     typeof(((stars_t*)0)->surveys[0]) *survey = USER_GET(user, 0);
     tile_t **out = USER_GET(user, 1); // Receive the tile.
     tile_t *tile;
     void *table_data;
-    star_data_t *s;
+    star_data_t *s, *sources;
 
     // All the columns we care about in the source file.
     eph_table_column_t columns[] = {
@@ -346,60 +544,94 @@ static int on_file_tile_loaded(const char type[4],
         return -1;
     }
 
-    table_data = eph_read_compressed_block(data, size, &data_ofs, &size);
+    table_data = eph_read_table_data(data, size, &data_ofs, flags, row_size,
+                                     nb, &size);
     if (!table_data) {
         LOG_E("Cannot get table data");
         return -1;
     }
     data_ofs = 0;
-    if (flags & 1) eph_shuffle_bytes(table_data, row_size, nb);
+
+    // Decode all the columns at once.  The gaia tiles don't have the ids
+    // column, so we only allocate it if needed.
+    gaia = malloc(nb * sizeof(*gaia));
+    hip = malloc(nb * sizeof(*hip));
+    hd = malloc(nb * sizeof(*hd));
+    tyc = malloc(nb * sizeof(*tyc));
+    vmag = malloc(nb * sizeof(*vmag));
+    ra = malloc(nb * sizeof(*ra));
+    de = malloc(nb * sizeof(*de));
+    plx = malloc(nb * sizeof(*plx));
+    pra = malloc(nb * sizeof(*pra));
+    pde = malloc(nb * sizeof(*pde));
+    bv = malloc(nb * sizeof(*bv));
+    ids = columns[11].got ? malloc(nb * 256) : NULL;
+    eph_read_table_columns(table_data, size, &data_ofs, nb,
+                           ARRAY_SIZE(columns), columns,
+                           gaia, hip, hd, tyc, vmag, ra, de, plx, pra, pde,
+                           bv, ids);
 
     tile = calloc(1, sizeof(*tile));
-    tile->sources = calloc(nb, sizeof(*tile->sources));
+    sources = calloc(nb, sizeof(*sources));
     tile->mag_min = DBL_MAX;
     tile->mag_max = -DBL_MAX;
 
     for (i = 0; i < nb; i++) {
-        s = &tile->sources[tile->nb];
-        eph_read_table_row(
-                table_data, size, &data_ofs, ARRAY_SIZE(columns), columns,
-                &s->gaia, &s->hip, &s->hd, &s->tyc, &vmag, &ra, &de, &plx,
-                &pra, &pde, &bv, ids);
-
-        assert(!isnan(ra));
-        assert(!isnan(de));
-        assert(!isnan(plx));
-
-        if (!isnan(survey->min_vmag) && (vmag < survey->min_vmag)) continue;
-        s->vmag = vmag;
-        s->ra = ra;
-        s->de = de;
-        s->pra = pra;
-        s->pde = pde;
-        s->plx = plx;
-        s->bv = isnan(bv) ? 0 : bv;
+        assert(!isnan(ra[i]));
+        assert(!isnan(de[i]));
+        assert(!isnan(plx[i]));
+
+        if (!isnan(survey->min_vmag) && (vmag[i] < survey->min_vmag))
+            continue;
+        s = &sources[n];
+        s->gaia = gaia[i];
+        s->hip = hip[i];
+        s->hd = hd[i];
+        s->tyc = tyc[i];
+        s->vmag = vmag[i];
+        s->ra = ra[i];
+        s->de = de[i];
+        s->pra = pra[i];
+        s->pde = pde[i];
+        s->plx = plx[i];
+        s->bv = isnan(bv[i]) ? 0 : bv[i];
         s->oid = s->hip ? oid_create("HIP ", s->hip) :
                  s->tyc ? oid_create("TYC ", s->tyc) :
                  s->gaia;
         assert(s->oid);
-        compute_pv(ra, de, pra, pde, plx, s);
-        s->illuminance = illuminance_for_vmag(vmag);
+        compute_pv(s->ra, s->de, s->pra, s->pde, s->plx, s);
+        s->illuminance = illuminance_for_vmag(s->vmag);
 
         // Turn '|' separated ids into '\0' separated values.
-        if (*ids) {
-            s->names = calloc(1, 2 + strlen(ids));
-            for (j = 0; ids[j]; j++)
-                s->names[j] = ids[j] != '|' ? ids[j] : '\0';
+        row_ids = ids ? &ids[i * 256] : "";
+        if (*row_ids) {
+            s->names = calloc(1, 2 + strnlen(row_ids, 256));
+            for (j = 0; j < 256 && row_ids[j]; j++)
+                s->names[j] = row_ids[j] != '|' ? row_ids[j] : '\0';
         }
 
-        tile->illuminance += illuminance_for_vmag(vmag);
-        tile->mag_min = min(tile->mag_min, vmag);
-        tile->mag_max = max(tile->mag_max, vmag);
-        tile->nb++;
+        tile->illuminance += s->illuminance;
+        tile->mag_min = min(tile->mag_min, s->vmag);
+        tile->mag_max = max(tile->mag_max, s->vmag);
+        n++;
     }
+    free(gaia);
+    free(hip);
+    free(hd);
+    free(tyc);
+    free(vmag);
+    free(ra);
+    free(de);
+    free(plx);
+    free(pra);
+    free(pde);
+    free(bv);
+    free(ids);
 
     // Sort the data by vmag, so that we can early exit during render.
-    qsort(tile->sources, tile->nb, sizeof(*tile->sources), star_data_cmp);
+    qsort(sources, n, sizeof(*sources), star_data_cmp);
+    tile_set_stars(tile, sources, n);
+    free(sources);
     free(table_data);
 
     *out = tile;
@@ -407,13 +639,13 @@ static int on_file_tile_loaded(const char type[4],
 }
 
 static const void *stars_create_tile(
-        void *user, int order, int pix, void *data, int size,
+        void *user, int order, int pix, void *data, int size, int flags,
         int *cost, int *transparency)
 {
     tile_t *tile;
     typeof(((stars_t*)0)->surveys[0]) *survey = user;
     eph_load(data, size, USER_PASS(survey, &tile), on_file_tile_loaded);
-    if (tile) *cost = tile->nb * sizeof(*tile->sources);
+    if (tile) *cost = tile_get_cost(tile);
     return tile;
 }
 
@@ -437,13 +669,222 @@ static int stars_init(obj_t *obj, json_value *args)
             "https://data.stellarium.org/surveys/gaia_dr2");
     stars->surveys[1].hips = hips_create(
             stars->surveys[1].url, 0, &survey_settings);
+    hips_set_importance(stars->surveys[1].hips, 2.0);
     return 0;
 }
 
+static uint64_t index_hash(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static index_entry_t *index_find(stars_t *stars, uint64_t key)
+{
+    int i, mask = stars->index.capacity - 1;
+    if (!stars->index.capacity) return NULL;
+    for (i = index_hash(key) & mask; ; i = (i + 1) & mask) {
+        if (stars->index.entries[i].key == key)
+            return &stars->index.entries[i];
+        if (!stars->index.entries[i].key) return NULL;
+    }
+}
+
+// Insert or replace an entry in the hash table.
+static void index_insert(stars_t *stars, const index_entry_t *entry)
+{
+    int i, mask, old_capacity = stars->index.capacity;
+    index_entry_t *old = stars->index.entries;
+
+    // Keep the load factor below 0.5.
+    if ((stars->index.nb + 1) * 2 > stars->index.capacity) {
+        stars->index.capacity = max(stars->index.capacity * 2, 1024);
+        stars->index.entries = calloc(stars->index.capacity,
+                                      sizeof(*stars->index.entries));
+        stars->index.nb = 0;
+        for (i = 0; i < old_capacity; i++)
+            if (old[i].key) index_insert(stars, &old[i]);
+        free(old);
+    }
+    mask = stars->index.capacity - 1;
+    for (i = index_hash(entry->key) & mask; ; i = (i + 1) & mask) {
+        if (stars->index.entries[i].key == entry->key) break;
+        if (!stars->index.entries[i].key) {
+            stars->index.nb++;
+            break;
+        }
+    }
+    stars->index.entries[i] = *entry;
+}
+
+// Queue an entry for the next save.
+static void index_queue(stars_t *stars, const index_entry_t *entry)
+{
+    if (stars->index.nb_pending >= stars->index.pending_capacity) {
+        stars->index.pending_capacity = max(
+                stars->index.pending_capacity * 2, 256);
+        stars->index.pending = realloc(stars->index.pending,
+                stars->index.pending_capacity * sizeof(*entry));
+    }
+    stars->index.pending[stars->index.nb_pending++] = *entry;
+}
+
+// Add an entry to the index, and queue it for the next save.
+static void index_add(stars_t *stars, const index_entry_t *entry)
+{
+    index_entry_t *e = index_find(stars, entry->key);
+    if (e && memcmp(e, entry, sizeof(*e)) == 0) return;
+    // Once the index is full we don't add new stars anymore, we will just
+    // search them in the tiles.
+    if (!e && stars->index.nb >= INDEX_MAX_NB) return;
+    index_insert(stars, entry);
+    index_queue(stars, entry);
+}
+
+static void index_remove(stars_t *stars, index_entry_t *entry)
+{
+    int i, j, k, mask = stars->index.capacity - 1;
+    // Backward shift deletion, so that we don't need tombstones.
+    i = entry - stars->index.entries;
+    stars->index.entries[i].key = 0;
+    for (j = (i + 1) & mask; stars->index.entries[j].key; j = (j + 1) & mask) {
+        k = index_hash(stars->index.entries[j].key) & mask;
+        // Move the entry if its ideal slot is not in (i, j].
+        if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+            stars->index.entries[i] = stars->index.entries[j];
+            stars->index.entries[j].key = 0;
+            i = j;
+        }
+    }
+    stars->index.nb--;
+}
+
+static void get_index_path(char *buf, int size)
+{
+    snprintf(buf, size, "%s/.cache/stars/index.bin", sys_get_user_dir());
+}
+
+static uint32_t get_survey_hash(const stars_t *stars, int survey)
+{
+    const char *url = stars->surveys[survey].url;
+    return crc32(0, (const Bytef*)url, strlen(url));
+}
+
+// Load the index saved from a previous session.
+static void index_load(stars_t *stars)
+{
+    char path[1024];
+    index_header_t header;
+    const index_entry_t *entries;
+    uint8_t *data;
+    uint32_t hash[2] = {get_survey_hash(stars, 0), get_survey_hash(stars, 1)};
+    int size, nb, i;
+
+    stars->index.loaded = true;
+    get_index_path(path, sizeof(path));
+    data = read_file(path, &size);
+    if (!data) return;
+    nb = (size - (int)sizeof(header)) / (int)sizeof(*entries);
+    memcpy(&header, data, min(size, sizeof(header)));
+    // If the file is invalid, or was made for other surveys, we delete it
+    // so that the next save starts a new one.
+    if (    size < sizeof(header) ||
+            memcmp(header.magic, "SIDX", 4) != 0 || header.version != 2 ||
+            memcmp(header.urls_hash, hash, sizeof(hash)) != 0) {
+        unlink(path);
+        goto end;
+    }
+    entries = (const index_entry_t*)(data + sizeof(header));
+    for (i = 0; i < nb && stars->index.nb < INDEX_MAX_NB; i++) {
+        if (entries[i].survey > 1 || !entries[i].key) continue;
+        index_insert(stars, &entries[i]);
+    }
+    // Too many replaced entries in the file, or a partially written one:
+    // rewrite it entirely at the next save.
+    if (    nb > stars->index.nb * 2 ||
+            nb * sizeof(*entries) != size - sizeof(header)) {
+        unlink(path);
+        for (i = 0; i < stars->index.capacity; i++) {
+            if (stars->index.entries[i].key)
+                index_queue(stars, &stars->index.entries[i]);
+        }
+    }
+end:
+    free(data);
+}
+
+// Append the new entries to the local index file.
+static void index_save(stars_t *stars)
+{
+    char path[1024];
+    index_header_t header = {
+        .magic = "SIDX",
+        .version = 2,
+        .urls_hash = {get_survey_hash(stars, 0), get_survey_hash(stars, 1)},
+    };
+    FILE *file;
+    int n;
+
+    stars->index.save_time = sys_get_unix_time();
+    get_index_path(path, sizeof(path));
+    sys_make_dir(path);
+    file = fopen(path, "ab");
+    if (!file) goto error;
+    fseek(file, 0, SEEK_END);
+    if (ftell(file) == 0 && fwrite(&header, sizeof(header), 1, file) != 1)
+        goto error;
+    n = stars->index.nb_pending;
+    if (fwrite(stars->index.pending, sizeof(index_entry_t), n, file) != n)
+        goto error;
+    if (fclose(file)) {
+        file = NULL;
+        goto error;
+    }
+    stars->index.nb_pending = 0;
+    return;
+
+error:
+    LOG_W("Cannot save stars index %s", path);
+    if (file) fclose(file);
+    // Start again from scratch next time.
+    unlink(path);
+}
+
+// Add the catalog ids of the stars of a tile to the index.
+static void index_add_tile(stars_t *stars, int survey, int order, int pix,
+                           const tile_t *tile)
+{
+    int i;
+    uint64_t oid;
+    const star_extra_t *extra;
+    index_entry_t entry = {.pix = pix, .survey = survey, .order = order};
+
+    if (!stars->index.loaded) index_load(stars);
+    // Only the stars with some catalog ids have an extra, the rows are
+    // stored on 16 bits, the stars after that are just not indexed, and we
+    // search them as before.
+    for (i = 0; i < tile->nb_extras; i++) {
+        extra = &tile->extras[i];
+        if (extra->index >= 1 << 16) break;
+        entry.row = extra->index;
+        oid = tile->oid[extra->index];
+        if (!oid_is_gaia(oid)) {
+            entry.key = oid;
+            index_add(stars, &entry);
+        }
+        if (extra->hd) {
+            entry.key = oid_create("HD  ", extra->hd);
+            index_add(stars, &entry);
+        }
+    }
+}
+
 static tile_t *get_tile(stars_t *stars, int survey, int order, int pix,
-                        bool *loading_complete)
+                        int flags, bool *loading_complete)
 {
-    int code, flags = 0;
+    int code;
     tile_t *tile;
     // Immediate load of the level 0 stars (they are needed for the
     // constellations).  The other tiles can be loaded in a thread.
@@ -451,24 +892,78 @@ static tile_t *get_tile(stars_t *stars, int survey, int order, int pix,
     tile = hips_get_tile(stars->surveys[survey].hips,
                          order, pix, flags, &code);
     if (loading_complete) *loading_complete = (code != 0);
+    // The tiles are parsed in the loading threads, so we only index them
+    // here, from the main thread.
+    if (tile && !(tile->flags & TILE_INDEXED)) {
+        tile->flags |= TILE_INDEXED;
+        index_add_tile(stars, survey, order, pix, tile);
+    }
     return tile;
 }
 
+/*
+ * Find a star from the index.
+ *
+ * Parameters:
+ *   key   - Index key (oid, HD oid or gaia id).
+ *   found - Set to true if the index knows the star.  In that case a NULL
+ *           return value means the tile is still loading.
+ */
+static obj_t *index_get_star(stars_t *stars, uint64_t key, bool *found)
+{
+    index_entry_t *entry;
+    tile_t *tile;
+    star_data_t s;
+
+    *found = false;
+    if (!stars->index.loaded) index_load(stars);
+    entry = index_find(stars, key);
+    if (!entry || !stars->surveys[entry->survey].hips) return NULL;
+    tile = get_tile(stars, entry->survey, entry->order, entry->pix, 0, NULL);
+    // The tile lookup could have added entries and moved this one.
+    entry = index_find(stars, key);
+    if (!entry) return NULL;
+    if (!tile) {
+        *found = true;
+        return NULL;
+    }
+    // Make sure the index is not out of date.
+    if (entry->row < tile->nb) {
+        tile_get_ids(tile, entry->row, &s);
+        if (    s.oid == key || s.gaia == key ||
+                (s.hd && oid_create("HD  ", s.hd) == key)) {
+            *found = true;
+            tile_get_star(tile, entry->row, &s);
+            return &star_create(&s)->obj;
+        }
+    }
+    index_remove(stars, entry);
+    return NULL;
+}
+
 bool debug_stars_show_all = false;
 
-static int render_visitor(int order, int pix, void *user)
+// Data shared by all the tiles during the rendering.
+typedef struct {
+    stars_t         *stars;
+    int             survey;
+    painter_t       painter;
+    int             nb_tot;
+    int             nb_loaded;
+    double          illuminance; // Total illuminance.
+} render_data_t;
+
+// Render a single tile, and return whether we should render its children.
+static bool render_tile(render_data_t *d, int order, int pix)
 {
-    PROFILE(stars_render_visitor, PROFILE_AGGREGATE);
-    stars_t *stars = USER_GET(user, 0);
-    int survey = *((int*)USER_GET(user, 1));
-    painter_t painter = *(const painter_t*)USER_GET(user, 2);
-    int *nb_tot = USER_GET(user, 3);
-    int *nb_loaded = USER_GET(user, 4);
-    double *illuminance = USER_GET(user, 5);
+    PROFILE(stars_render_tile, PROFILE_AGGREGATE);
+    stars_t *stars = d->stars;
+    int survey = d->survey;
+    painter_t painter = d->painter;
     tile_t *tile;
-    int i, n = 0;
-    star_data_t *s;
-    double p[4], p_win[4], size, luminance;
+    const star_extra_t *extra;
+    int i, j, n = 0, nb;
+    double size, luminance, vmag;
     double color[3], max_sep, fov, viewport_cap[4];
     bool loaded;
 
@@ -477,9 +972,9 @@ static int render_visitor(int order, int pix, void *user)
     if (painter_is_tile_clipped(&painter, FRAME_ASTROM, order, pix, true))
         return 0;
 
-    (*nb_tot)++;
-    tile = get_tile(stars, survey, order, pix, &loaded);
-    if (loaded) (*nb_loaded)++;
+    d->nb_tot++;
+    tile = get_tile(stars, survey, order, pix, HIPS_PIN, &loaded);
+    if (loaded) d->nb_loaded++;
 
     if (!tile) goto end;
     if (tile->mag_min > painter.mag_max) goto end;
@@ -497,50 +992,40 @@ static int render_visitor(int order, int pix, void *user)
     mat3_mul_vec3(painter.obs->rh2i, viewport_cap, viewport_cap);
     viewport_cap[3] = cos(max_sep);
 
-    point_t *points = malloc(tile->nb * sizeof(*points));
-    for (i = 0; i < tile->nb; i++) {
-        s = &tile->sources[i];
-        if (s->vmag > painter.mag_max) break;
-        if (vec3_dot(s->pos, viewport_cap) < viewport_cap[3]) continue;
-
-        // Compute star observed and screen pos.
-        vec3_copy(s->pos, p);
-        p[3] = 0;
-        //astrometric_to_apparent(painter.obs, p, true, p);
-        convert_frame(painter.obs, FRAME_ASTROM, FRAME_OBSERVED, true, p, p);
-        // Skip if below horizon.
-        if ((painter.flags & PAINTER_HIDE_BELOW_HORIZON) && p[2] < 0)
-            continue;
-        // Skip if not visible.
-        convert_frame(painter.obs, FRAME_OBSERVED, FRAME_VIEW, true, p, p);
-        if (!project(painter.proj, PROJ_TO_WINDOW_SPACE |
-                     PROJ_ALREADY_NORMALIZED, 2, p, p_win))
-            continue;
-
-        (*illuminance) += s->illuminance;
-        core_get_point_for_mag(s->vmag, &size, &luminance);
-        bv_to_rgb(s->bv, color);
-        points[n] = (point_t) {
-            .pos = {p_win[0], p_win[1], 0, 0},
-            .size = size,
-            .color = {color[0], color[1], color[2], luminance},
-            .oid = s->oid,
-        };
-        n++;
-        if (s->vmag <= painter.label_mag_max && survey != SURVEY_GAIA)
-            star_render_name(&painter, s, p_win, size, s->vmag, color);
+    // The stars are sorted by vmag, so we only need the first ones.
+    for (nb = 0; nb < tile->nb; nb++) {
+        if (tile->vmag[nb] / 1000.0 > painter.mag_max) break;
+    }
+    point_t *points = arena_alloc(core->frame_arena, nb * sizeof(*points));
+    int *index = arena_alloc(core->frame_arena, nb * sizeof(*index));
+    n = painter_project_stars(&painter, nb, tile->pos, viewport_cap,
+                              index, points);
+    for (j = 0; j < n; j++) {
+        i = index[j];
+        vmag = tile->vmag[i] / 1000.0;
+        d->illuminance += illuminance_for_vmag(vmag);
+        core_get_point_for_mag(vmag, &size, &luminance);
+        bv_to_rgb(tile->bv[i] / 1000.0, color);
+        points[j].size = size;
+        vec4_set(points[j].color, color[0], color[1], color[2], luminance);
+        points[j].oid = tile->oid[i];
+        if (vmag <= painter.label_mag_max && survey != SURVEY_GAIA) {
+            extra = tile_get_extra(tile, i);
+            if (extra)
+                star_render_name(&painter, tile->oid[i], extra->hip,
+                                 extra->hd, points[j].pos, size, vmag, color);
+        }
     }
     paint_points(&painter, n, points, FRAME_WINDOW);
-    free(points);
 
 end:
     // Test if we should go into higher order tiles.
     // Since for the moment we have two different surveys, keep going
     // until order 3 no matter what, so that we reach the gaia survey.
-    if (order < 3 && painter.mag_max > GAIA_MIN_MAG) return 1;
-    if (!tile) return 0;
-    if (tile->mag_max > painter.mag_max) return 0;
-    return 1;
+    if (order < 3 && painter.mag_max > GAIA_MIN_MAG) return true;
+    if (!tile) return false;
+    if (tile->mag_max > painter.mag_max) return false;
+    return true;
 }
 
 
@@ -548,27 +1033,39 @@ static int stars_render(const obj_t *obj, const painter_t *painter_)
 {
     PROFILE(stars_render, 0);
     stars_t *stars = (stars_t*)obj;
-    int i, nb_tot = 0, nb_loaded = 0;
-    double illuminance = 0; // Totall illuminance
-    painter_t painter = *painter_;
+    // Only used from the main thread, so we can keep the same iterator.
+    static hips_iterator_t iter = {};
+    int order, pix;
+    double illuminance;
+    render_data_t d = {
+        .stars = stars,
+        .painter = *painter_,
+    };
 
     if (!stars->visible) return 0;
 
-    for (i = 0; i < ARRAY_SIZE(stars->surveys); i++) {
-        if (!stars->surveys[i].hips) break;
-        hips_traverse(USER_PASS(stars, &i, &painter,
-                      &nb_tot, &nb_loaded, &illuminance),
-                      render_visitor);
+    for (d.survey = 0; d.survey < ARRAY_SIZE(stars->surveys); d.survey++) {
+        if (!stars->surveys[d.survey].hips) break;
+        hips_iterator_init(&iter, HIPS_ITER_BFS);
+        while (hips_iterator_next(&iter, &order, &pix)) {
+            if (render_tile(&d, order, pix))
+                hips_iterator_push_children(&iter, order, pix);
+        }
     }
 
     /* Ad-hoc formula to adjust tonemapping when many stars are visible.
      * I think the illuminance computation is correct, but should we use
      * core_report_illuminance_in_fov?  Also the factor used (20) is
      * arbitrary.*/
-    illuminance *= core->telescope.light_grasp;
+    illuminance = d.illuminance * core->telescope.light_grasp;
     core_report_luminance_in_fov(illuminance * 20.0, false);
 
-    progressbar_report("stars", "Stars", nb_loaded, nb_tot, -1);
+    progressbar_report("stars", "Stars", d.nb_loaded, d.nb_tot, -1);
+
+    // Save the ids we indexed.
+    if (    stars->index.nb_pending && sys_get_unix_time() >
+            stars->index.save_time + INDEX_SAVE_DELAY)
+        index_save(stars);
     return 0;
 }
 
@@ -583,6 +1080,7 @@ static int stars_get_visitor(int order, int pix, void *user)
         uint64_t    n;
     } *d = user;
     tile_t *tile;
+    star_data_t s;
 
     is_gaia = d->cat == 2 || (d->cat == 3 && oid_is_gaia(d->n));
 
@@ -592,20 +1090,24 @@ static int stars_get_visitor(int order, int pix, void *user)
             return 0;
     }
 
-    tile = get_tile(d->stars, 0, order, pix, NULL);
-    if (!tile && is_gaia) tile = get_tile(d->stars, 1, order, pix, NULL);
+    tile = get_tile(d->stars, 0, order, pix, 0, NULL);
+    if (!tile && is_gaia) tile = get_tile(d->stars, 1, order, pix, 0, NULL);
 
     // Gaia survey has a min order of 3.
     // XXX: read the survey properties file instead of hard coding!
     if (!tile) return order < 3 ? 1 : 0;
     for (i = 0; i < tile->nb; i++) {
-        if (    (d->cat == 0 && tile->sources[i].hip == d->n) ||
-                (d->cat == 1 && tile->sources[i].hd  == d->n) ||
-                (d->cat == 2 && tile->sources[i].gaia == d->n) ||
-                (d->cat == 3 && tile->sources[i].oid  == d->n)) {
-            d->ret = &star_create(&tile->sources[i])->obj;
-            return -1; // Stop the search.
+        if (d->cat == 3 && tile->oid[i] != d->n) continue;
+        if (d->cat != 3) {
+            // Only unpack the ids, since most of the stars don't match.
+            tile_get_ids(tile, i, &s);
+            if (d->cat == 0 && s.hip != d->n) continue;
+            if (d->cat == 1 && s.hd != d->n) continue;
+            if (d->cat == 2 && s.gaia != d->n) continue;
         }
+        tile_get_star(tile, i, &s);
+        d->ret = &star_create(&s)->obj;
+        return -1; // Stop the search.
     }
     return 1;
 }
@@ -613,8 +1115,10 @@ static int stars_get_visitor(int order, int pix, void *user)
 static obj_t *stars_get(const obj_t *obj, const char *id, int flags)
 {
     int r, cat;
-    uint64_t n = 0;
+    uint64_t n = 0, key;
     regmatch_t matches[3];
+    obj_t *ret;
+    bool found;
 
     stars_t *stars = (stars_t*)obj;
     r = regexec(&stars->search_reg, id, 3, matches, 0);
@@ -624,6 +1128,11 @@ static obj_t *stars_get(const obj_t *obj, const char *id, int flags)
     if (strncasecmp(id, "hd", 2) == 0) cat = 1;
     if (strncasecmp(id, "gaia", 4) == 0) cat = 2;
 
+    key = cat == 0 ? oid_create("HIP ", n) :
+          cat == 1 ? oid_create("HD  ", n) : n;
+    ret = index_get_star(stars, key, &found);
+    if (ret || found) return ret;
+
     struct {
         stars_t  *stars;
         obj_t    *ret;
@@ -643,9 +1152,13 @@ static obj_t *stars_get_by_oid(const obj_t *obj, uint64_t oid, uint64_t hint)
         int      cat;
         uint64_t n;
     } d = {.stars=(void*)obj, .cat=3, .n=oid};
+    obj_t *ret;
+    bool found;
     if (    !oid_is_catalog(oid, "HIP ") &&
             !oid_is_catalog(oid, "TYC ") &&
             !oid_is_gaia(oid)) return NULL;
+    ret = index_get_star((stars_t*)obj, oid, &found);
+    if (ret || found) return ret;
     hips_traverse(&d, stars_get_visitor);
     return d.ret;
 }
@@ -655,6 +1168,7 @@ static int stars_list_visitor(int order, int pix, void *user)
 {
     int i, r;
     star_t *star = NULL;
+    star_data_t s;
     struct {
         stars_t *stars;
         double max_mag;
@@ -663,13 +1177,14 @@ static int stars_list_visitor(int order, int pix, void *user)
         void *user;
     } *d = user;
     tile_t *tile;
-    tile = get_tile(d->stars, 0, order, pix, NULL);
+    tile = get_tile(d->stars, 0, order, pix, 0, NULL);
     if (!tile || tile->mag_max <= d->max_mag) return 0;
     for (i = 0; i < tile->nb; i++) {
-        if (tile->sources[i].vmag > d->max_mag) continue;
+        if (tile->vmag[i] / 1000.0 > d->max_mag) continue;
         d->nb++;
         if (!d->f) continue;
-        star = star_create(&tile->sources[i]);
+        tile_get_star(tile, i, &s);
+        star = star_create(&s);
         r = d->f(d->user, (obj_t*)star);
         obj_release((obj_t*)star);
         if (r) break;
@@ -685,6 +1200,7 @@ static int stars_list(const obj_t *obj, observer_t *obs,
     tile_t *tile;
     stars_t *stars = (void*)obj;
     star_t *star;
+    star_data_t s;
 
     struct {
         stars_t *stars;
@@ -702,12 +1218,13 @@ static int stars_list(const obj_t *obj, observer_t *obs,
     // Get tile from hint (as nuniq).
     order = log2(hint / 4) / 2;
     pix = hint - 4 * (1 << (2 * (order)));
-    tile = get_tile(stars, 0, order, pix, NULL);
+    tile = get_tile(stars, 0, order, pix, 0, NULL);
     if (!tile) return 0;
     for (i = 0; i < tile->nb; i++) {
         if (!f) continue;
         nb++;
-        star = star_create(&tile->sources[i]);
+        tile_get_star(tile, i, &s);
+        star = star_create(&s);
         r = f(user, (obj_t*)star);
         obj_release((obj_t*)star);
         if (r) break;
@@ -736,6 +1253,7 @@ static int stars_add_data_source(
     sprintf(stars->surveys[0].url, "%s", url);
     stars->surveys[0].hips = hips_create(
             stars->surveys[0].url, 0, &survey_settings);
+    hips_set_importance(stars->surveys[0].hips, 2.0);
     stars->surveys[0].min_vmag = NAN;
 
     // Tell online gaia survey to only start after the vmag for this survey.
@@ -817,4 +1335,43 @@ static void test_create_from_json(void)
 }
 TEST_REGISTER(NULL, test_create_from_json, TEST_AUTO);
 
+static void test_stars_index(void)
+{
+    stars_t stars = {.index.loaded = true};
+    index_entry_t entry = {0}, *e;
+    const int nb = 5000;
+    int i;
+
+    for (i = 0; i < nb; i++) {
+        entry.key = oid_create("HIP ", i + 1);
+        entry.pix = i;
+        index_add(&stars, &entry);
+    }
+    assert(stars.index.nb == nb && stars.index.nb_pending == nb);
+    // Adding the same entry again doesn't need a new save.
+    entry.key = oid_create("HIP ", 1);
+    entry.pix = 0;
+    index_add(&stars, &entry);
+    assert(stars.index.nb_pending == nb);
+    // Remove one star out of three, and check the others are still found.
+    for (i = 0; i < nb; i += 3)
+        index_remove(&stars, index_find(&stars, oid_create("HIP ", i + 1)));
+    for (i = 0; i < nb; i++) {
+        e = index_find(&stars, oid_create("HIP ", i + 1));
+        assert((i % 3 == 0) == (e == NULL));
+        assert(!e || e->pix == i);
+    }
+    assert(stars.index.nb == nb - (nb + 2) / 3);
+
+    // Once full, the index doesn't accept new stars.
+    for (i = 0; i < INDEX_MAX_NB + 10; i++) {
+        entry.key = oid_create("TYC ", i + 1);
+        index_add(&stars, &entry);
+    }
+    assert(stars.index.nb == INDEX_MAX_NB);
+    free(stars.index.entries);
+    free(stars.index.pending);
+}
+TEST_REGISTER(NULL, test_stars_index, TEST_AUTO);
+
 #endif
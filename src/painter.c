@@ -29,6 +29,8 @@ int paint_finish(const painter_t *painter)
 {
     PROFILE(paint_finish, 0);
     REND(painter->rend, finish);
+    // All the transient render data has been used now.
+    if (core->frame_arena) arena_reset(core->frame_arena);
     return 0;
 }
 
@@ -479,3 +481,474 @@ int paint_2d_line(const painter_t *painter, const double transf[3][3],
     REND(painter->rend, line_2d, painter, p1_win, p2_win);
     return 0;
 }
+
+/*
+ * Batched projection of the stars.
+ *
+ * The stars directions are stored as floats, so we can do all the
+ * computation in single precision, four stars at a time with SSE.  The
+ * aberration and light deflection are the same formulas as eraAb and
+ * eraLdsun, and all the rotations from ICRS to the observed frame are
+ * merged into a single matrix.
+ */
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+typedef struct {
+    float cap[4];       // Viewport cap.
+    float eh[3];        // Sun to observer unit vector.
+    float ld_k;         // Light deflection factor (SRS / em).
+    float ld_dlim;      // Light deflection limiter.
+    float v[3];         // Observer barycentric velocity (c units).
+    float bm1;          // sqrt(1 - |v|^2).
+    float ab_k1;        // 1 / (1 + bm1).
+    float ab_k2;        // SRS / em.
+    float ri2h[3][3];   // ICRS to horizontal (row major).
+    bool  refraction;
+    float refa, refb;
+    bool  hide_below_horizon;
+    float ro2v[3][3];   // Horizontal to view (row major).
+    int   proj;
+    float proj_mat[4][4]; // Perspective matrix (row major).
+    float scaling[2];
+    float window_size[2];
+} stars_batch_t;
+
+// Store a column major rotation as a row major float matrix.
+static void batch_set_mat(const double m[3][3], float out[3][3])
+{
+    int i, j;
+    for (i = 0; i < 3; i++)
+    for (j = 0; j < 3; j++)
+        out[i][j] = m[j][i];
+}
+
+// Check if we can use the batched projection, and setup the parameters.
+static bool stars_batch_init(const painter_t *painter, const double cap[4],
+                             stars_batch_t *b)
+{
+    const observer_t *obs = painter->obs;
+    const projection_t *proj = painter->proj;
+    double em2, ri2c[3][3], m[3][3];
+    int i, j;
+
+    if (proj->type != PROJ_PERSPECTIVE && proj->type != PROJ_STEREOGRAPHIC)
+        return false;
+    // Single precision gives about 0.02 arcsec, only use it when this is
+    // well below the size of a pixel.
+    if (2 * proj->scaling[0] / proj->window_size[0] < 1e-5) return false;
+
+    memset(b, 0, sizeof(*b));
+    for (i = 0; i < 4; i++) b->cap[i] = cap[i];
+    em2 = max(obs->astrom.em * obs->astrom.em, 1.0);
+    for (i = 0; i < 3; i++) {
+        b->eh[i] = obs->astrom.eh[i];
+        b->v[i] = obs->astrom.v[i];
+    }
+    b->ld_k = ERFA_SRS / obs->astrom.em;
+    b->ld_dlim = 1e-6 / em2;
+    b->bm1 = obs->astrom.bm1;
+    b->ab_k1 = 1.0 / (1.0 + obs->astrom.bm1);
+    b->ab_k2 = ERFA_SRS / obs->astrom.em;
+    // eraRxp uses row major matrices.
+    mat3_transpose(obs->astrom.bpn, ri2c);
+
+    // ICRS to horizontal without refraction.
+    mat3_mul(obs->ri2h, ri2c, m);
+    batch_set_mat(m, b->ri2h);
+    b->refa = obs->astrom.refa;
+    b->refb = obs->astrom.refb;
+    b->refraction = b->refa != 0.0 || b->refb != 0.0;
+    b->hide_below_horizon = painter->flags & PAINTER_HIDE_BELOW_HORIZON;
+    batch_set_mat(obs->ro2v, b->ro2v);
+
+    b->proj = proj->type;
+    for (i = 0; i < 4; i++)
+    for (j = 0; j < 4; j++)
+        b->proj_mat[i][j] = proj->mat[j][i];
+    for (i = 0; i < 2; i++) {
+        b->scaling[i] = proj->scaling[i];
+        b->window_size[i] = proj->window_size[i];
+    }
+    return true;
+}
+
+// Scalar version of the batched projection, for a single star.
+static bool stars_batch_project1(const stars_batch_t *b, const float pos[3],
+                                 double out[2])
+{
+    float x = pos[0], y = pos[1], z = pos[2];
+    float d, w, w1, px, py, pz, r, tz, del, cosdel, f, zz, cx, cy, cz, cw;
+
+    if (x * b->cap[0] + y * b->cap[1] + z * b->cap[2] < b->cap[3])
+        return false;
+
+    // Light deflection by the Sun (eraLdsun).
+    d = x * b->eh[0] + y * b->eh[1] + z * b->eh[2];
+    w = b->ld_k / max(1.0f + d, b->ld_dlim);
+    x += w * (b->eh[0] - d * x);
+    y += w * (b->eh[1] - d * y);
+    z += w * (b->eh[2] - d * z);
+
+    // Aberration (eraAb).
+    d = x * b->v[0] + y * b->v[1] + z * b->v[2];
+    w1 = 1.0f + d * b->ab_k1;
+    px = x * b->bm1 + w1 * b->v[0] + b->ab_k2 * (b->v[0] - d * x);
+    py = y * b->bm1 + w1 * b->v[1] + b->ab_k2 * (b->v[1] - d * y);
+    pz = z * b->bm1 + w1 * b->v[2] + b->ab_k2 * (b->v[2] - d * z);
+
+    // To horizontal.
+    x = b->ri2h[0][0] * px + b->ri2h[0][1] * py + b->ri2h[0][2] * pz;
+    y = b->ri2h[1][0] * px + b->ri2h[1][1] * py + b->ri2h[1][2] * pz;
+    z = b->ri2h[2][0] * px + b->ri2h[2][1] * py + b->ri2h[2][2] * pz;
+
+    // Refraction (see refraction.c).
+    if (b->refraction) {
+        r = max(sqrtf(x * x + y * y), 1e-6f);
+        zz = max(z, 0.05f);
+        tz = r / zz;
+        w = b->refb * tz * tz;
+        del = (b->refa + w) * tz / (1.0f + (b->refa + 3.0f * w) / (zz * zz));
+        cosdel = 1.0f - del * del / 2.0f;
+        f = cosdel - del * zz / r;
+        x *= f;
+        y *= f;
+        z = cosdel * z + del * r;
+    }
+    // The aberration and refraction don't keep the norm.
+    r = 1.0f / sqrtf(x * x + y * y + z * z);
+    x *= r;
+    y *= r;
+    z *= r;
+    if (b->hide_below_horizon && z < 0) return false;
+
+    // To view.
+    px = b->ro2v[0][0] * x + b->ro2v[0][1] * y + b->ro2v[0][2] * z;
+    py = b->ro2v[1][0] * x + b->ro2v[1][1] * y + b->ro2v[1][2] * z;
+    pz = b->ro2v[2][0] * x + b->ro2v[2][1] * y + b->ro2v[2][2] * z;
+
+    // Projection.
+    if (b->proj == PROJ_PERSPECTIVE) {
+        cx = b->proj_mat[0][0] * px + b->proj_mat[0][1] * py +
+             b->proj_mat[0][2] * pz + b->proj_mat[0][3];
+        cy = b->proj_mat[1][0] * px + b->proj_mat[1][1] * py +
+             b->proj_mat[1][2] * pz + b->proj_mat[1][3];
+        cz = b->proj_mat[2][0] * px + b->proj_mat[2][1] * py +
+             b->proj_mat[2][2] * pz + b->proj_mat[2][3];
+        cw = b->proj_mat[3][0] * px + b->proj_mat[3][1] * py +
+             b->proj_mat[3][2] * pz + b->proj_mat[3][3];
+        if (!(fabsf(cx) <= cw && fabsf(cy) <= cw && fabsf(cz) <= cw))
+            return false;
+        cx /= cw;
+        cy /= cw;
+    } else {
+        w = 2.0f / (1.0f - pz);
+        cx = px * w / b->scaling[0];
+        cy = py * w / b->scaling[1];
+        if (!(fabsf(cx) <= 1.0f && fabsf(cy) <= 1.0f)) return false;
+    }
+    out[0] = (+cx + 1) / 2 * b->window_size[0];
+    out[1] = (-cy + 1) / 2 * b->window_size[1];
+    return true;
+}
+
+#ifdef __SSE2__
+
+#define SPLAT(v) _mm_set1_ps(v)
+
+static inline __m128 dot3_ps(__m128 x, __m128 y, __m128 z, const float v[3])
+{
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, SPLAT(v[0])),
+                                 _mm_mul_ps(y, SPLAT(v[1]))),
+                      _mm_mul_ps(z, SPLAT(v[2])));
+}
+
+static inline __m128 abs_ps(__m128 x)
+{
+    return _mm_andnot_ps(SPLAT(-0.0f), x);
+}
+
+// Same as stars_batch_project1, for four stars at once.
+// Return the mask of the visible stars.
+static int stars_batch_project4(const stars_batch_t *b, const float (*pos)[3],
+                                float out_x[4], float out_y[4])
+{
+    __m128 x, y, z, d, w, w1, px, py, pz, r, zz, tz, del, cosdel, f, m;
+    __m128 cx, cy, cz, cw;
+    const __m128 one = SPLAT(1.0f);
+
+    x = _mm_setr_ps(pos[0][0], pos[1][0], pos[2][0], pos[3][0]);
+    y = _mm_setr_ps(pos[0][1], pos[1][1], pos[2][1], pos[3][1]);
+    z = _mm_setr_ps(pos[0][2], pos[1][2], pos[2][2], pos[3][2]);
+
+    m = _mm_cmpge_ps(dot3_ps(x, y, z, b->cap), SPLAT(b->cap[3]));
+    if (!_mm_movemask_ps(m)) return 0;
+
+    // Light deflection by the Sun (eraLdsun).
+    d = dot3_ps(x, y, z, b->eh);
+    w = _mm_div_ps(SPLAT(b->ld_k),
+                   _mm_max_ps(_mm_add_ps(one, d), SPLAT(b->ld_dlim)));
+    x = _mm_add_ps(x, _mm_mul_ps(w, _mm_sub_ps(SPLAT(b->eh[0]),
+                                               _mm_mul_ps(d, x))));
+    y = _mm_add_ps(y, _mm_mul_ps(w, _mm_sub_ps(SPLAT(b->eh[1]),
+                                               _mm_mul_ps(d, y))));
+    z = _mm_add_ps(z, _mm_mul_ps(w, _mm_sub_ps(SPLAT(b->eh[2]),
+                                               _mm_mul_ps(d, z))));
+
+    // Aberration (eraAb).
+    d = dot3_ps(x, y, z, b->v);
+    w1 = _mm_add_ps(one, _mm_mul_ps(d, SPLAT(b->ab_k1)));
+#define ABERRATION(p, c) _mm_add_ps(_mm_add_ps( \
+            _mm_mul_ps(p, SPLAT(b->bm1)), _mm_mul_ps(w1, SPLAT(b->v[c]))), \
+            _mm_mul_ps(SPLAT(b->ab_k2), \
+                       _mm_sub_ps(SPLAT(b->v[c]), _mm_mul_ps(d, p))))
+    px = ABERRATION(x, 0);
+    py = ABERRATION(y, 1);
+    pz = ABERRATION(z, 2);
+#undef ABERRATION
+
+    // To horizontal.
+    x = dot3_ps(px, py, pz, b->ri2h[0]);
+    y = dot3_ps(px, py, pz, b->ri2h[1]);
+    z = dot3_ps(px, py, pz, b->ri2h[2]);
+
+    // Refraction (see refraction.c).
+    if (b->refraction) {
+        r = _mm_max_ps(_mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(x, x),
+                                              _mm_mul_ps(y, y))),
+                       SPLAT(1e-6f));
+        zz = _mm_max_ps(z, SPLAT(0.05f));
+        tz = _mm_div_ps(r, zz);
+        w = _mm_mul_ps(SPLAT(b->refb), _mm_mul_ps(tz, tz));
+        del = _mm_div_ps(
+            _mm_mul_ps(_mm_add_ps(SPLAT(b->refa), w), tz),
+            _mm_add_ps(one, _mm_div_ps(
+                _mm_add_ps(SPLAT(b->refa), _mm_mul_ps(SPLAT(3.0f), w)),
+                _mm_mul_ps(zz, zz))));
+        cosdel = _mm_sub_ps(one, _mm_mul_ps(SPLAT(0.5f),
+                                            _mm_mul_ps(del, del)));
+        f = _mm_sub_ps(cosdel, _mm_div_ps(_mm_mul_ps(del, zz), r));
+        x = _mm_mul_ps(x, f);
+        y = _mm_mul_ps(y, f);
+        z = _mm_add_ps(_mm_mul_ps(cosdel, z), _mm_mul_ps(del, r));
+    }
+    r = _mm_div_ps(one, _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(
+            _mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z))));
+    x = _mm_mul_ps(x, r);
+    y = _mm_mul_ps(y, r);
+    z = _mm_mul_ps(z, r);
+    if (b->hide_below_horizon)
+        m = _mm_and_ps(m, _mm_cmpge_ps(z, _mm_setzero_ps()));
+
+    // To view.
+    px = dot3_ps(x, y, z, b->ro2v[0]);
+    py = dot3_ps(x, y, z, b->ro2v[1]);
+    pz = dot3_ps(x, y, z, b->ro2v[2]);
+
+    // Projection.
+    if (b->proj == PROJ_PERSPECTIVE) {
+        cx = _mm_add_ps(dot3_ps(px, py, pz, b->proj_mat[0]),
+                        SPLAT(b->proj_mat[0][3]));
+        cy = _mm_add_ps(dot3_ps(px, py, pz, b->proj_mat[1]),
+                        SPLAT(b->proj_mat[1][3]));
+        cz = _mm_add_ps(dot3_ps(px, py, pz, b->proj_mat[2]),
+                        SPLAT(b->proj_mat[2][3]));
+        cw = _mm_add_ps(dot3_ps(px, py, pz, b->proj_mat[3]),
+                        SPLAT(b->proj_mat[3][3]));
+        m = _mm_and_ps(m, _mm_cmple_ps(abs_ps(cx), cw));
+        m = _mm_and_ps(m, _mm_cmple_ps(abs_ps(cy), cw));
+        m = _mm_and_ps(m, _mm_cmple_ps(abs_ps(cz), cw));
+        cx = _mm_div_ps(cx, cw);
+        cy = _mm_div_ps(cy, cw);
+    } else {
+        w = _mm_div_ps(SPLAT(2.0f), _mm_sub_ps(one, pz));
+        cx = _mm_div_ps(_mm_mul_ps(px, w), SPLAT(b->scaling[0]));
+        cy = _mm_div_ps(_mm_mul_ps(py, w), SPLAT(b->scaling[1]));
+        m = _mm_and_ps(m, _mm_cmple_ps(abs_ps(cx), one));
+        m = _mm_and_ps(m, _mm_cmple_ps(abs_ps(cy), one));
+    }
+    _mm_storeu_ps(out_x, _mm_mul_ps(_mm_add_ps(cx, one),
+                                    SPLAT(b->window_size[0] / 2)));
+    _mm_storeu_ps(out_y, _mm_mul_ps(_mm_sub_ps(one, cy),
+                                    SPLAT(b->window_size[1] / 2)));
+    return _mm_movemask_ps(m);
+}
+
+#undef SPLAT
+
+#endif // __SSE2__
+
+int painter_project_stars(const painter_t *painter, int n,
+                          const float (*pos)[3], const double cap[4],
+                          int *index, point_t *points)
+{
+    PROFILE(painter_project_stars, PROFILE_AGGREGATE);
+    stars_batch_t b;
+    double p[4], p_win[4];
+    int i, nb = 0;
+#ifdef __SSE2__
+    float x[4], y[4];
+    int j, mask;
+#endif
+
+    if (!stars_batch_init(painter, cap, &b)) {
+        // Double precision path, for the other projections and very
+        // small fov.
+        for (i = 0; i < n; i++) {
+            // Float positions are only normalized to float precision.
+            vec3_set(p, pos[i][0], pos[i][1], pos[i][2]);
+            vec3_normalize(p, p);
+            p[3] = 0;
+            if (vec3_dot(p, cap) < cap[3]) continue;
+            convert_frame(painter->obs, FRAME_ASTROM, FRAME_OBSERVED, true,
+                          p, p);
+            if ((painter->flags & PAINTER_HIDE_BELOW_HORIZON) && p[2] < 0)
+                continue;
+            convert_frame(painter->obs, FRAME_OBSERVED, FRAME_VIEW, true,
+                          p, p);
+            if (!project(painter->proj, PROJ_TO_WINDOW_SPACE |
+                         PROJ_ALREADY_NORMALIZED, 2, p, p_win))
+                continue;
+            index[nb] = i;
+            points[nb] = (point_t) {.pos = {p_win[0], p_win[1]}};
+            nb++;
+        }
+        return nb;
+    }
+
+    i = 0;
+#ifdef __SSE2__
+    for (; i + 4 <= n; i += 4) {
+        mask = stars_batch_project4(&b, pos + i, x, y);
+        for (j = 0; j < 4; j++) {
+            if (!(mask & (1 << j))) continue;
+            index[nb] = i + j;
+            points[nb] = (point_t) {.pos = {x[j], y[j]}};
+            nb++;
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        if (!stars_batch_project1(&b, pos[i], p_win)) continue;
+        index[nb] = i;
+        points[nb] = (point_t) {.pos = {p_win[0], p_win[1]}};
+        nb++;
+    }
+    return nb;
+}
+
+/******** TESTS ***********************************************************/
+
+#if COMPILE_TESTS
+
+#include <time.h>
+
+// Setup a painter looking at a dense field of random stars.
+static float (*test_stars_setup(painter_t *painter, projection_t *proj,
+                                int n, double cap[4]))[3]
+{
+    float (*pos)[3] = malloc(n * sizeof(*pos));
+    observer_t *obs;
+    double p[3];
+    int i, j;
+
+    core_init(100, 100, 1.0);
+    obs = core->observer;
+    obj_set_attr((obj_t*)obs, "utc", "f", 58450.0);
+    obj_set_attr((obj_t*)obs, "longitude", "f", -84.388 * DD2R);
+    obj_set_attr((obj_t*)obs, "latitude", "f", 33.749 * DD2R);
+    obj_set_attr((obj_t*)obs, "azimuth", "f", 30 * DD2R);
+    obj_set_attr((obj_t*)obs, "altitude", "f", 40 * DD2R);
+    obs->refraction = true;
+    observer_update(obs, false);
+    *painter = (painter_t) {.obs = obs, .proj = proj,
+                            .flags = PAINTER_HIDE_BELOW_HORIZON};
+
+    eraS2c(obs->azimuth, obs->altitude, cap);
+    mat3_mul_vec3(obs->rh2i, cap, cap);
+    cap[3] = cos(40 * DD2R);
+    srand(0);
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < 3; j++) p[j] = (rand() / (double)RAND_MAX) * 2 - 1;
+        vec3_mix(cap, p, 0.25, p);
+        vec3_normalize(p, p);
+        for (j = 0; j < 3; j++) pos[i][j] = p[j];
+    }
+    return pos;
+}
+
+static void test_painter_project_stars(void)
+{
+    const int n = 10000;
+    const int projs[] = {PROJ_PERSPECTIVE, PROJ_STEREOGRAPHIC};
+    painter_t painter;
+    projection_t proj;
+    float (*pos)[3];
+    double cap[4], p[4], p_win[4];
+    int i, j, k, nb, nb_ref, *index = malloc(n * sizeof(*index));
+    point_t *points = malloc(n * sizeof(*points));
+
+    pos = test_stars_setup(&painter, &proj, n, cap);
+    for (k = 0; k < ARRAY_SIZE(projs); k++) {
+        projection_init(&proj, projs[k], 60 * DD2R, 800, 600);
+        nb = painter_project_stars(&painter, n, pos, cap, index, points);
+        // Compare to the double precision path.
+        nb_ref = 0;
+        j = 0;
+        for (i = 0; i < n; i++) {
+            vec3_set(p, pos[i][0], pos[i][1], pos[i][2]);
+            vec3_normalize(p, p);
+            if (vec3_dot(p, cap) < cap[3]) continue;
+            convert_frame(painter.obs, FRAME_ASTROM, FRAME_OBSERVED, true,
+                          p, p);
+            if (p[2] < 0) continue;
+            convert_frame(painter.obs, FRAME_OBSERVED, FRAME_VIEW, true,
+                          p, p);
+            if (!project(&proj, PROJ_TO_WINDOW_SPACE |
+                         PROJ_ALREADY_NORMALIZED, 2, p, p_win))
+                continue;
+            nb_ref++;
+            // Stars right on the border can go either way.
+            while (j < nb && index[j] < i) j++;
+            if (j < nb && index[j] == i)
+                assert(vec2_dist(p_win, points[j].pos) < 0.01);
+        }
+        assert(nb > n / 4);
+        assert(abs(nb - nb_ref) < 4);
+    }
+    free(pos);
+    free(index);
+    free(points);
+}
+
+// Print the number of stars per second we can project on a dense field.
+static void bench_painter_project_stars(void)
+{
+    const int n = 200000, nb_iter = 20;
+    painter_t painter;
+    projection_t proj;
+    float (*pos)[3];
+    double cap[4];
+    int i, nb = 0, *index = malloc(n * sizeof(*index));
+    point_t *points = malloc(n * sizeof(*points));
+    clock_t t;
+
+    pos = test_stars_setup(&painter, &proj, n, cap);
+    projection_init(&proj, PROJ_STEREOGRAPHIC, 60 * DD2R, 800, 600);
+    t = clock();
+    for (i = 0; i < nb_iter; i++)
+        nb = painter_project_stars(&painter, n, pos, cap, index, points);
+    t = clock() - t;
+    LOG_I("painter_project_stars: %.1f Mstars/s (%d visible)",
+          (double)n * nb_iter / t * CLOCKS_PER_SEC / 1e6, nb);
+    free(pos);
+    free(index);
+    free(points);
+}
+
+TEST_REGISTER(NULL, test_painter_project_stars, TEST_AUTO);
+TEST_REGISTER(NULL, bench_painter_project_stars, 0);
+
+#endif
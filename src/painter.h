@@ -82,6 +82,12 @@ struct renderer
                     const painter_t     *painter,
                     const double        p1[2],
                     const double        p2[2]);
+
+    // Statistics of the current frame, reset in prepare.
+    struct {
+        int nb_draw_calls;
+        int nb_tex_binds;
+    } stats;
 };
 
 renderer_t* render_gl_create(void);
@@ -296,6 +302,32 @@ bool painter_is_tile_clipped(const painter_t *painter, int frame,
                              int order, int pix,
                              bool outside);
 
+/*
+ * Function: painter_project_stars
+ * Compute the window positions of a batch of stars.
+ *
+ * This gives the same result as converting each star from FRAME_ASTROM to
+ * FRAME_VIEW and then projecting it, but the stars are processed in single
+ * precision, four at a time with SIMD instructions when available.  For
+ * the projections that are not supported, or at very small fov, it falls
+ * back to the double precision path.
+ *
+ * Parameters:
+ *   painter - The painter.
+ *   n       - Number of stars.
+ *   pos     - Normalized astrometric directions of the stars.
+ *   cap     - Only consider the stars inside this cap (xyz direction,
+ *             w cosine of the max separation from it).
+ *   index   - Receives the indices of the visible stars.
+ *   points  - Receives the visible stars, only the window position is set.
+ *
+ * Returns:
+ *   The number of visible stars.
+ */
+int painter_project_stars(const painter_t *painter, int n,
+                          const float (*pos)[3], const double cap[4],
+                          int *index, point_t *points);
+
 /*
  * Function: paint_orbit
  * Draw an orbit from it's elements.
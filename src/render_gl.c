@@ -16,6 +16,10 @@
 
 #include <float.h>
 
+// Number of vertices of the render items used for atlas textures, so that
+// many tiles can be batched together.
+#define ATLAS_ITEM_SIZE 4096
+
 // All the shader attribute locations.
 enum {
     ATTR_POS,
@@ -115,6 +119,12 @@ struct item
     int         flags;
     double      depth_range[2];
 
+    // For atlas textures: the slots drawn by the item.  We keep a ref to
+    // them until the flush, so that they cannot be reused in the middle of
+    // the frame.
+    texture_t   **slots;
+    int         nb_slots;
+
     union {
         struct {
             double width;
@@ -265,6 +275,8 @@ static void prepare(renderer_t *rend_, double win_w, double win_h,
     rend->fb_size[0] = win_w * scale;
     rend->fb_size[1] = win_h * scale;
     rend->scale = scale;
+    rend->rend.stats.nb_draw_calls = 0;
+    rend->rend.stats.nb_tex_binds = 0;
 
     DL_FOREACH(rend->tex_cache, ctex)
         ctex->in_use = false;
@@ -283,6 +295,33 @@ static void flush(renderer_t *rend_)
     rend_flush(rend);
 }
 
+/*
+ * Function: item_create
+ * Create a new render item.
+ *
+ * The item and its buffers are allocated from the frame arena, so they
+ * don't need to be released.
+ *
+ * Parameters:
+ *   type           - The type of item.
+ *   buf_info       - Vertex buffer info, or NULL for no buffers.
+ *   buf_size       - Capacity of the vertex buffer.
+ *   indices_size   - Capacity of the indices buffer.
+ */
+static item_t *item_create(int type, const gl_buf_info_t *buf_info,
+                           int buf_size, int indices_size)
+{
+    arena_t *arena = core->frame_arena;
+    item_t *item = arena_calloc(arena, 1, sizeof(*item));
+    item->type = type;
+    if (!buf_info) return item;
+    gl_buf_init(&item->buf, buf_info, buf_size,
+                arena_alloc(arena, buf_size * buf_info->size));
+    gl_buf_init(&item->indices, &INDICES_BUF, indices_size,
+                arena_alloc(arena, indices_size * INDICES_BUF.size));
+    return item;
+}
+
 /*
  * Function: get_item
  * Try to get a render item we can batch with.
@@ -335,10 +374,8 @@ static void points(renderer_t *rend_,
     if (item && item->points.smooth != painter->points_smoothness)
         item = NULL;
     if (!item) {
-        item = calloc(1, sizeof(*item));
-        item->type = ITEM_POINTS;
-        gl_buf_alloc(&item->buf, &POINTS_BUF, MAX_POINTS * 4);
-        gl_buf_alloc(&item->indices, &INDICES_BUF, MAX_POINTS * 6);
+        item = item_create(ITEM_POINTS, &POINTS_BUF,
+                           MAX_POINTS * 4, MAX_POINTS * 6);
         vec4_copy(painter->color, item->color);
         item->points.smooth = painter->points_smoothness;
         DL_APPEND(rend->items, item);
@@ -428,10 +465,7 @@ static void quad_planet(
     tex = tex ?: rend->white_tex;
     n = grid_size + 1;
 
-    item = calloc(1, sizeof(*item));
-    item->type = ITEM_PLANET;
-    gl_buf_alloc(&item->buf, &PLANET_BUF, n * n * 4);
-    gl_buf_alloc(&item->indices, &INDICES_BUF, n * n * 6);
+    item = item_create(ITEM_PLANET, &PLANET_BUF, n * n * 4, n * n * 6);
     item->tex = tex;
     item->tex->ref++;
     vec4_copy(painter->color, item->color);
@@ -529,6 +563,7 @@ static void quad(renderer_t          *rend_,
 {
     renderer_gl_t *rend = (void*)rend_;
     item_t *item;
+    texture_t *page;
     int n, i, j, k, ofs;
     const int INDICES[6][2] = {
         {0, 0}, {0, 1}, {1, 0}, {1, 1}, {1, 0}, {0, 1} };
@@ -551,10 +586,7 @@ static void quad(renderer_t          *rend_,
                 memcmp(item->atm.sun, painter->atm.sun, sizeof(item->atm.sun))))
             item = NULL;
         if (!item) {
-            item = calloc(1, sizeof(*item));
-            item->type = ITEM_ATMOSPHERE;
-            gl_buf_alloc(&item->buf, &ATMOSPHERE_BUF, 256);
-            gl_buf_alloc(&item->indices, &INDICES_BUF, 256 * 6);
+            item = item_create(ITEM_ATMOSPHERE, &ATMOSPHERE_BUF, 256, 256 * 6);
             item->prog = &rend->progs.atmosphere;
             memcpy(item->atm.p, painter->atm.p, sizeof(item->atm.p));
             memcpy(item->atm.sun, painter->atm.sun, sizeof(item->atm.sun));
@@ -562,23 +594,41 @@ static void quad(renderer_t          *rend_,
     } else if (painter->flags & PAINTER_FOG_SHADER) {
         item = get_item(rend, ITEM_FOG, n * n, grid_size * grid_size * 6, tex);
         if (!item) {
-            item = calloc(1, sizeof(*item));
-            item->type = ITEM_FOG;
-            gl_buf_alloc(&item->buf, &FOG_BUF, 256);
-            gl_buf_alloc(&item->indices, &INDICES_BUF, 256 * 6);
+            item = item_create(ITEM_FOG, &FOG_BUF, 256, 256 * 6);
             item->prog = &rend->progs.fog;
         }
     } else {
-        item = calloc(1, sizeof(*item));
-        item->type = ITEM_TEXTURE;
-        gl_buf_alloc(&item->buf, &TEXTURE_BUF, n * n);
-        gl_buf_alloc(&item->indices, &INDICES_BUF, n * n * 6);
-        item->prog = &rend->progs.blit;
+        // All the textures of an atlas page can be rendered together.
+        page = tex->page ?: tex;
+        item = get_item(rend, ITEM_TEXTURE,
+                        n * n, grid_size * grid_size * 6, page);
+        if (item && (item->flags != painter->flags ||
+                     !vec4_equal(item->color, painter->color)))
+            item = NULL;
+        if (!item) {
+            item = item_create(ITEM_TEXTURE, &TEXTURE_BUF,
+                               tex->page ? ATLAS_ITEM_SIZE : n * n,
+                               (tex->page ? ATLAS_ITEM_SIZE : n * n) * 6);
+            item->prog = &rend->progs.blit;
+            item->tex = page;
+            item->tex->ref++;
+        }
     }
 
     ofs = item->buf.nb;
-    item->tex = tex;
-    item->tex->ref++;
+    if (!item->tex) {
+        item->tex = tex;
+        item->tex->ref++;
+    }
+    if (tex->page) {
+        // Each quad uses at least four vertices.
+        if (!item->slots)
+            item->slots = arena_alloc(core->frame_arena,
+                    ATLAS_ITEM_SIZE / 4 * sizeof(*item->slots));
+        assert(item->nb_slots < ATLAS_ITEM_SIZE / 4);
+        item->slots[item->nb_slots++] = tex;
+        tex->ref++;
+    }
     vec4_copy(painter->color, item->color);
     item->flags = painter->flags;
 
@@ -590,8 +640,17 @@ static void quad(renderer_t          *rend_,
         vec4_set(p, uv[0][0], uv[0][1], 0, 1);
         vec2_addk(p, duvx, (double)j / grid_size, p);
         vec2_addk(p, duvy, (double)i / grid_size, p);
-        tex_pos[0] = p[0] * tex->w / tex->tex_w;
-        tex_pos[1] = p[1] * tex->h / tex->tex_h;
+        if (tex->page) {
+            // Stay half a texel inside the slot, so that the linear
+            // filtering doesn't bleed into the neighbour slots.
+            tex_pos[0] = (tex->x + 0.5 + p[0] * (tex->w - 1)) /
+                         tex->page->tex_w;
+            tex_pos[1] = (tex->y + 0.5 + p[1] * (tex->h - 1)) /
+                         tex->page->tex_h;
+        } else {
+            tex_pos[0] = p[0] * tex->w / tex->tex_w;
+            tex_pos[1] = p[1] * tex->h / tex->tex_h;
+        }
         if (tex->border) {
             tex_pos[0] = mix((tex->border - 0.5) / tex->w,
                              1.0 - (tex->border - 0.5) / tex->w, tex_pos[0]);
@@ -645,10 +704,7 @@ static void texture2(renderer_gl_t *rend, texture_t *tex,
     if (item && !vec4_equal(item->color, color)) item = NULL;
 
     if (!item) {
-        item = calloc(1, sizeof(*item));
-        item->type = ITEM_ALPHA_TEXTURE;
-        gl_buf_alloc(&item->buf, &TEXTURE_BUF, 64 * 4);
-        gl_buf_alloc(&item->indices, &INDICES_BUF, 64 * 6);
+        item = item_create(ITEM_ALPHA_TEXTURE, &TEXTURE_BUF, 64 * 4, 64 * 6);
         item->prog = &rend->progs.blit_tag;
         item->tex = tex;
         item->tex->ref++;
@@ -716,6 +772,7 @@ static void text(renderer_t *rend_, const char *text, const double pos[2],
         ctex->size = size;
         ctex->text = strdup(text);
         ctex->tex = texture_from_data(img, w, h, 1, 0, 0, w, h, 0);
+        texture_set_owner(ctex->tex, TEX_CAT_LABEL, NULL);
         free(img);
         DL_APPEND(rend->tex_cache, ctex);
     }
@@ -774,6 +831,7 @@ static void item_points_render(renderer_gl_t *rend, const item_t *item)
 
     gl_buf_enable(&item->buf);
     GL(glDrawElements(GL_TRIANGLES, item->indices.nb, GL_UNSIGNED_SHORT, 0));
+    rend->rend.stats.nb_draw_calls++;
     gl_buf_disable(&item->buf);
 
     GL(glDeleteBuffers(1, &array_buffer));
@@ -794,6 +852,7 @@ static void item_lines_render(renderer_gl_t *rend, const item_t *item)
 
     GL(glActiveTexture(GL_TEXTURE0));
     GL(glBindTexture(GL_TEXTURE_2D, rend->white_tex->id));
+    rend->rend.stats.nb_tex_binds++;
 
     GL(glEnable(GL_BLEND));
     GL(glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA,
@@ -816,6 +875,7 @@ static void item_lines_render(renderer_gl_t *rend, const item_t *item)
 
     gl_buf_enable(&item->buf);
     GL(glDrawElements(GL_LINES, item->indices.nb, GL_UNSIGNED_SHORT, 0));
+    rend->rend.stats.nb_draw_calls++;
     gl_buf_disable(&item->buf);
 
     GL(glDeleteBuffers(1, &array_buffer));
@@ -863,6 +923,7 @@ static void item_vg_render(renderer_gl_t *rend, const item_t *item)
     nvgStroke(rend->vg);
     nvgRestore(rend->vg);
     nvgEndFrame(rend->vg);
+    rend->rend.stats.nb_draw_calls++;
 }
 
 static void item_alpha_texture_render(renderer_gl_t *rend, const item_t *item)
@@ -876,6 +937,7 @@ static void item_alpha_texture_render(renderer_gl_t *rend, const item_t *item)
 
     GL(glActiveTexture(GL_TEXTURE0));
     GL(glBindTexture(GL_TEXTURE_2D, item->tex->id));
+    rend->rend.stats.nb_tex_binds++;
     GL(glEnable(GL_CULL_FACE));
 
     GL(glEnable(GL_BLEND));
@@ -898,6 +960,7 @@ static void item_alpha_texture_render(renderer_gl_t *rend, const item_t *item)
 
     gl_buf_enable(&item->buf);
     GL(glDrawElements(GL_TRIANGLES, item->indices.nb, GL_UNSIGNED_SHORT, 0));
+    rend->rend.stats.nb_draw_calls++;
     gl_buf_disable(&item->buf);
 
     GL(glDeleteBuffers(1, &array_buffer));
@@ -916,6 +979,7 @@ static void item_texture_render(renderer_gl_t *rend, const item_t *item)
 
     GL(glActiveTexture(GL_TEXTURE0));
     GL(glBindTexture(GL_TEXTURE_2D, item->tex->id));
+    rend->rend.stats.nb_tex_binds++;
     GL(glEnable(GL_CULL_FACE));
 
     if (item->tex->format == GL_RGB && item->color[3] == 1.0) {
@@ -964,6 +1028,7 @@ static void item_texture_render(renderer_gl_t *rend, const item_t *item)
 
     gl_buf_enable(&item->buf);
     GL(glDrawElements(GL_TRIANGLES, item->indices.nb, GL_UNSIGNED_SHORT, 0));
+    rend->rend.stats.nb_draw_calls++;
     gl_buf_disable(&item->buf);
 
     GL(glDeleteBuffers(1, &array_buffer));
@@ -982,6 +1047,7 @@ static void item_planet_render(renderer_gl_t *rend, const item_t *item)
 
     GL(glActiveTexture(GL_TEXTURE0));
     GL(glBindTexture(GL_TEXTURE_2D, item->tex->id));
+    rend->rend.stats.nb_tex_binds++;
 
     GL(glActiveTexture(GL_TEXTURE1));
     if (item->planet.normalmap) {
@@ -1046,6 +1112,7 @@ static void item_planet_render(renderer_gl_t *rend, const item_t *item)
 
     gl_buf_enable(&item->buf);
     GL(glDrawElements(GL_TRIANGLES, item->indices.nb, GL_UNSIGNED_SHORT, 0));
+    rend->rend.stats.nb_draw_calls++;
     gl_buf_disable(&item->buf);
 
     GL(glDeleteBuffers(1, &array_buffer));
@@ -1056,6 +1123,7 @@ static void rend_flush(renderer_gl_t *rend)
 {
     item_t *item, *tmp;
     tex_cache_t *ctex, *tmptex;
+    int i;
 
     // Compute depth range.
     rend->depth_range[0] = DBL_MAX;
@@ -1089,10 +1157,9 @@ static void rend_flush(renderer_gl_t *rend)
         if (item->type == ITEM_VG_RECT) item_vg_render(rend, item);
         if (item->type == ITEM_VG_LINE) item_vg_render(rend, item);
         DL_DELETE(rend->items, item);
+        for (i = 0; i < item->nb_slots; i++)
+            texture_release(item->slots[i]);
         texture_release(item->tex);
-        gl_buf_release(&item->buf);
-        gl_buf_release(&item->indices);
-        free(item);
     }
 
     DL_FOREACH_SAFE(rend->tex_cache, ctex, tmptex) {
@@ -1122,10 +1189,7 @@ static void line(renderer_t           *rend_,
     if (item && item->lines.width != painter->lines_width) item = NULL;
 
     if (!item) {
-        item = calloc(1, sizeof(*item));
-        item->type = ITEM_LINES;
-        gl_buf_alloc(&item->buf, &LINES_BUF, 1024);
-        gl_buf_alloc(&item->indices, &INDICES_BUF, 1024);
+        item = item_create(ITEM_LINES, &LINES_BUF, 1024, 1024);
         item->lines.width = painter->lines_width;
         vec4_copy(painter->color, item->color);
         DL_APPEND(rend->items, item);
@@ -1162,8 +1226,7 @@ void ellipse_2d(renderer_t        *rend_,
 {
     renderer_gl_t *rend = (void*)rend_;
     item_t *item;
-    item = calloc(1, sizeof(*item));
-    item->type = ITEM_VG_ELLIPSE;
+    item = item_create(ITEM_VG_ELLIPSE, NULL, 0, 0);
     vec2_copy(pos, item->vg.pos);
     vec2_copy(size, item->vg.size);
     vec4_copy(painter->color, item->color);
@@ -1179,8 +1242,7 @@ void rect_2d(renderer_t        *rend_,
 {
     renderer_gl_t *rend = (void*)rend_;
     item_t *item;
-    item = calloc(1, sizeof(*item));
-    item->type = ITEM_VG_RECT;
+    item = item_create(ITEM_VG_RECT, NULL, 0, 0);
     vec2_copy(pos, item->vg.pos);
     vec2_copy(size, item->vg.size);
     vec4_copy(painter->color, item->color);
@@ -1196,8 +1258,7 @@ void line_2d(renderer_t          *rend_,
 {
     renderer_gl_t *rend = (void*)rend_;
     item_t *item;
-    item = calloc(1, sizeof(*item));
-    item->type = ITEM_VG_LINE;
+    item = item_create(ITEM_VG_LINE, NULL, 0, 0);
     vec2_copy(p1, item->vg.pos);
     vec2_copy(p2, item->vg.pos2);
     vec4_copy(painter->color, item->color);
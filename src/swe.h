@@ -34,12 +34,16 @@
 #include "profiler.h"
 #include "tests.h"
 
+#include "utils/arena.h"
+#include "utils/bc1.h"
 #include "utils/cache.h"
 #include "utils/catalog.h"
 #include "utils/color.h"
 #include "utils/fader.h"
 #include "utils/font.h"
 #include "utils/gesture.h"
+#include "utils/lz4.h"
+#include "utils/moc.h"
 #include "utils/progressbar.h"
 #include "utils/texture.h"
 #include "utils/utils.h"
@@ -0,0 +1,169 @@
+/* Stellarium Web Engine - Copyright (c) 2018 - Noctua Software Ltd
+ *
+ * This program is licensed under the terms of the GNU AGPL v3, or
+ * alternatively under a commercial licence.
+ *
+ * The terms of the AGPL v3 license can be found in the main directory of this
+ * repository.
+ */
+
+#include "arena.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ALIGN 16
+
+typedef struct block block_t;
+struct block {
+    block_t *next;
+    size_t  size;
+    size_t  used;
+    // Padding so that the data is aligned.
+    uint8_t pad[ALIGN - (3 * sizeof(size_t)) % ALIGN];
+    uint8_t data[];
+};
+
+typedef struct {
+    int     nb_allocs;
+    int     nb_mallocs;
+    size_t  size;
+} stats_t;
+
+struct arena {
+    block_t *blocks;     // Current block first.
+    size_t  block_size;
+    stats_t stats;       // Stats of the current cycle.
+    stats_t last_stats;  // Stats of the previous cycle.
+};
+
+static block_t *block_create(arena_t *arena, size_t size)
+{
+    block_t *block = malloc(sizeof(*block) + size);
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    arena->stats.nb_mallocs++;
+    return block;
+}
+
+arena_t *arena_create(size_t block_size)
+{
+    arena_t *arena = calloc(1, sizeof(*arena));
+    arena->block_size = block_size;
+    return arena;
+}
+
+void arena_delete(arena_t *arena)
+{
+    block_t *block, *next;
+    if (!arena) return;
+    for (block = arena->blocks; block; block = next) {
+        next = block->next;
+        free(block);
+    }
+    free(arena);
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    block_t *block = arena->blocks;
+    void *ret;
+
+    size = (size + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+    if (!block || block->used + size > block->size) {
+        block = block_create(arena, size > arena->block_size ?
+                                    size : arena->block_size);
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+    ret = block->data + block->used;
+    block->used += size;
+    arena->stats.nb_allocs++;
+    arena->stats.size += size;
+    return ret;
+}
+
+void *arena_calloc(arena_t *arena, size_t nmemb, size_t size)
+{
+    void *ret = arena_alloc(arena, nmemb * size);
+    memset(ret, 0, nmemb * size);
+    return ret;
+}
+
+void arena_reset(arena_t *arena)
+{
+    block_t *block, *next;
+    size_t total = 0;
+
+    if (arena->blocks && arena->blocks->next) {
+        for (block = arena->blocks; block; block = next) {
+            next = block->next;
+            total += block->size;
+            free(block);
+        }
+        arena->blocks = NULL;
+        // Next cycles should fit in a single block.
+        arena->block_size = total > arena->block_size ?
+                            total : arena->block_size;
+        arena->blocks = block_create(arena, arena->block_size);
+    }
+    if (arena->blocks) arena->blocks->used = 0;
+    arena->last_stats = arena->stats;
+    memset(&arena->stats, 0, sizeof(arena->stats));
+}
+
+void arena_get_stats(const arena_t *arena, int *nb_allocs, int *nb_mallocs,
+                     size_t *size)
+{
+    if (nb_allocs) *nb_allocs = arena->last_stats.nb_allocs;
+    if (nb_mallocs) *nb_mallocs = arena->last_stats.nb_mallocs;
+    if (size) *size = arena->last_stats.size;
+}
+
+/******** TESTS ***********************************************************/
+
+#if COMPILE_TESTS
+
+#include "tests.h"
+
+static void test_arena(void)
+{
+    arena_t *arena;
+    uint8_t *a, *b;
+    int i, nb_allocs, nb_mallocs;
+    size_t size;
+
+    arena = arena_create(1024);
+    a = arena_alloc(arena, 3);
+    b = arena_calloc(arena, 10, 4);
+    assert((uintptr_t)a % 16 == 0 && (uintptr_t)b % 16 == 0);
+    assert(b >= a + 3);
+    for (i = 0; i < 40; i++) assert(b[i] == 0);
+    // Bigger than the block size.
+    arena_alloc(arena, 4000);
+    for (i = 0; i < 100; i++) arena_alloc(arena, 100);
+    arena_reset(arena);
+    arena_get_stats(arena, &nb_allocs, &nb_mallocs, &size);
+    assert(nb_allocs == 103);
+    assert(nb_mallocs > 1);
+    assert(size >= 4000 + 100 * 100);
+
+    // Now the same allocations should not need any malloc.
+    arena_alloc(arena, 3);
+    arena_calloc(arena, 10, 4);
+    arena_alloc(arena, 4000);
+    for (i = 0; i < 100; i++) arena_alloc(arena, 100);
+    arena_reset(arena);
+    arena_get_stats(arena, &nb_allocs, &nb_mallocs, NULL);
+    assert(nb_allocs == 103);
+    assert(nb_mallocs == 0);
+    arena_delete(arena);
+}
+
+TEST_REGISTER(NULL, test_arena, TEST_AUTO);
+
+#endif
@@ -0,0 +1,75 @@
+/* Stellarium Web Engine - Copyright (c) 2018 - Noctua Software Ltd
+ *
+ * This program is licensed under the terms of the GNU AGPL v3, or
+ * alternatively under a commercial licence.
+ *
+ * The terms of the AGPL v3 license can be found in the main directory of this
+ * repository.
+ */
+
+/*
+ * File: arena.h
+ * Linear allocator for short lived data.
+ *
+ * Allocations just move a pointer forward into a big block of memory, and
+ * are never freed individually: all the memory is released at once with
+ * <arena_reset>.  This is used for the data that only lives during a
+ * frame.
+ */
+
+#include <stddef.h>
+
+typedef struct arena arena_t;
+
+/*
+ * Function: arena_create
+ * Create a new arena.
+ *
+ * Parameters:
+ *   block_size - Initial size of the memory block.  The arena grows
+ *                automatically if needed.
+ */
+arena_t *arena_create(size_t block_size);
+
+/*
+ * Function: arena_delete
+ * Delete an arena and all its memory.
+ */
+void arena_delete(arena_t *arena);
+
+/*
+ * Function: arena_alloc
+ * Allocate memory from an arena.
+ *
+ * The returned memory is aligned to 16 bytes, and is valid until the next
+ * call to <arena_reset>.
+ */
+void *arena_alloc(arena_t *arena, size_t size);
+
+/*
+ * Function: arena_calloc
+ * Same as <arena_alloc>, but set the memory to zero.
+ */
+void *arena_calloc(arena_t *arena, size_t nmemb, size_t size);
+
+/*
+ * Function: arena_reset
+ * Release all the memory allocated from an arena.
+ *
+ * If the arena had to grow, the blocks are merged into a single one, so
+ * that the next cycle can be served without any malloc.
+ */
+void arena_reset(arena_t *arena);
+
+/*
+ * Function: arena_get_stats
+ * Get the statistics of the last cycle (between the two last resets).
+ *
+ * Parameters:
+ *   arena      - An arena.
+ *   nb_allocs  - Number of allocations served.  Can be NULL.
+ *   nb_mallocs - Number of calls to malloc done by the arena.  Can be NULL.
+ *   size       - Number of bytes allocated.  Can be NULL.
+ */
+void arena_get_stats(const arena_t *arena, int *nb_allocs, int *nb_mallocs,
+                     size_t *size);
@@ -0,0 +1,237 @@
+/* Stellarium Web Engine - Copyright (c) 2018 - Noctua Software Ltd
+ *
+ * This program is licensed under the terms of the GNU AGPL v3, or
+ * alternatively under a commercial licence.
+ *
+ * The terms of the AGPL v3 license can be found in the main directory of this
+ * repository.
+ */
+
+/*
+ * The encoder uses the bounding box of the block colors, slightly inset,
+ * as the two end points, and then picks the closest of the four palette
+ * colors for each pixel.  This is not the best possible quality, but it is
+ * fast enough to run on every loaded tile.
+ */
+
+#include "bc1.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+
+int bc1_get_size(int w, int h)
+{
+    return (w / 4) * (h / 4) * 8;
+}
+
+static uint16_t to_565(const uint8_t c[3])
+{
+    return ((c[0] * 31 + 127) / 255) << 11 |
+           ((c[1] * 63 + 127) / 255) << 5 |
+           ((c[2] * 31 + 127) / 255);
+}
+
+static void from_565(uint16_t v, uint8_t c[3])
+{
+    c[0] = (v >> 11) & 31;
+    c[1] = (v >> 5) & 63;
+    c[2] = v & 31;
+    c[0] = (c[0] << 3) | (c[0] >> 2);
+    c[1] = (c[1] << 2) | (c[1] >> 4);
+    c[2] = (c[2] << 3) | (c[2] >> 2);
+}
+
+// Compute the four colors of a block palette.
+static void get_palette(uint16_t c0, uint16_t c1, uint8_t pal[4][3])
+{
+    int i;
+    from_565(c0, pal[0]);
+    from_565(c1, pal[1]);
+    for (i = 0; i < 3; i++) {
+        if (c0 > c1) {
+            pal[2][i] = (2 * pal[0][i] + pal[1][i]) / 3;
+            pal[3][i] = (pal[0][i] + 2 * pal[1][i]) / 3;
+        } else {
+            pal[2][i] = (pal[0][i] + pal[1][i]) / 2;
+            pal[3][i] = 0;
+        }
+    }
+}
+
+static void encode_block(const uint8_t block[16][3], uint8_t out[8])
+{
+    uint8_t min[3] = {255, 255, 255}, max[3] = {0, 0, 0}, pal[4][3];
+    uint16_t c0, c1, tmp;
+    uint32_t indices = 0;
+    int i, j, k, inset, d, best, best_d;
+
+    for (i = 0; i < 16; i++) {
+        for (k = 0; k < 3; k++) {
+            if (block[i][k] < min[k]) min[k] = block[i][k];
+            if (block[i][k] > max[k]) max[k] = block[i][k];
+        }
+    }
+    // Inset the bounding box, since the extreme colors are rarely the
+    // best end points.
+    for (k = 0; k < 3; k++) {
+        inset = (max[k] - min[k]) / 16;
+        min[k] += inset;
+        max[k] -= inset;
+    }
+    c0 = to_565(max);
+    c1 = to_565(min);
+    // c0 > c1 selects the four colors mode.
+    if (c0 < c1) {
+        tmp = c0;
+        c0 = c1;
+        c1 = tmp;
+    }
+    if (c0 != c1) {
+        get_palette(c0, c1, pal);
+        for (i = 0; i < 16; i++) {
+            best = 0;
+            best_d = 1 << 30;
+            for (j = 0; j < 4; j++) {
+                d = 0;
+                for (k = 0; k < 3; k++)
+                    d += (block[i][k] - pal[j][k]) * (block[i][k] - pal[j][k]);
+                if (d < best_d) {
+                    best_d = d;
+                    best = j;
+                }
+            }
+            indices |= (uint32_t)best << (2 * i);
+        }
+    }
+    out[0] = c0 & 0xff;
+    out[1] = c0 >> 8;
+    out[2] = c1 & 0xff;
+    out[3] = c1 >> 8;
+    for (i = 0; i < 4; i++) out[4 + i] = (indices >> (8 * i)) & 0xff;
+}
+
+void bc1_encode(const uint8_t *img, int w, int h, int bpp, uint8_t *out)
+{
+    uint8_t block[16][3];
+    int x, y, i, j;
+    assert(w % 4 == 0 && h % 4 == 0);
+    assert(bpp == 3 || bpp == 4);
+    for (y = 0; y < h; y += 4)
+    for (x = 0; x < w; x += 4) {
+        for (i = 0; i < 4; i++)
+        for (j = 0; j < 4; j++)
+            memcpy(block[i * 4 + j], &img[((y + i) * w + x + j) * bpp], 3);
+        encode_block(block, out);
+        out += 8;
+    }
+}
+
+void bc1_decode(const uint8_t *data, int w, int h, uint8_t *out)
+{
+    uint8_t pal[4][3];
+    uint32_t indices;
+    int x, y, i, j;
+    assert(w % 4 == 0 && h % 4 == 0);
+    for (y = 0; y < h; y += 4)
+    for (x = 0; x < w; x += 4) {
+        get_palette(data[0] | data[1] << 8, data[2] | data[3] << 8, pal);
+        indices = data[4] | data[5] << 8 | data[6] << 16 |
+                  (uint32_t)data[7] << 24;
+        for (i = 0; i < 4; i++)
+        for (j = 0; j < 4; j++) {
+            memcpy(&out[((y + i) * w + x + j) * 3],
+                   pal[(indices >> (2 * (i * 4 + j))) & 3], 3);
+        }
+        data += 8;
+    }
+}
+
+/******** TESTS ***********************************************************/
+
+#if COMPILE_TESTS
+
+#include "log.h"
+#include "tests.h"
+#include <math.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Fill a test image with smooth gradients and some noise.
+static uint8_t *test_create_img(int w, int h)
+{
+    uint8_t *img = malloc(w * h * 3);
+    int i, j;
+    srand(0);
+    for (i = 0; i < h; i++)
+    for (j = 0; j < w; j++) {
+        img[(i * w + j) * 3 + 0] = j * 255 / w;
+        img[(i * w + j) * 3 + 1] = i * 255 / h;
+        img[(i * w + j) * 3 + 2] = 128 + rand() % 16;
+    }
+    return img;
+}
+
+// Return the root mean square error between two RGB images.
+static double test_rmse(const uint8_t *a, const uint8_t *b, int n)
+{
+    double sum = 0;
+    int i;
+    for (i = 0; i < n; i++) sum += (a[i] - b[i]) * (a[i] - b[i]);
+    return sqrt(sum / n);
+}
+
+static void test_bc1(void)
+{
+    const int w = 64, h = 32;
+    uint8_t *img, *data, *out;
+    uint8_t block[16 * 3], block_out[16 * 3];
+
+    // Uniform block.
+    memset(block, 200, sizeof(block));
+    data = malloc(8);
+    bc1_encode(block, 4, 4, 3, data);
+    bc1_decode(data, 4, 4, block_out);
+    assert(test_rmse(block, block_out, sizeof(block)) < 4);
+    free(data);
+
+    img = test_create_img(w, h);
+    data = malloc(bc1_get_size(w, h));
+    out = malloc(w * h * 3);
+    assert(bc1_get_size(w, h) * 6 == w * h * 3);
+    bc1_encode(img, w, h, 3, data);
+    bc1_decode(data, w, h, out);
+    assert(test_rmse(img, out, w * h * 3) < 8);
+    free(img);
+    free(data);
+    free(out);
+}
+
+// Print the encoding time of a tile and the quality loss.
+static void bench_bc1(void)
+{
+    const int w = 512, h = 512, nb_iter = 20;
+    uint8_t *img, *data, *out;
+    clock_t t;
+    int i;
+
+    img = test_create_img(w, h);
+    data = malloc(bc1_get_size(w, h));
+    out = malloc(w * h * 3);
+    t = clock();
+    for (i = 0; i < nb_iter; i++) bc1_encode(img, w, h, 3, data);
+    t = clock() - t;
+    bc1_decode(data, w, h, out);
+    LOG_I("bc1_encode %dx%d: %.2f ms/tile, ratio: %.1f, rmse: %.2f",
+          w, h, (double)t / CLOCKS_PER_SEC * 1000 / nb_iter,
+          (double)(w * h * 3) / bc1_get_size(w, h),
+          test_rmse(img, out, w * h * 3));
+    free(img);
+    free(data);
+    free(out);
+}
+
+TEST_REGISTER(NULL, test_bc1, TEST_AUTO);
+TEST_REGISTER(NULL, bench_bc1, 0);
+
+#endif
@@ -0,0 +1,49 @@
+/* Stellarium Web Engine - Copyright (c) 2018 - Noctua Software Ltd
+ *
+ * This program is licensed under the terms of the GNU AGPL v3, or
+ * alternatively under a commercial licence.
+ *
+ * The terms of the AGPL v3 license can be found in the main directory of this
+ * repository.
+ */
+
+/*
+ * File: bc1.h
+ * Compression of images to the BC1 (aka DXT1) GPU block format.
+ *
+ * The images are split into blocks of 4x4 pixels, each one stored in 8
+ * bytes, so that an RGB image takes six times less memory on the GPU.
+ */
+
+#include <stdint.h>
+
+/*
+ * Function: bc1_get_size
+ * Return the size in bytes of a BC1 image.
+ */
+int bc1_get_size(int w, int h);
+
+/*
+ * Function: bc1_encode
+ * Compress an image to BC1.
+ *
+ * Parameters:
+ *   img - RGB or RGBA image data.  The alpha channel is ignored.
+ *   w   - Width of the image, must be a multiple of 4.
+ *   h   - Height of the image, must be a multiple of 4.
+ *   bpp - Number of bytes per pixel of the image (3 or 4).
+ *   out - Output buffer of <bc1_get_size> bytes.
+ */
+void bc1_encode(const uint8_t *img, int w, int h, int bpp, uint8_t *out);
+
+/*
+ * Function: bc1_decode
+ * Uncompress a BC1 image to RGB.
+ *
+ * Parameters:
+ *   data - BC1 data.
+ *   w    - Width of the image, must be a multiple of 4.
+ *   h    - Height of the image, must be a multiple of 4.
+ *   out  - Output RGB buffer of w * h * 3 bytes.
+ */
+void bc1_decode(const uint8_t *data, int w, int h, uint8_t *out);
@@ -7,78 +7,253 @@
  * repository.
  */
 
+/*
+ * The cache is made of two independent structures sharing the same items:
+ *
+ * - An intrusive doubly linked list of all the items sorted from the least
+ *   recently used to the most recently used.  Moving an item to the end of
+ *   the list on a hit, or removing the oldest item is O(1).
+ *
+ * - An open addressing hash table (linear probing) of pointers to the items,
+ *   used to find an item from its key.  We only rehash when the table gets
+ *   too full, never on a lookup.
+ */
+
 #include "cache.h"
-#include "uthash.h"
+#include "utlist.h"
+
 #include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Initial number of slots in the index.  Must be a power of two.
+#define INDEX_MIN_SIZE 64
 
 typedef struct item item_t;
 struct item {
-    UT_hash_handle  hh;
-    char            key[256];
+    item_t          *prev, *next; // LRU list, oldest first.
+    uint32_t        hash;
+    int             keylen;
     void            *data;
     int             cost;
-    uint64_t        last_used;
     int             (*delfunc)(void *data);
+    char            key[];
 };
 
 struct cache {
-    item_t *items;
-    uint64_t clock;
-    int size;
-    int max_size;
+    item_t      *items; // LRU list head (least recently used item).
+    item_t      **index; // Open addressing hash table.
+    int         index_size; // Always a power of two.
+    int         nb; // Number of items in the cache.
+    int         nb_deleted; // Number of tombstones in the index.
+    int         size;
+    int         max_size;
+    int         hard_size; // Zero for no hard limit.
+    // Set when a full cleanup pass couldn't go under the max size, so that
+    // we don't scan all the kept items again on each insertion.  Until the
+    // next full pass we only check the items added or used since then,
+    // which are at the end of the LRU list.
+    bool        all_kept;
+    int         nb_new;
+    int         nb_rehash; // Only used for stats and tests.
 };
 
+// Marker of a removed slot in the index.
+static item_t g_tombstone;
+#define TOMBSTONE (&g_tombstone)
+
+// FNV-1a, fast enough for the small keys we use.
+static uint32_t hash_key(const void *key, int len)
+{
+    const uint8_t *p = key;
+    uint32_t h = 2166136261u;
+    int i;
+    for (i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
 cache_t *cache_create(int size)
 {
     cache_t *cache = calloc(1, sizeof(*cache));
     cache->max_size = size;
+    cache->index_size = INDEX_MIN_SIZE;
+    cache->index = calloc(cache->index_size, sizeof(*cache->index));
     return cache;
 }
 
+// Return the index slot of an item, or of the first free slot where an
+// item with this key can be inserted.
+static item_t **index_lookup(const cache_t *cache, const void *key, int len,
+                             uint32_t hash)
+{
+    const int mask = cache->index_size - 1;
+    int i = hash & mask;
+    item_t *item, **free_slot = NULL;
+
+    while ((item = cache->index[i])) {
+        if (item == TOMBSTONE) {
+            if (!free_slot) free_slot = &cache->index[i];
+        } else if (item->hash == hash && item->keylen == len &&
+                   memcmp(item->key, key, len) == 0) {
+            return &cache->index[i];
+        }
+        i = (i + 1) & mask;
+    }
+    return free_slot ?: &cache->index[i];
+}
+
+static void index_resize(cache_t *cache, int size)
+{
+    item_t **old = cache->index;
+    int i, j, old_size = cache->index_size;
+
+    cache->index = calloc(size, sizeof(*cache->index));
+    cache->index_size = size;
+    cache->nb_deleted = 0;
+    cache->nb_rehash++;
+    for (i = 0; i < old_size; i++) {
+        if (!old[i] || old[i] == TOMBSTONE) continue;
+        j = old[i]->hash & (size - 1);
+        while (cache->index[j]) j = (j + 1) & (size - 1);
+        cache->index[j] = old[i];
+    }
+    free(old);
+}
+
+static void index_add(cache_t *cache, item_t *item)
+{
+    item_t **slot;
+    int size = cache->index_size;
+
+    // Keep the load factor (including tombstones) under 3/4.  If most of
+    // the used slots are tombstones we just rehash at the same size.
+    if ((cache->nb + cache->nb_deleted + 1) * 4 > size * 3) {
+        if ((cache->nb + 1) * 2 > size) size *= 2;
+        index_resize(cache, size);
+    }
+    slot = index_lookup(cache, item->key, item->keylen, item->hash);
+    assert(*slot == NULL || *slot == TOMBSTONE);
+    if (*slot == TOMBSTONE) cache->nb_deleted--;
+    *slot = item;
+    cache->nb++;
+}
+
+static void remove_item(cache_t *cache, item_t *item)
+{
+    item_t **slot;
+    slot = index_lookup(cache, item->key, item->keylen, item->hash);
+    assert(*slot == item);
+    *slot = TOMBSTONE;
+    cache->nb_deleted++;
+    cache->nb--;
+    DL_DELETE(cache->items, item);
+    cache->size -= item->cost;
+    free(item);
+}
+
+// Only check the items added or used since the last full cleanup pass.
+static void cleanup_new_items(cache_t *cache)
+{
+    item_t *item, *prev;
+    int n = cache->nb_new < cache->nb ? cache->nb_new : cache->nb;
+
+    cache->nb_new = 0;
+    item = cache->items ? cache->items->prev : NULL;
+    while (item && n--) {
+        prev = (item == cache->items) ? NULL : item->prev;
+        if (item->delfunc(item->data) != CACHE_KEEP) {
+            remove_item(cache, item);
+            if (cache->size < cache->max_size) return;
+        }
+        item = prev;
+    }
+}
+
 static void cleanup(cache_t *cache)
 {
-    item_t *item, *tmp;
-    HASH_ITER(hh, cache->items, item, tmp) {
-        if (item->delfunc(item->data) == CACHE_KEEP) continue;
-        HASH_DEL(cache->items, item);
-        cache->size -= item->cost;
-        free(item);
+    item_t *item;
+    int n = cache->nb;
+
+    if (    cache->all_kept &&
+            !(cache->hard_size && cache->size >= cache->hard_size)) {
+        cleanup_new_items(cache);
+        return;
+    }
+    cache->all_kept = false;
+    cache->nb_new = 0;
+    // Only check each item once, in case all of them ask to be kept.
+    while (cache->items && n--) {
+        item = cache->items;
+        if (item->delfunc(item->data) == CACHE_KEEP) {
+            // Move it to the end of the list so that we don't check it
+            // again during the next cleanup.
+            DL_DELETE(cache->items, item);
+            DL_APPEND(cache->items, item);
+            continue;
+        }
+        remove_item(cache, item);
         if (cache->size < cache->max_size) return;
     }
+    cache->all_kept = true;
+}
+
+void cache_retry_cleanup(cache_t *cache)
+{
+    cache->all_kept = false;
+    cache->nb_new = 0;
+}
+
+void cache_set_hard_size(cache_t *cache, int size)
+{
+    cache->hard_size = size;
 }
 
 void cache_add(cache_t *cache, const void *key, int len, void *data,
                int cost, int (*delfunc)(void *data))
 {
     item_t *item;
-    assert(len <= sizeof(item->key));
     cache->size += cost;
     if (cache->size >= cache->max_size) cleanup(cache);
-    item = calloc(1, sizeof(*item));
+    item = calloc(1, sizeof(*item) + len);
     memcpy(item->key, key, len);
+    item->keylen = len;
+    item->hash = hash_key(key, len);
     item->data = data;
     item->cost = cost;
-    item->last_used = cache->clock++;
     item->delfunc = delfunc;
-    HASH_ADD(hh, cache->items, key, len, item);
+    index_add(cache, item);
+    DL_APPEND(cache->items, item);
+    if (cache->all_kept) cache->nb_new++;
 }
 
-void *cache_get(cache_t *cache, const void *key, int keylen)
+static item_t *get_item(const cache_t *cache, const void *key, int keylen)
 {
     item_t *item;
-    HASH_FIND(hh, cache->items, key, keylen, item);
+    item = *index_lookup(cache, key, keylen, hash_key(key, keylen));
+    return item == TOMBSTONE ? NULL : item;
+}
+
+void *cache_get(cache_t *cache, const void *key, int keylen)
+{
+    item_t *item = get_item(cache, key, keylen);
     if (!item) return NULL;
-    item->last_used = cache->clock++;
-    // Reinsert item on top of the hash list so that it stays sorted.
-    HASH_DEL(cache->items, item);
-    HASH_ADD(hh, cache->items, key, keylen, item);
+    // Move the item at the end of the LRU list.
+    if (item->next) {
+        DL_DELETE(cache->items, item);
+        DL_APPEND(cache->items, item);
+        if (cache->all_kept) cache->nb_new++;
+    }
     return item->data;
 }
 
 void cache_set_cost(cache_t *cache, const void *key, int keylen, int cost)
 {
-    item_t *item;
-    HASH_FIND(hh, cache->items, key, keylen, item);
+    item_t *item = get_item(cache, key, keylen);
     if (!item) return;
     cache->size -= item->cost;
     item->cost = cost;
@@ -94,3 +269,131 @@ int cache_get_current_size(const cache_t *cache)
 {
     return cache->size;
 }
+
+/******** TESTS ***********************************************************/
+
+#if COMPILE_TESTS
+
+#include "tests.h"
+#include <time.h>
+
+static int test_del(void *data)
+{
+    return (intptr_t)data < 0 ? CACHE_KEEP : 0;
+}
+
+// Like the hips tiles: always kept, unless the cache is over its hard size.
+static cache_t *g_test_cache;
+static int test_del_hard(void *data)
+{
+    return cache_get_current_size(g_test_cache) < 10 ? CACHE_KEEP : 0;
+}
+
+static void test_free_cache(cache_t *cache)
+{
+    item_t *item, *tmp;
+    DL_FOREACH_SAFE(cache->items, item, tmp) free(item);
+    free(cache->index);
+    free(cache);
+}
+
+static void test_cache(void)
+{
+    cache_t *cache = cache_create(11);
+    intptr_t i;
+    int key;
+
+    for (i = 0; i < 10; i++) {
+        key = i;
+        cache_add(cache, &key, sizeof(key), (void*)i, 1, test_del);
+    }
+    // Touch item 0 so that 1 becomes the oldest one.
+    key = 0;
+    assert(cache_get(cache, &key, sizeof(key)) == (void*)0);
+    key = 10;
+    cache_add(cache, &key, sizeof(key), (void*)10, 1, test_del);
+    key = 1;
+    assert(!cache_get(cache, &key, sizeof(key)));
+    key = 0;
+    assert(cache_get(cache, &key, sizeof(key)) == (void*)0);
+    assert(cache_get_current_size(cache) == 10);
+
+    // Items that ask to be kept are skipped.
+    key = 11;
+    cache_add(cache, &key, sizeof(key), (void*)-1, 5, test_del);
+    key = 11;
+    assert(cache_get(cache, &key, sizeof(key)) == (void*)-1);
+    cache_set_cost(cache, &key, sizeof(key), 20);
+    assert(cache_get(cache, &key, sizeof(key)) == (void*)-1);
+    test_free_cache(cache);
+
+    // Once a cleanup pass only found kept items, we don't scan them again
+    // until cache_retry_cleanup.
+    cache = cache_create(3);
+    for (i = 0; i < 3; i++) {
+        key = i;
+        cache_add(cache, &key, sizeof(key), (void*)-1, 1, test_del);
+    }
+    assert(cache->all_kept);
+    key = 3;
+    cache_add(cache, &key, sizeof(key), (void*)3, 1, test_del);
+    assert(cache_get_current_size(cache) == 4);
+    cache_retry_cleanup(cache);
+    key = 4;
+    cache_add(cache, &key, sizeof(key), (void*)4, 1, test_del);
+    key = 3;
+    assert(!cache_get(cache, &key, sizeof(key)));
+    // The items added after the full pass can still be evicted.
+    assert(cache->all_kept);
+    key = 5;
+    cache_add(cache, &key, sizeof(key), (void*)5, 1, test_del);
+    key = 6;
+    cache_add(cache, &key, sizeof(key), (void*)-1, 1, test_del);
+    key = 5;
+    assert(!cache_get(cache, &key, sizeof(key)));
+    test_free_cache(cache);
+
+    // The hard size is respected even if all the items ask to be kept.
+    cache = g_test_cache = cache_create(3);
+    cache_set_hard_size(cache, 10);
+    for (i = 0; i < 100; i++) {
+        key = i;
+        cache_add(cache, &key, sizeof(key), (void*)i, 1, test_del_hard);
+        assert(cache_get_current_size(cache) <= 10);
+    }
+    test_free_cache(cache);
+}
+
+// Check that a cache hit never rehash the index, and print the time per
+// lookup.
+static void bench_cache(void)
+{
+    const int n = 100000, nb_iter = 50;
+    cache_t *cache = cache_create(n + 1);
+    int i, j, key, nb_rehash;
+    clock_t t;
+
+    for (i = 0; i < n; i++) {
+        key = i;
+        cache_add(cache, &key, sizeof(key), (void*)(intptr_t)i, 1, test_del);
+    }
+    nb_rehash = cache->nb_rehash;
+    t = clock();
+    for (j = 0; j < nb_iter; j++) {
+        for (i = 0; i < n; i++) {
+            key = (i * 7919) % n;
+            cache_get(cache, &key, sizeof(key));
+        }
+    }
+    t = clock() - t;
+    assert(cache->nb_rehash == nb_rehash);
+    LOG_I("cache_get: %.1f ns/hit (index size: %d, rehash: %d)",
+          (double)t / CLOCKS_PER_SEC * 1e9 / (n * nb_iter),
+          cache->index_size, cache->nb_rehash);
+    test_free_cache(cache);
+}
+
+TEST_REGISTER(NULL, test_cache, TEST_AUTO);
+TEST_REGISTER(NULL, bench_cache, 0);
+
+#endif
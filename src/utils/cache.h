@@ -11,6 +11,9 @@
  * File: cache.h
  *
  * Utils to store values in cache.
+ *
+ * The items are evicted in least recently used order when the total cost
+ * goes over the cache size.  Lookups, insertions and evictions are all O(1).
  */
 
 /*
@@ -73,6 +76,27 @@ void *cache_get(cache_t *cache, const void *key, int keylen);
  */
 void cache_set_cost(cache_t *cache, const void *key, int keylen, int cost);
 
+/*
+ * Function: cache_retry_cleanup
+ * Notify the cache that the items kept by their delete function may now
+ * be deleted.
+ *
+ * When a cleanup only finds items asking to be kept, the cache only checks
+ * the items added or used since then (and so can stay above its max size)
+ * until this function is called, or the cache goes over its hard size.
+ */
+void cache_retry_cleanup(cache_t *cache);
+
+/*
+ * Function: cache_set_hard_size
+ * Set a size above which the cache always checks all the items for
+ * deletion, even if they all asked to be kept during the last cleanup.
+ *
+ * This is useful when the delete function stops keeping the items past a
+ * given cache size.
+ */
+void cache_set_hard_size(cache_t *cache, int size);
+
 /*
  * Function: cache_get_current_size
  * Return the total cost of all the currently cached items
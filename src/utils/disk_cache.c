@@ -0,0 +1,565 @@
+/* Stellarium Web Engine - Copyright (c) 2018 - Noctua Software Ltd
+ *
+ * This program is licensed under the terms of the GNU AGPL v3, or
+ * alternatively under a commercial licence.
+ *
+ * The terms of the AGPL v3 license can be found in the main directory of this
+ * repository.
+ */
+
+/*
+ * The log file is a sequence of records, each made of a fixed size header
+ * followed by the key, the etag and the data.  A record either adds an
+ * entry, removes it, or only changes its expiration date.  Only the header, key and etag are checked when we
+ * load the index, the data checksum is only tested when we read it.
+ *
+ * Writes are only ever appended at the end of the file, so after a crash
+ * the only possible corruption is a partially written last record, that we
+ * discard when we open the cache.
+ */
+
+#include "disk_cache.h"
+#include "log.h"
+#include "uthash.h"
+#include "utlist.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h> // For crc32.
+
+#define RECORD_MAGIC 0x43455753 // "SWEC"
+
+// Max number of bytes copied by each compaction step.
+#define COMPACT_STEP_SIZE (1 << 20)
+
+enum {
+    RECORD_PUT = 1,
+    RECORD_DEL = 2,
+    RECORD_EXPIRE = 3,
+};
+
+typedef struct {
+    uint32_t    magic;
+    uint32_t    type;
+    uint32_t    key_len;
+    uint32_t    etag_len;
+    uint32_t    size;
+    uint32_t    crc; // crc32 of the header, key and etag.
+    uint32_t    data_crc;
+    uint32_t    reserved;
+    double      expiration;
+} record_t;
+
+typedef struct entry entry_t;
+struct entry {
+    UT_hash_handle  hh;
+    entry_t         *prev, *next; // LRU list, oldest first.
+    char            *key;
+    char            *etag;
+    double          expiration;
+    int64_t         offset; // Offset of the data in the log.
+    int64_t         new_offset; // Offset in the compacted log, or -1.
+    int             size;
+    uint32_t        data_crc;
+};
+
+struct disk_cache {
+    char        *path;
+    int         fd;
+    entry_t     *index;
+    entry_t     *lru; // LRU list head (least recently used entry).
+    int64_t     file_size;
+    int64_t     live_size; // Total size of the live entries records.
+    int64_t     max_size;
+    int         nb_hits;
+    int         nb_misses;
+
+    // The compaction is done incrementally, a few entries at each put, so
+    // that we never block for too long.  We copy the entries in the index
+    // order, the ones added during the compaction are at the end.
+    struct {
+        bool        running;
+        int         fd; // The new log.
+        int64_t     offset; // Size of the new log.
+        entry_t     *cursor; // Next entry to copy.
+    } compact;
+};
+
+static int64_t get_record_size(const char *key, const char *etag, int size)
+{
+    return sizeof(record_t) + strlen(key) + (etag ? strlen(etag) : 0) + size;
+}
+
+// zlib crc32 returns the initial crc value when the buffer is NULL, so
+// we need to skip the empty buffers.
+static uint32_t checksum(uint32_t crc, const void *data, int size)
+{
+    return size ? crc32(crc, data, size) : crc;
+}
+
+static uint32_t get_record_crc(const record_t *record,
+                               const void *key, const void *etag)
+{
+    record_t tmp = *record;
+    uint32_t ret;
+    tmp.crc = 0;
+    ret = checksum(0, &tmp, sizeof(tmp));
+    ret = checksum(ret, key, record->key_len);
+    ret = checksum(ret, etag, record->etag_len);
+    return ret;
+}
+
+static void remove_entry(disk_cache_t *cache, entry_t *e)
+{
+    if (cache->compact.cursor == e) cache->compact.cursor = e->hh.next;
+    HASH_DEL(cache->index, e);
+    DL_DELETE(cache->lru, e);
+    cache->live_size -= get_record_size(e->key, e->etag, e->size);
+    free(e->key);
+    free(e->etag);
+    free(e);
+}
+
+static entry_t *add_entry(disk_cache_t *cache, char *key, char *etag,
+                          double expiration, int64_t offset, int size,
+                          uint32_t data_crc)
+{
+    entry_t *e;
+    HASH_FIND_STR(cache->index, key, e);
+    if (e) remove_entry(cache, e);
+    e = calloc(1, sizeof(*e));
+    e->key = key;
+    e->etag = etag;
+    e->expiration = expiration;
+    e->offset = offset;
+    e->new_offset = -1;
+    e->size = size;
+    e->data_crc = data_crc;
+    HASH_ADD_KEYPTR(hh, cache->index, e->key, strlen(e->key), e);
+    DL_APPEND(cache->lru, e);
+    cache->live_size += get_record_size(key, etag, size);
+    return e;
+}
+
+static int write_all(int fd, const void *data, int64_t size, int64_t offset)
+{
+    ssize_t r;
+    while (size) {
+        r = pwrite(fd, data, size, offset);
+        if (r <= 0) return -1;
+        data += r;
+        size -= r;
+        offset += r;
+    }
+    return 0;
+}
+
+// Write a record at a given offset of a file.
+static int write_record(int fd, int64_t offset, int type,
+                        const char *key, const char *etag,
+                        const void *data, int size, double expiration)
+{
+    record_t record = {
+        .magic = RECORD_MAGIC,
+        .type = type,
+        .key_len = strlen(key),
+        .etag_len = etag ? strlen(etag) : 0,
+        .size = size,
+        .data_crc = checksum(0, data, size),
+        .expiration = expiration,
+    };
+    record.crc = get_record_crc(&record, key, etag);
+    if (    write_all(fd, &record, sizeof(record), offset) ||
+            write_all(fd, key, record.key_len, offset + sizeof(record)) ||
+            write_all(fd, etag, record.etag_len,
+                      offset + sizeof(record) + record.key_len) ||
+            write_all(fd, data, size, offset + sizeof(record) +
+                      record.key_len + record.etag_len))
+        return -1;
+    return 0;
+}
+
+static void *read_data(const disk_cache_t *cache, const entry_t *e)
+{
+    char *data;
+    data = malloc(e->size + 1);
+    if (pread(cache->fd, data, e->size, e->offset) != e->size ||
+            checksum(0, data, e->size) != e->data_crc) {
+        free(data);
+        return NULL;
+    }
+    data[e->size] = '\0';
+    return data;
+}
+
+// Append a record to the log.
+static int append(disk_cache_t *cache, int type, const char *key,
+                  const char *etag, const void *data, int size,
+                  double expiration)
+{
+    if (write_record(cache->fd, cache->file_size, type, key, etag,
+                     data, size, expiration)) {
+        LOG_W("Cannot write to cache %s", cache->path);
+        if (ftruncate(cache->fd, cache->file_size)) {}
+        return -1;
+    }
+    cache->file_size += get_record_size(key, etag, size);
+    return 0;
+}
+
+static void compact_abort(disk_cache_t *cache);
+
+// Append a record without data for an entry.  If the entry was already
+// copied in the new log, the record also has to be written there.
+static void append_meta(disk_cache_t *cache, int type, entry_t *e,
+                        double expiration)
+{
+    append(cache, type, e->key, NULL, NULL, 0, expiration);
+    if (cache->compact.running && e->new_offset >= 0) {
+        if (write_record(cache->compact.fd, cache->compact.offset,
+                         type, e->key, NULL, NULL, 0, expiration))
+            compact_abort(cache);
+        else
+            cache->compact.offset += get_record_size(e->key, NULL, 0);
+    }
+}
+
+static void delete_entry(disk_cache_t *cache, entry_t *e)
+{
+    append_meta(cache, RECORD_DEL, e, 0);
+    remove_entry(cache, e);
+}
+
+// Read all the records of the log to build the index.
+static void load_index(disk_cache_t *cache)
+{
+    struct stat st;
+    const uint8_t *data;
+    record_t record;
+    const char *key, *etag;
+    int64_t offset = 0, size;
+    entry_t *e;
+
+    if (fstat(cache->fd, &st) || st.st_size == 0) return;
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, cache->fd, 0);
+    if (data == MAP_FAILED) return;
+    while (offset + (int64_t)sizeof(record) <= st.st_size) {
+        // The records are not aligned.
+        memcpy(&record, data + offset, sizeof(record));
+        key = (const char*)(data + offset + sizeof(record));
+        etag = key + record.key_len;
+        size = (int64_t)sizeof(record) + record.key_len +
+               record.etag_len + record.size;
+        if (record.magic != RECORD_MAGIC || offset + size > st.st_size ||
+                record.crc != get_record_crc(&record, key, etag))
+            break;
+        if (record.type == RECORD_PUT) {
+            add_entry(cache, strndup(key, record.key_len),
+                      record.etag_len ? strndup(etag, record.etag_len)
+                                      : NULL,
+                      record.expiration,
+                      offset + size - record.size, record.size,
+                      record.data_crc);
+        } else {
+            HASH_FIND(hh, cache->index, key, record.key_len, e);
+            if (e && record.type == RECORD_EXPIRE)
+                e->expiration = record.expiration;
+            else if (e)
+                remove_entry(cache, e);
+        }
+        offset += size;
+    }
+    munmap((void*)data, st.st_size);
+
+    if (offset < st.st_size) {
+        LOG_W("Discard %d corrupted bytes from cache %s",
+              (int)(st.st_size - offset), cache->path);
+        if (ftruncate(cache->fd, offset)) {}
+    }
+    cache->file_size = offset;
+}
+
+disk_cache_t *disk_cache_open(const char *path, int64_t max_size)
+{
+    disk_cache_t *cache;
+    char tmp_path[1024];
+    int fd;
+
+    // Remove any leftover of an interrupted compaction.
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    unlink(tmp_path);
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        LOG_W("Cannot open cache %s", path);
+        return NULL;
+    }
+    cache = calloc(1, sizeof(*cache));
+    cache->path = strdup(path);
+    cache->fd = fd;
+    cache->max_size = max_size;
+    load_index(cache);
+    return cache;
+}
+
+void disk_cache_close(disk_cache_t *cache)
+{
+    entry_t *e, *tmp;
+    if (!cache) return;
+    if (cache->compact.running) compact_abort(cache);
+    HASH_ITER(hh, cache->index, e, tmp) remove_entry(cache, e);
+    close(cache->fd);
+    free(cache->path);
+    free(cache);
+}
+
+static void compact_abort(disk_cache_t *cache)
+{
+    char tmp_path[1024];
+    entry_t *e;
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache->path);
+    close(cache->compact.fd);
+    unlink(tmp_path);
+    memset(&cache->compact, 0, sizeof(cache->compact));
+    DL_FOREACH(cache->lru, e) e->new_offset = -1;
+}
+
+// Start to rewrite the log with only the live entries.
+static void compact_start(disk_cache_t *cache)
+{
+    char tmp_path[1024];
+    int fd;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache->path);
+    fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) return;
+    cache->compact.running = true;
+    cache->compact.fd = fd;
+    cache->compact.offset = 0;
+    cache->compact.cursor = cache->index;
+}
+
+// Copy up to max_size bytes of entries into the new log, and replace the
+// old log once all the entries have been copied.
+static void compact_step(disk_cache_t *cache, int64_t max_size)
+{
+    char tmp_path[1024];
+    entry_t *e;
+    void *data;
+    int64_t size;
+
+    while (cache->compact.cursor && max_size > 0) {
+        e = cache->compact.cursor;
+        cache->compact.cursor = e->hh.next;
+        data = read_data(cache, e);
+        if (!data) { // Corrupted, just drop it.
+            remove_entry(cache, e);
+            continue;
+        }
+        if (write_record(cache->compact.fd, cache->compact.offset,
+                         RECORD_PUT, e->key, e->etag, data,
+                         e->size, e->expiration)) {
+            free(data);
+            compact_abort(cache);
+            return;
+        }
+        free(data);
+        size = get_record_size(e->key, e->etag, e->size);
+        cache->compact.offset += size;
+        e->new_offset = cache->compact.offset - e->size;
+        max_size -= size;
+    }
+    if (cache->compact.cursor) return;
+
+    // Only replace the old log once the new one is fully on disk.
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache->path);
+    if (fsync(cache->compact.fd) || rename(tmp_path, cache->path)) {
+        compact_abort(cache);
+        return;
+    }
+    close(cache->fd);
+    cache->fd = cache->compact.fd;
+    cache->file_size = cache->compact.offset;
+    DL_FOREACH(cache->lru, e) {
+        e->offset = e->new_offset;
+        e->new_offset = -1;
+    }
+    memset(&cache->compact, 0, sizeof(cache->compact));
+}
+
+bool disk_cache_lookup(disk_cache_t *cache, const char *key,
+                       const char **etag, double *expiration)
+{
+    entry_t *e;
+    HASH_FIND_STR(cache->index, key, e);
+    if (!e) {
+        cache->nb_misses++;
+        return false;
+    }
+    cache->nb_hits++;
+    DL_DELETE(cache->lru, e);
+    DL_APPEND(cache->lru, e);
+    if (etag) *etag = e->etag;
+    if (expiration) *expiration = e->expiration;
+    return true;
+}
+
+void *disk_cache_read(disk_cache_t *cache, const char *key, int *size)
+{
+    entry_t *e;
+    void *data;
+    HASH_FIND_STR(cache->index, key, e);
+    if (!e) return NULL;
+    data = read_data(cache, e);
+    if (!data) {
+        LOG_W("Corrupted cache entry %s", key);
+        delete_entry(cache, e);
+        return NULL;
+    }
+    if (size) *size = e->size;
+    return data;
+}
+
+int disk_cache_put(disk_cache_t *cache, const char *key,
+                   const void *data, int size,
+                   const char *etag, double expiration)
+{
+    entry_t *e;
+
+    if (get_record_size(key, etag, size) > cache->max_size) return -1;
+    if (append(cache, RECORD_PUT, key, etag, data, size, expiration))
+        return -1;
+    e = add_entry(cache, strdup(key), etag ? strdup(etag) : NULL,
+                  expiration, cache->file_size - size, size,
+                  checksum(0, data, size));
+
+    // Evict the least recently used entries.
+    while (cache->live_size > cache->max_size && cache->lru != e)
+        delete_entry(cache, cache->lru);
+
+    // Compact the log if it contains too much garbage.
+    if (    !cache->compact.running &&
+            cache->file_size - cache->live_size > cache->max_size / 2)
+        compact_start(cache);
+    if (cache->compact.running) compact_step(cache, COMPACT_STEP_SIZE);
+    return 0;
+}
+
+int disk_cache_set_expiration(disk_cache_t *cache, const char *key,
+                              double expiration)
+{
+    entry_t *e;
+    HASH_FIND_STR(cache->index, key, e);
+    if (!e) return -1;
+    append_meta(cache, RECORD_EXPIRE, e, expiration);
+    e->expiration = expiration;
+    return 0;
+}
+
+void disk_cache_get_stats(const disk_cache_t *cache,
+                          int *nb_hits, int *nb_misses, int64_t *size)
+{
+    if (nb_hits) *nb_hits = cache->nb_hits;
+    if (nb_misses) *nb_misses = cache->nb_misses;
+    if (size) *size = cache->live_size;
+}
+
+/******** TESTS ***********************************************************/
+
+#if COMPILE_TESTS
+
+#include "tests.h"
+
+static void test_disk_cache(void)
+{
+    char dir[] = "/tmp/swe_test_cacheXXXXXX";
+    char path[128], key[32], *data;
+    const char *etag;
+    disk_cache_t *cache;
+    int i, size, nb_hits, nb_misses;
+    double expiration;
+    FILE *file;
+    struct stat st;
+
+    assert(mkdtemp(dir));
+    snprintf(path, sizeof(path), "%s/cache.log", dir);
+    cache = disk_cache_open(path, 4096);
+    assert(cache);
+    for (i = 0; i < 10; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        assert(disk_cache_put(cache, key, key, strlen(key), "etag", i) == 0);
+    }
+    assert(disk_cache_lookup(cache, "key3", &etag, &expiration));
+    assert(strcmp(etag, "etag") == 0 && expiration == 3);
+    assert(!disk_cache_lookup(cache, "nokey", NULL, NULL));
+    // Replace an entry.
+    assert(disk_cache_put(cache, "key5", "new", 3, NULL, 0) == 0);
+    // Only update the expiration date.
+    assert(disk_cache_set_expiration(cache, "key7", 100) == 0);
+    assert(disk_cache_set_expiration(cache, "nokey", 100) == -1);
+    disk_cache_close(cache);
+
+    // Reopen and simulate a partially written record at the end.
+    file = fopen(path, "ab");
+    fwrite("SWEC garbage", 12, 1, file);
+    fclose(file);
+    cache = disk_cache_open(path, 4096);
+    data = disk_cache_read(cache, "key5", &size);
+    assert(size == 3 && strcmp(data, "new") == 0);
+    free(data);
+    data = disk_cache_read(cache, "key9", &size);
+    assert(strcmp(data, "key9") == 0);
+    free(data);
+    assert(disk_cache_lookup(cache, "key7", &etag, &expiration));
+    assert(strcmp(etag, "etag") == 0 && expiration == 100);
+    data = disk_cache_read(cache, "key7", &size);
+    assert(size == 4 && strcmp(data, "key7") == 0);
+    free(data);
+
+    // Fill the cache: the oldest entries get evicted, and the log gets
+    // compacted.
+    data = calloc(1, 1000);
+    for (i = 0; i < 20; i++) {
+        snprintf(key, sizeof(key), "big%d", i);
+        assert(disk_cache_put(cache, key, data, 1000, NULL, 0) == 0);
+    }
+    free(data);
+    assert(!disk_cache_lookup(cache, "key0", NULL, NULL));
+    assert(disk_cache_lookup(cache, "big19", NULL, NULL));
+    disk_cache_get_stats(cache, &nb_hits, &nb_misses, NULL);
+    assert(nb_hits == 2 && nb_misses == 1);
+    stat(path, &st);
+    assert(st.st_size <= 4096 * 3 / 2 + 1100);
+
+    // Modify the cache in the middle of a compaction.
+    compact_start(cache);
+    compact_step(cache, 1);
+    assert(cache->compact.running);
+    assert(disk_cache_put(cache, "big19", "new", 3, NULL, 0) == 0);
+    assert(disk_cache_put(cache, "small", "small", 5, NULL, 0) == 0);
+    compact_step(cache, INT64_MAX);
+    assert(!cache->compact.running);
+    disk_cache_close(cache);
+    cache = disk_cache_open(path, 4096);
+    data = disk_cache_read(cache, "big19", &size);
+    assert(size == 3 && memcmp(data, "new", 3) == 0);
+    free(data);
+    data = disk_cache_read(cache, "small", &size);
+    assert(size == 5 && memcmp(data, "small", 5) == 0);
+    free(data);
+    assert(disk_cache_lookup(cache, "big18", NULL, NULL));
+    disk_cache_close(cache);
+
+    unlink(path);
+    rmdir(dir);
+}
+
+TEST_REGISTER(NULL, test_disk_cache, TEST_AUTO);
+
+#endif
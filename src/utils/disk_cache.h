@@ -0,0 +1,127 @@
+/* Stellarium Web Engine - Copyright (c) 2018 - Noctua Software Ltd
+ *
+ * This program is licensed under the terms of the GNU AGPL v3, or
+ * alternatively under a commercial licence.
+ *
+ * The terms of the AGPL v3 license can be found in the main directory of this
+ * repository.
+ */
+
+/*
+ * File: disk_cache.h
+ *
+ * Persistent key/value store used to cache the downloaded files.
+ *
+ * All the entries are stored in a single append-only log file, and an
+ * index of all the entries is kept in memory, so that checking if an entry
+ * is in the cache doesn't need any file system access.
+ *
+ * When the total size goes over the cache max size, the least recently
+ * used entries are evicted.  The log is compacted when it contains too
+ * much garbage.  The compaction writes a new file and atomically replaces
+ * the old one, so that a crash never corrupts the cache.  It is done
+ * incrementally, a bounded amount of data being copied at each put.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Type: disk_cache_t
+ * A persistent cache stored in a single file.
+ */
+typedef struct disk_cache disk_cache_t;
+
+/*
+ * Function: disk_cache_open
+ * Open or create a disk cache.
+ *
+ * This reads the index of all the entries in memory.  Any partially
+ * written entry at the end of the log (after a crash) is discarded.
+ *
+ * Parameters:
+ *   path     - Path of the cache log file.
+ *   max_size - Max size of the cache data in bytes.
+ *
+ * Return:
+ *   The cache, or NULL in case of error.
+ */
+disk_cache_t *disk_cache_open(const char *path, int64_t max_size);
+
+/*
+ * Function: disk_cache_close
+ * Close a disk cache and free all the memory it uses.
+ */
+void disk_cache_close(disk_cache_t *cache);
+
+/*
+ * Function: disk_cache_lookup
+ * Check if an entry is in the cache, without reading its data.
+ *
+ * This only uses the in memory index, and updates the hit/miss counters.
+ *
+ * Parameters:
+ *   key        - Key of the entry.
+ *   etag       - Get the etag of the entry.  Can be NULL.  The pointer
+ *                stays valid until the next modification of the cache.
+ *   expiration - Get the unix time expiration date.  Can be NULL.
+ *
+ * Return:
+ *   true if the entry is in the cache.
+ */
+bool disk_cache_lookup(disk_cache_t *cache, const char *key,
+                       const char **etag, double *expiration);
+
+/*
+ * Function: disk_cache_read
+ * Read the data of an entry.
+ *
+ * The returned data is always followed by a zero byte, so that text data
+ * can be used as a string.  If the data is corrupted, the entry is removed
+ * from the cache.
+ *
+ * Return:
+ *   A newly allocated buffer with the data, or NULL if the entry is not
+ *   in the cache.
+ */
+void *disk_cache_read(disk_cache_t *cache, const char *key, int *size);
+
+/*
+ * Function: disk_cache_put
+ * Add or replace an entry in the cache.
+ *
+ * Parameters:
+ *   key        - Key of the entry.
+ *   data       - The data to store.
+ *   size       - Size of the data.
+ *   etag       - Etag of the data.  Can be NULL.
+ *   expiration - Unix time expiration date of the data.
+ *
+ * Return:
+ *   0 on success.
+ */
+int disk_cache_put(disk_cache_t *cache, const char *key,
+                   const void *data, int size,
+                   const char *etag, double expiration);
+
+/*
+ * Function: disk_cache_set_expiration
+ * Change the expiration date of an entry, without rewriting its data.
+ *
+ * Return:
+ *   0 on success, or -1 if the entry is not in the cache.
+ */
+int disk_cache_set_expiration(disk_cache_t *cache, const char *key,
+                              double expiration);
+
+/*
+ * Function: disk_cache_get_stats
+ * Get the cache statistics.
+ *
+ * Parameters:
+ *   nb_hits   - Get the number of successful lookups.  Can be NULL.
+ *   nb_misses - Get the number of failed lookups.  Can be NULL.
+ *   size      - Get the size of the cached data.  Can be NULL.
+ */
+void disk_cache_get_stats(const disk_cache_t *cache,
+                          int *nb_hits, int *nb_misses, int64_t *size);
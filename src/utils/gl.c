@@ -126,6 +126,15 @@ void gl_buf_alloc(gl_buf_t *buf, const gl_buf_info_t *info, int capacity)
     buf->capacity = capacity;
 }
 
+void gl_buf_init(gl_buf_t *buf, const gl_buf_info_t *info, int capacity,
+                 void *data)
+{
+    memset(buf, 0, sizeof(*buf));
+    buf->info = info;
+    buf->data = data;
+    buf->capacity = capacity;
+}
+
 void gl_buf_release(gl_buf_t *buf)
 {
     free(buf->data);
@@ -87,9 +87,20 @@ typedef struct gl_buf
  */
 void gl_buf_alloc(gl_buf_t *buf, const gl_buf_info_t *info, int capacity);
 
+/*
+ * Function: gl_buf_init
+ * Init a buffer using already allocated memory.
+ *
+ * The data must be big enough for capacity items.  The buffer doesn't own
+ * the data: the caller is responsible for releasing it, and should not
+ * call <gl_buf_release> on the buffer.
+ */
+void gl_buf_init(gl_buf_t *buf, const gl_buf_info_t *info, int capacity,
+                 void *data);
+
 /*
  * Function: gl_buf_release
- * Release the memory used by a buffer.
+ * Release the memory of a buffer created with <gl_buf_alloc>.
  */
 void gl_buf_release(gl_buf_t *buf);
 
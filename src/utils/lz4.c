@@ -0,0 +1,192 @@
+/* Stellarium Web Engine - Copyright (c) 2018 - Noctua Software Ltd
+ *
+ * This program is licensed under the terms of the GNU AGPL v3, or
+ * alternatively under a commercial licence.
+ *
+ * The terms of the AGPL v3 license can be found in the main directory of this
+ * repository.
+ */
+
+/*
+ * The data is a list of sequences:
+ *
+ *   1 byte:  token: literals length (4 high bits), match length - 4 (4 low
+ *            bits).  A value of 15 means the length continues with extra
+ *            bytes, each one added to the length, until a byte != 255.
+ *   n bytes: literals.
+ *   2 bytes: match offset, little endian.
+ *   n bytes: match length extra bytes.
+ *
+ * The last sequence only contains literals.  The last match has to start at
+ * least 12 bytes before the end of the block, and the last 5 bytes are
+ * always literals.
+ */
+
+#include "lz4.h"
+
+#include <limits.h>
+#include <string.h>
+
+#define HASH_BITS 12
+#define MIN_MATCH 4
+#define MF_LIMIT 12
+#define LAST_LITERALS 5
+
+int lz4_compress_bound(int size)
+{
+    return size + size / 255 + 16;
+}
+
+static uint8_t *write_len(uint8_t *op, int len)
+{
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+static uint8_t *write_sequence(uint8_t *op, const uint8_t *literals,
+                               int nb_literals, int offset, int match_len)
+{
+    uint8_t *token = op++;
+    *token = (nb_literals < 15 ? nb_literals : 15) << 4;
+    if (nb_literals >= 15) op = write_len(op, nb_literals - 15);
+    memcpy(op, literals, nb_literals);
+    op += nb_literals;
+    if (!match_len) return op; // Last sequence.
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    match_len -= MIN_MATCH;
+    *token |= match_len < 15 ? match_len : 15;
+    if (match_len >= 15) op = write_len(op, match_len - 15);
+    return op;
+}
+
+int lz4_compress(const uint8_t *src, int size, uint8_t *dst)
+{
+    int table[1 << HASH_BITS];
+    int i = 0, anchor = 0, ref, len;
+    uint32_t seq;
+    uint8_t *op = dst;
+
+    memset(table, 0xff, sizeof(table));
+    // Greedy search of the previous occurrence of each 4 bytes sequence.
+    while (i + MF_LIMIT <= size) {
+        memcpy(&seq, src + i, 4);
+        ref = table[(seq * 2654435761u) >> (32 - HASH_BITS)];
+        table[(seq * 2654435761u) >> (32 - HASH_BITS)] = i;
+        if (ref < 0 || i - ref > 65535 || memcmp(src + ref, src + i, 4)) {
+            i++;
+            continue;
+        }
+        for (len = MIN_MATCH; i + len < size - LAST_LITERALS &&
+                              src[ref + len] == src[i + len]; len++);
+        op = write_sequence(op, src + anchor, i - anchor, i - ref, len);
+        i += len;
+        anchor = i;
+    }
+    op = write_sequence(op, src + anchor, size - anchor, 0, 0);
+    return op - dst;
+}
+
+// Read the extra bytes of a literals or match length.
+static int read_len(const uint8_t **ip, const uint8_t *iend, int len)
+{
+    int c;
+    if (len != 15) return len;
+    do {
+        if (*ip >= iend || len > INT_MAX - 255) return -1;
+        c = *(*ip)++;
+        len += c;
+    } while (c == 255);
+    return len;
+}
+
+int lz4_decompress(const uint8_t *src, int src_size, uint8_t *dst,
+                   int dst_size)
+{
+    const uint8_t *ip = src, *iend = src + src_size, *match;
+    uint8_t *op = dst, *oend = dst + dst_size;
+    int token, len, offset, i;
+
+    while (ip < iend) {
+        token = *ip++;
+        len = read_len(&ip, iend, token >> 4);
+        if (len < 0 || len > iend - ip || len > oend - op) return -1;
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+        if (ip == iend) break; // Last sequence.
+
+        if (iend - ip < 2) return -1;
+        offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op - dst) return -1;
+        len = read_len(&ip, iend, token & 15);
+        if (len < 0 || len > oend - op - MIN_MATCH) return -1;
+        len += MIN_MATCH;
+        match = op - offset;
+        if (offset >= len) {
+            memcpy(op, match, len);
+        } else {
+            // Overlapping match: copy byte per byte to repeat the pattern.
+            for (i = 0; i < len; i++) op[i] = match[i];
+        }
+        op += len;
+    }
+    return op - dst;
+}
+
+/******** TESTS ***********************************************************/
+
+#if COMPILE_TESTS
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "tests.h"
+
+static void test_lz4_roundtrip(const uint8_t *data, int size)
+{
+    uint8_t *comp, *out;
+    int comp_size;
+    comp = malloc(lz4_compress_bound(size));
+    out = malloc(size + 1);
+    comp_size = lz4_compress(data, size, comp);
+    assert(comp_size <= lz4_compress_bound(size));
+    assert(lz4_decompress(comp, comp_size, out, size) == size);
+    assert(memcmp(data, out, size) == 0);
+    // Not enough space for the output.
+    if (size) assert(lz4_decompress(comp, comp_size, out, size - 1) == -1);
+    free(comp);
+    free(out);
+}
+
+static void test_lz4(void)
+{
+    const int size = 100000;
+    uint8_t *data = malloc(size);
+    // Hand written block, with an overlapping match.
+    const uint8_t ref[] = {0x1f, 'a', 0x01, 0x00, 0x05, 0x50,
+                           'a', 'a', 'a', 'a', 'a'};
+    uint8_t out[30];
+    int i;
+
+    assert(lz4_decompress(ref, sizeof(ref), out, sizeof(out)) == 30);
+    for (i = 0; i < 30; i++) assert(out[i] == 'a');
+
+    srand(0);
+    test_lz4_roundtrip(data, 0);
+    for (i = 0; i < size; i++) data[i] = rand();
+    test_lz4_roundtrip(data, 10);
+    test_lz4_roundtrip(data, size);
+    for (i = 0; i < size; i++) data[i] = (i / 100) % 7 + rand() % 2;
+    test_lz4_roundtrip(data, size);
+    memset(data, 0, size);
+    test_lz4_roundtrip(data, size);
+    free(data);
+}
+
+TEST_REGISTER(NULL, test_lz4, TEST_AUTO);
+
+#endif
@@ -0,0 +1,57 @@
+/* Stellarium Web Engine - Copyright (c) 2018 - Noctua Software Ltd
+ *
+ * This program is licensed under the terms of the GNU AGPL v3, or
+ * alternatively under a commercial licence.
+ *
+ * The terms of the AGPL v3 license can be found in the main directory of this
+ * repository.
+ */
+
+/*
+ * File: lz4.h
+ * Minimal implementation of the LZ4 block format.
+ *
+ * LZ4 gives a lower compression ratio than zlib, but decompresses several
+ * times faster.  The data is compatible with the reference implementation
+ * (LZ4_compress_default / LZ4_decompress_safe), so the blocks can be
+ * created by any LZ4 library.
+ */
+
+#include <stdint.h>
+
+/*
+ * Function: lz4_compress_bound
+ * Return the maximum compressed size of some data.
+ */
+int lz4_compress_bound(int size);
+
+/*
+ * Function: lz4_compress
+ * Compress a block of data.
+ *
+ * Parameters:
+ *   src  - The data to compress.
+ *   size - Size of the data.
+ *   dst  - Output buffer of at least <lz4_compress_bound> bytes.
+ *
+ * Return:
+ *   The size of the compressed data.
+ */
+int lz4_compress(const uint8_t *src, int size, uint8_t *dst);
+
+/*
+ * Function: lz4_decompress
+ * Decompress a block of data.
+ *
+ * Parameters:
+ *   src      - The compressed data.
+ *   src_size - Size of the compressed data.
+ *   dst      - Output buffer.
+ *   dst_size - Size of the output buffer.
+ *
+ * Return:
+ *   The size of the decompressed data, or -1 if the data is corrupted or
+ *   doesn't fit in the output buffer.
+ */
+int lz4_decompress(const uint8_t *src, int src_size, uint8_t *dst,
+                   int dst_size);
@@ -0,0 +1,324 @@
+/* Stellarium Web Engine - Copyright (c) 2018 - Noctua Software Ltd
+ *
+ * This program is licensed under the terms of the GNU AGPL v3, or
+ * alternatively under a commercial licence.
+ *
+ * The terms of the AGPL v3 license can be found in the main directory of this
+ * repository.
+ */
+
+#include "moc.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FITS_BLOCK 2880
+#define FITS_CARD 80
+
+struct moc {
+    uint64_t    (*ranges)[2];
+    int         nb;
+    int         capacity;
+    bool        normalized; // Set if the ranges are sorted and disjoint.
+};
+
+// Values of a fits header we care about.
+typedef struct {
+    char        xtension[16];
+    char        tform1[16];
+    char        ordering[16];
+    int         bitpix;
+    int         naxis;
+    int64_t     naxes[8];
+    int64_t     pcount;
+} fits_header_t;
+
+moc_t *moc_create(void)
+{
+    moc_t *moc = calloc(1, sizeof(*moc));
+    moc->normalized = true;
+    return moc;
+}
+
+void moc_delete(moc_t *moc)
+{
+    if (!moc) return;
+    free(moc->ranges);
+    free(moc);
+}
+
+void moc_add_range(moc_t *moc, uint64_t start, uint64_t end)
+{
+    if (end <= start) return;
+    if (moc->nb == moc->capacity) {
+        moc->capacity = moc->capacity ? moc->capacity * 2 : 64;
+        moc->ranges = realloc(moc->ranges,
+                              moc->capacity * sizeof(*moc->ranges));
+    }
+    moc->ranges[moc->nb][0] = start;
+    moc->ranges[moc->nb][1] = end;
+    moc->nb++;
+    moc->normalized = false;
+}
+
+void moc_add_cell(moc_t *moc, int order, uint64_t pix)
+{
+    int shift = 2 * (MOC_MAX_ORDER - order);
+    assert(order >= 0 && order <= MOC_MAX_ORDER);
+    moc_add_range(moc, pix << shift, (pix + 1) << shift);
+}
+
+static int range_cmp(const void *a, const void *b)
+{
+    const uint64_t *ra = a, *rb = b;
+    return (ra[0] > rb[0]) - (ra[0] < rb[0]);
+}
+
+// Sort the ranges and merge the ones that overlap.
+static void normalize(moc_t *moc)
+{
+    int i, n = 0;
+    if (moc->normalized) return;
+    qsort(moc->ranges, moc->nb, sizeof(*moc->ranges), range_cmp);
+    for (i = 0; i < moc->nb; i++) {
+        if (n && moc->ranges[i][0] <= moc->ranges[n - 1][1]) {
+            if (moc->ranges[i][1] > moc->ranges[n - 1][1])
+                moc->ranges[n - 1][1] = moc->ranges[i][1];
+            continue;
+        }
+        moc->ranges[n][0] = moc->ranges[i][0];
+        moc->ranges[n][1] = moc->ranges[i][1];
+        n++;
+    }
+    moc->nb = n;
+    moc->normalized = true;
+}
+
+bool moc_intersects(moc_t *moc, int order, uint64_t pix)
+{
+    int shift = 2 * (MOC_MAX_ORDER - order);
+    uint64_t start = pix << shift, end = (pix + 1) << shift;
+    int lo = 0, hi, mid;
+
+    normalize(moc);
+    // Search the first range that ends after the start of the cell.
+    hi = moc->nb;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (moc->ranges[mid][1] <= start) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < moc->nb && moc->ranges[lo][0] < end;
+}
+
+int moc_get_ranges(moc_t *moc, const uint64_t (**ranges)[2])
+{
+    normalize(moc);
+    *ranges = (const uint64_t (*)[2])moc->ranges;
+    return moc->nb;
+}
+
+// Get the string value of a fits card, without the quotes and the
+// trailing spaces.
+static void card_get_str(const char *card, char *out, int size)
+{
+    const char *start, *end;
+    int len;
+    *out = '\0';
+    start = memchr(card + 10, '\'', FITS_CARD - 10);
+    if (!start) return;
+    start++;
+    end = memchr(start, '\'', card + FITS_CARD - start);
+    if (!end) return;
+    while (end > start && end[-1] == ' ') end--;
+    len = end - start;
+    if (len >= size) len = size - 1;
+    memcpy(out, start, len);
+    out[len] = '\0';
+}
+
+static int64_t card_get_int(const char *card)
+{
+    char buf[FITS_CARD - 9];
+    memcpy(buf, card + 10, FITS_CARD - 10);
+    buf[FITS_CARD - 10] = '\0';
+    return strtoll(buf, NULL, 10);
+}
+
+static bool card_is(const char *card, const char *key)
+{
+    int len = strlen(key);
+    return strncmp(card, key, len) == 0 &&
+           (len == 8 || card[len] == ' ' || card[len] == '=');
+}
+
+// Parse a fits header starting at a given offset.
+// Return the offset of the data following the header, or -1 in case of
+// error.
+static int64_t parse_header(const char *data, int64_t size, int64_t offset,
+                            fits_header_t *h)
+{
+    const char *card;
+
+    memset(h, 0, sizeof(*h));
+    for (; offset + FITS_CARD <= size; offset += FITS_CARD) {
+        card = data + offset;
+        if (card_is(card, "END")) {
+            offset += FITS_CARD;
+            return (offset + FITS_BLOCK - 1) / FITS_BLOCK * FITS_BLOCK;
+        }
+        if (card_is(card, "XTENSION"))
+            card_get_str(card, h->xtension, sizeof(h->xtension));
+        if (card_is(card, "TFORM1"))
+            card_get_str(card, h->tform1, sizeof(h->tform1));
+        if (card_is(card, "ORDERING"))
+            card_get_str(card, h->ordering, sizeof(h->ordering));
+        if (card_is(card, "BITPIX")) h->bitpix = card_get_int(card);
+        if (card_is(card, "NAXIS")) h->naxis = card_get_int(card);
+        if (card_is(card, "PCOUNT")) h->pcount = card_get_int(card);
+        if (strncmp(card, "NAXIS", 5) == 0 && card[5] >= '1' &&
+                card[5] <= '8' && card[6] == ' ')
+            h->naxes[card[5] - '1'] = card_get_int(card);
+    }
+    return -1;
+}
+
+// Size of the data of an HDU, rounded to the fits blocks.
+static int64_t get_data_size(const fits_header_t *h)
+{
+    int64_t size;
+    int i;
+    if (h->naxis == 0) return 0;
+    size = abs(h->bitpix) / 8;
+    for (i = 0; i < h->naxis && i < 8; i++) size *= h->naxes[i];
+    size += h->pcount;
+    return (size + FITS_BLOCK - 1) / FITS_BLOCK * FITS_BLOCK;
+}
+
+static uint64_t read_be(const uint8_t *p, int size)
+{
+    uint64_t v = 0;
+    int i;
+    for (i = 0; i < size; i++) v = (v << 8) | p[i];
+    return v;
+}
+
+static void add_nuniq(moc_t *moc, uint64_t nuniq)
+{
+    int order;
+    if (nuniq < 4) return;
+    order = (63 - __builtin_clzll(nuniq)) / 2 - 1;
+    if (order > MOC_MAX_ORDER) return;
+    moc_add_cell(moc, order, nuniq - (4ULL << (2 * order)));
+}
+
+int moc_parse_fits(moc_t *moc, const void *data_, int size)
+{
+    const char *data = data_;
+    fits_header_t h;
+    int64_t offset, i;
+    int value_size;
+    bool range;
+    const uint8_t *p;
+
+    if (size < FITS_BLOCK || strncmp(data, "SIMPLE", 6) != 0) return -1;
+    // Skip the primary HDU.
+    offset = parse_header(data, size, 0, &h);
+    if (offset < 0) return -1;
+    offset += get_data_size(&h);
+    // The MOC is stored in the first column of a binary table.
+    offset = parse_header(data, size, offset, &h);
+    if (offset < 0 || strcmp(h.xtension, "BINTABLE") != 0) return -1;
+    value_size = strchr(h.tform1, 'K') ? 8 : strchr(h.tform1, 'J') ? 4 : 0;
+    if (!value_size || h.naxes[0] != value_size) return -1;
+    if (offset + h.naxes[0] * h.naxes[1] > size) return -1;
+    range = strcmp(h.ordering, "RANGE") == 0;
+    if (range && h.naxes[1] % 2) return -1;
+
+    p = (const uint8_t*)data + offset;
+    for (i = 0; i < h.naxes[1]; i += range ? 2 : 1) {
+        if (range) {
+            moc_add_range(moc, read_be(p + i * value_size, value_size),
+                          read_be(p + (i + 1) * value_size, value_size));
+        } else {
+            add_nuniq(moc, read_be(p + i * value_size, value_size));
+        }
+    }
+    return 0;
+}
+
+/******** TESTS ***********************************************************/
+
+#if COMPILE_TESTS
+
+#include "tests.h"
+
+// Create a fits MOC file with some NUNIQ values.
+static int make_fits(char *buf, const uint32_t *values, int nb)
+{
+    char *p = buf;
+    int i;
+    #define CARD(...) do { \
+        p[snprintf(p, FITS_CARD, __VA_ARGS__)] = ' '; \
+        p += FITS_CARD; \
+    } while (0)
+
+    memset(buf, ' ', FITS_BLOCK * 3);
+    CARD("SIMPLE  =                    T");
+    CARD("BITPIX  =                    8");
+    CARD("NAXIS   =                    0");
+    CARD("END");
+    p = buf + FITS_BLOCK;
+    CARD("XTENSION= 'BINTABLE'");
+    CARD("BITPIX  =                    8");
+    CARD("NAXIS   =                    2");
+    CARD("NAXIS1  =                    4");
+    CARD("NAXIS2  = %20d", nb);
+    CARD("TFIELDS =                    1");
+    CARD("TFORM1  = '1J      '");
+    CARD("ORDERING= 'NUNIQ   '");
+    CARD("END");
+    p = buf + 2 * FITS_BLOCK;
+    for (i = 0; i < nb; i++) {
+        p[i * 4 + 0] = values[i] >> 24;
+        p[i * 4 + 1] = values[i] >> 16;
+        p[i * 4 + 2] = values[i] >> 8;
+        p[i * 4 + 3] = values[i] >> 0;
+    }
+    #undef CARD
+    return FITS_BLOCK * 3;
+}
+
+static void test_moc(void)
+{
+    char buf[FITS_BLOCK * 3];
+    const uint64_t (*ranges)[2];
+    // Order 0 pix 3, order 1 pix 0 and 1, order 3 pix 100.
+    const uint32_t values[] = {4 + 3, 16 + 0, 16 + 1, 256 + 100};
+    moc_t *moc;
+    int size;
+
+    moc = moc_create();
+    size = make_fits(buf, values, 4);
+    assert(moc_parse_fits(moc, buf, size) == 0);
+    // The two order 1 cells get merged.
+    assert(moc_get_ranges(moc, &ranges) == 3);
+    assert(moc_intersects(moc, 0, 0));
+    assert(moc_intersects(moc, 0, 3));
+    assert(!moc_intersects(moc, 0, 5));
+    assert(moc_intersects(moc, 1, 1));
+    assert(!moc_intersects(moc, 1, 2));
+    assert(moc_intersects(moc, 5, 3 * 1024 + 500));
+    assert(moc_intersects(moc, 1, 100 / 16));
+    assert(moc_intersects(moc, 4, 100 * 4 + 2));
+    assert(!moc_intersects(moc, 3, 101));
+    assert(!moc_intersects(moc, 29, (101ULL << 52)));
+    assert(moc_parse_fits(moc, buf, 100) == -1);
+    moc_delete(moc);
+}
+
+TEST_REGISTER(NULL, test_moc, TEST_AUTO);
+
+#endif
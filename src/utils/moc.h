@@ -0,0 +1,85 @@
+/* Stellarium Web Engine - Copyright (c) 2018 - Noctua Software Ltd
+ *
+ * This program is licensed under the terms of the GNU AGPL v3, or
+ * alternatively under a commercial licence.
+ *
+ * The terms of the AGPL v3 license can be found in the main directory of this
+ * repository.
+ */
+
+/*
+ * File: moc.h
+ * Multi-Order Coverage maps.
+ *
+ * A MOC describes the part of the sky covered by a survey as a set of
+ * healpix cells of different orders.  Internally all the cells are
+ * converted to a sorted list of disjoint ranges of pixels at the max order
+ * (29), so that testing if a cell intersects the coverage is a simple
+ * binary search, whatever the order of the cell.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MOC_MAX_ORDER 29
+
+/*
+ * Type: moc_t
+ * A coverage map.
+ */
+typedef struct moc moc_t;
+
+/*
+ * Function: moc_create
+ * Create a new empty coverage map.
+ */
+moc_t *moc_create(void);
+
+/*
+ * Function: moc_delete
+ * Delete a coverage map.
+ */
+void moc_delete(moc_t *moc);
+
+/*
+ * Function: moc_add_cell
+ * Add a healpix cell to the coverage.
+ */
+void moc_add_cell(moc_t *moc, int order, uint64_t pix);
+
+/*
+ * Function: moc_add_range
+ * Add a range of pixels at MOC_MAX_ORDER to the coverage.
+ *
+ * Parameters:
+ *   start - First pixel of the range.
+ *   end   - Pixel after the last pixel of the range.
+ */
+void moc_add_range(moc_t *moc, uint64_t start, uint64_t end);
+
+/*
+ * Function: moc_parse_fits
+ * Add the cells of a MOC fits file (as defined by the IVOA standard) to
+ * the coverage.
+ *
+ * Both the NUNIQ and RANGE ordering are supported.
+ *
+ * Return:
+ *   0 on success, -1 if the file is not a valid MOC.
+ */
+int moc_parse_fits(moc_t *moc, const void *data, int size);
+
+/*
+ * Function: moc_intersects
+ * Test if a healpix cell intersects the coverage.
+ */
+bool moc_intersects(moc_t *moc, int order, uint64_t pix);
+
+/*
+ * Function: moc_get_ranges
+ * Get the list of sorted disjoint ranges of the coverage.
+ *
+ * Return:
+ *   The number of ranges.
+ */
+int moc_get_ranges(moc_t *moc, const uint64_t (**ranges)[2]);
@@ -10,6 +10,9 @@
 #ifndef NO_LIBCURL
 
 #include "request.h"
+#include "disk_cache.h"
+#include "uthash.h"
+#include "utlist.h"
 #include "utstring.h"
 
 #include <assert.h>
@@ -29,14 +32,51 @@
 #   define PATH_MAX 1024
 #endif
 
-#define MAX_NB  16
+// Max number of idle curl handles we keep for reuse.
+#define POOL_SIZE 32
+
+// Max size of the data in the disk cache.
+#define CACHE_MAX_SIZE (512 * (1 << 20))
+
+// Max number of urls we remember as already revalidated.
+#define MAX_REVALIDATED 4096
+
+typedef struct request request_t;
+
+// Set of the urls already revalidated.
+typedef struct {
+    UT_hash_handle  hh;
+    char            url[];
+} url_t;
 
 // static data.
 static struct {
     CURLM        *curlm;
-    char         *cache_dir;
+    disk_cache_t *cache;
     int          nb; // Number of current running handles.
-} g = {};
+
+    // Idle easy handles.  Reusing them keeps their DNS and TLS session
+    // caches, the connections themselves are kept alive by the multi handle.
+    CURL         *pool[POOL_SIZE];
+    int          pool_size;
+
+    int          max_nb; // Max number of concurrent requests.
+    int          max_host_nb; // Max number of connections per host.
+    long         connect_timeout; // ms, zero for curl default.
+    long         timeout; // ms, zero for no timeout.
+
+    // Statistics of the finished transfers.
+    int          nb_done;
+    int64_t      nb_bytes;
+    double       latency; // Averaged time to first byte (sec).
+
+    request_t    *revalidations; // Running background revalidations.
+    url_t        *revalidated;
+} g = {
+    .max_nb = 16,
+    .max_host_nb = 6,
+    .connect_timeout = 15000,
+};
 
 struct request
 {
@@ -48,37 +88,20 @@ struct request
     void        *data;          // Actual data.
     int         size;
     bool        done;           // Request finished
-    char        *local_path;    // Data saved to this file
+    bool        cached;         // Data is in the disk cache.
+    void        *stale_data;    // Replaced data, kept until deleted.
+
+    // Background revalidation of a stale cached request.
+    request_t   *revalidation;  // For the stale request.
+    request_t   *origin;        // For the revalidation request.
+    request_t   *next;          // In the revalidations list.
+    bool        is_revalidation;
 
     struct curl_slist *headers;
     char        *etag;
     double      expiration;     // Unix time expiration date.
 };
 
-static const char *request_get_file(request_t *req, int *status_code);
-
-static void *read_file(const char *path, int *size)
-{
-    FILE *file;
-    char *ret;
-    int read_size __attribute__((unused));
-    int size_default;
-
-    size = size ?: &size_default; // Allow to pass NULL as size;
-    file = fopen(path, "rb");
-    if (!file) return NULL;
-    assert(file);
-    fseek(file, 0, SEEK_END);
-    *size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    ret = malloc(*size + 1);
-    read_size = fread(ret, *size, 1, file);
-    assert(read_size == 1 || *size == 0);
-    ret[*size] = '\0';
-    fclose(file);
-    return ret;
-}
-
 static double get_unix_time(void)
 {
     struct timeval tv;
@@ -86,16 +109,6 @@ static double get_unix_time(void)
     return tv.tv_sec + tv.tv_usec / 1000. / 1000.;
 }
 
-static bool file_exists(const char *path)
-{
-    FILE *file;
-    if ((file = fopen(path, "r"))) {
-        fclose(file);
-        return true;
-    }
-    return false;
-}
-
 /*
  * Create directories for a given file path.
  */
@@ -113,93 +126,159 @@ static int ensure_dir(const char *path)
     return 0;
 }
 
-static char *create_local_path(const char *url, const char *suffix)
+static void clear_revalidated(void)
 {
-    char *ret;
-    int i, r;
-    r = asprintf(&ret, "%s/%s%s", g.cache_dir, url, suffix ?: "");
-    if (r == -1) LOG_E("Error");
-    for (i = strlen(g.cache_dir) + 1; ret[i]; i++) {
-        if (ret[i] == '/' || ret[i] == ':')
-            ret[i] = '_';
+    url_t *url, *tmp;
+    HASH_ITER(hh, g.revalidated, url, tmp) {
+        HASH_DEL(g.revalidated, url);
+        free(url);
     }
-    ensure_dir(ret);
-    return ret;
 }
 
 void request_init(const char *cache_dir)
 {
+    char path[PATH_MAX];
     assert(cache_dir);
-    if (!g.curlm) g.curlm = curl_multi_init();
-    free(g.cache_dir);
-    g.cache_dir = strdup(cache_dir);
+    if (!g.curlm) {
+        g.curlm = curl_multi_init();
+        // Allow several requests to share a single HTTP/2 connection.
+        curl_multi_setopt(g.curlm, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+        curl_multi_setopt(g.curlm, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+                          (long)g.max_nb);
+        curl_multi_setopt(g.curlm, CURLMOPT_MAX_HOST_CONNECTIONS,
+                          (long)g.max_host_nb);
+    }
+    disk_cache_close(g.cache);
+    clear_revalidated();
+    snprintf(path, sizeof(path), "%s/requests.cache", cache_dir);
+    ensure_dir(path);
+    g.cache = disk_cache_open(path, CACHE_MAX_SIZE);
+}
+
+void request_get_cache_stats(int *nb_hits, int *nb_misses, int64_t *size)
+{
+    if (nb_hits) *nb_hits = 0;
+    if (nb_misses) *nb_misses = 0;
+    if (size) *size = 0;
+    if (g.cache) disk_cache_get_stats(g.cache, nb_hits, nb_misses, size);
+}
+
+void request_set_limits(int max_connections, int max_host_connections)
+{
+    g.max_nb = max_connections > 0 ? max_connections : 1;
+    g.max_host_nb = max_host_connections > 0 ? max_host_connections : 0;
+    if (!g.curlm) return;
+    curl_multi_setopt(g.curlm, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)g.max_nb);
+    curl_multi_setopt(g.curlm, CURLMOPT_MAX_HOST_CONNECTIONS,
+                      (long)g.max_host_nb);
+}
+
+void request_set_timeouts(double connect_timeout, double timeout)
+{
+    g.connect_timeout = connect_timeout > 0 ? connect_timeout * 1000 : 0;
+    g.timeout = timeout > 0 ? timeout * 1000 : 0;
+}
+
+void request_get_stats(int *nb_requests, int64_t *bytes, double *latency)
+{
+    if (nb_requests) *nb_requests = g.nb_done;
+    if (bytes) *bytes = g.nb_bytes;
+    if (latency) *latency = g.latency;
+}
+
+static CURL *get_handle(void)
+{
+    if (g.pool_size) return g.pool[--g.pool_size];
+    return curl_easy_init();
+}
+
+// Detach a handle from the multi handle and put it back into the pool.
+static void release_handle(CURL *handle)
+{
+    curl_multi_remove_handle(g.curlm, handle);
+    g.nb--;
+    if (g.pool_size == POOL_SIZE) {
+        curl_easy_cleanup(handle);
+        return;
+    }
+    curl_easy_reset(handle);
+    g.pool[g.pool_size++] = handle;
+}
+
+// Queue a background request to check if the cached data of a request is
+// still valid.  We only do it once per url.
+static void revalidate(request_t *req)
+{
+    url_t *url;
+    request_t *revalidation;
+
+    HASH_FIND_STR(g.revalidated, req->url, url);
+    if (url) return;
+    // At worst we revalidate some urls a second time.
+    if (HASH_COUNT(g.revalidated) >= MAX_REVALIDATED) clear_revalidated();
+    url = calloc(1, sizeof(*url) + strlen(req->url) + 1);
+    strcpy(url->url, req->url);
+    HASH_ADD_STR(g.revalidated, url, url);
+
+    revalidation = calloc(1, sizeof(*revalidation));
+    revalidation->url = strdup(req->url);
+    revalidation->etag = req->etag ? strdup(req->etag) : NULL;
+    revalidation->origin = req;
+    revalidation->is_revalidation = true;
+    req->revalidation = revalidation;
+    LL_APPEND(g.revalidations, revalidation);
 }
 
 request_t *request_create(const char *url)
 {
-    char *local_path, *info_path;
-    char etag[128];
-    double expiration;
-    FILE *file;
-    int r;
+    return request_create2(url, 0);
+}
+
+request_t *request_create2(const char *url, int flags)
+{
+    const char *etag;
     request_t *req = calloc(1, sizeof(*req));
     req->url = strdup(url);
 
     assert(strchr(url, ':')); // Make sure we have a protocol.
 
     // Check for cache info.
-    local_path = create_local_path(url, NULL);
-    info_path = create_local_path(url, ".info");
-    if (file_exists(local_path) && file_exists(info_path)) {
-        file = fopen(info_path, "r");
-        r = fscanf(file, "etag: %s\n", etag);
-        if (r == 1) req->etag = strdup(etag);
-        r = fscanf(file, "expiration: %lf\n", &expiration);
-        if (r == 1) req->expiration = expiration;
-        fclose(file);
-
+    if (g.cache && disk_cache_lookup(g.cache, url, &etag, &req->expiration)) {
+        if (etag) req->etag = strdup(etag);
         // If the cached version is not expired yet just use it.
         if (req->expiration && req->expiration > get_unix_time()) {
-            req->local_path = strdup(local_path);
+            req->cached = true;
+            req->status_code = 200;
+            req->done = true;
+        // Otherwise we can still use it while we check it in the
+        // background.
+        } else if (flags & REQUEST_STALE_WHILE_REVALIDATE) {
+            req->cached = true;
             req->status_code = 200;
             req->done = true;
+            revalidate(req);
         }
     }
-
-    free(local_path);
-    free(info_path);
     return req;
 }
 
 void request_delete(request_t *req)
 {
     if (!req) return;
-    if (req->handle) LOG_E("Aborting request not implemented yet!");
+    // Abort the request if it is still running.
+    if (req->handle) release_handle(req->handle);
+    // The revalidation keeps running, it only updates the disk cache.
+    if (req->revalidation) req->revalidation->origin = NULL;
     if (req->data != utstring_body(&req->data_buf)) free(req->data);
     utstring_done(&req->data_buf);
     utstring_done(&req->header_buf);
+    free(req->stale_data);
     free(req->url);
-    free(req->local_path);
     free(req->etag);
     if (req->headers) curl_slist_free_all(req->headers);
     free(req);
 }
 
-static void save_cache(const char *url, const char *path, const char *etag,
-                       double expiration)
-{
-    char *info_path;
-    FILE *file;
-    int r;
-    r = asprintf(&info_path, "%s.info", path);
-    if (r == -1) LOG_E("Error");
-    file = fopen(info_path, "w");
-    fprintf(file, "etag: %s\n", etag);
-    fprintf(file, "expiration: %.0f\n", expiration);
-    fclose(file);
-    free(info_path);
-}
-
 static bool header_find(const char *header, const char *re,
                         char *buf, int buf_size)
 {
@@ -227,39 +306,74 @@ static void on_done(request_t *req)
 {
     char buf[128] = {};
     const char *header;
-    const char *path;
-
-    assert(!req->local_path);
+    bool max_age;
 
     // The resource didn't change.
-    if (req->status_code / 100 == 3) {
-        req->local_path = create_local_path(req->url, NULL);
-        assert(file_exists(req->local_path));
-    }
+    if (req->status_code / 100 == 3) req->cached = true;
 
-    if (req->status_code / 100 != 2) goto end;
+    if (req->status_code / 100 != 2 && req->status_code != 304) goto end;
 
     // Parse header for cache control.
     header = utstring_body(&req->header_buf);
+    max_age = header_find(header, "Cache-Control: max-age=([0-9]+)\r\n",
+                          buf, sizeof(buf));
+    if (max_age) req->expiration = get_unix_time() + atof(buf);
+    // Not modified, only update the expiration date of the cached data.
+    if (req->status_code == 304) {
+        if (max_age && g.cache)
+            disk_cache_set_expiration(g.cache, req->url, req->expiration);
+        goto end;
+    }
     if (header_find(header, "ETag: \"(.+)\"\r\n", buf, sizeof(buf))) {
         free(req->etag);
         req->etag = strdup(buf);
     }
-    if (header_find(header, "Cache-Control: max-age=([0-9]+)\r\n",
-                    buf, sizeof(buf))) {
-        req->expiration = get_unix_time() + atof(buf);
-    }
     // For the moment we save all the files in the cache as long as they
-    // have an etag.  We also never clean the cache!
-    if (req->etag) {
-        path = request_get_file(req, NULL);
-        save_cache(req->url, path, req->etag, req->expiration);
+    // have an etag.
+    if (req->etag && g.cache) {
+        disk_cache_put(g.cache, req->url, req->data, req->size,
+                       req->etag, req->expiration);
     }
 
 end:
     return;
 }
 
+static void update_stats(CURL *handle)
+{
+    curl_off_t bytes = 0, ttfb = 0;
+    curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+    curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME_T, &ttfb);
+    g.nb_bytes += bytes;
+    // Exponential moving average of the latency.
+    if (!g.nb_done) g.latency = ttfb / 1000000.0;
+    g.latency += (ttfb / 1000000.0 - g.latency) * 0.1;
+    g.nb_done++;
+}
+
+static void start_request(request_t *req);
+
+// Called when a background revalidation has finished.  If the data
+// changed, the stale request uses the new data, but we keep the old one
+// alive since it might still be in use.
+static void on_revalidated(request_t *req)
+{
+    request_t *origin = req->origin;
+    LL_DELETE(g.revalidations, req);
+    if (origin) origin->revalidation = NULL;
+    if (origin && origin->cached && origin->data &&
+            req->status_code / 100 == 2 &&
+            (req->size != origin->size ||
+             memcmp(req->data, origin->data, req->size) != 0)) {
+        free(origin->stale_data);
+        origin->stale_data = origin->data;
+        origin->data = malloc(req->size + 1);
+        memcpy(origin->data, req->data, req->size + 1);
+        origin->size = req->size;
+    }
+    request_delete(req);
+}
+
 static void update(void)
 {
     int nb, msgs_in_queue;
@@ -267,13 +381,22 @@ static void update(void)
     CURL *handle;
     request_t *req;
     static double last = 0;
+    double start;
 
-    // Avoid loading too many resources too fast to keep a good framerate.
-    if ((get_unix_time() - last) < 16.0 / 1000) return;
+    // Start the pending revalidations.
+    LL_FOREACH(g.revalidations, req) {
+        if (g.nb >= g.max_nb) break;
+        if (!req->handle) start_request(req);
+    }
 
+    // Always let curl progress, so that the transfers don't stall.
     assert(g.curlm);
     curl_multi_perform(g.curlm, &nb);
     if (nb == g.nb) return;
+
+    // Avoid loading too many resources too fast to keep a good framerate.
+    start = get_unix_time();
+    if ((start - last) < 16.0 / 1000) return;
     while ((msg = curl_multi_info_read(g.curlm, &msgs_in_queue))) {
         if (msg->msg == CURLMSG_DONE) {
             handle = msg->easy_handle;
@@ -283,9 +406,8 @@ static void update(void)
             // Convention: returns a server timeout if the connection failed.
             if (!req->status_code && msg->data.result)
                 req->status_code = 598;
-            g.nb--;
-            curl_multi_remove_handle(g.curlm, handle);
-            curl_easy_cleanup(handle);
+            update_stats(handle);
+            release_handle(handle);
             req->handle = NULL;
             req->done = true;
             if (req->status_code / 100 == 2) {
@@ -296,8 +418,11 @@ static void update(void)
                 req->data = utstring_body(&req->data_buf);
             }
             on_done(req);
+            if (req->is_revalidation) on_revalidated(req);
             last = get_unix_time();
-            break;
+            // Don't spend more than a few ms here, the remaining messages
+            // stay in the queue until the next call.
+            if (last - start > 4.0 / 1000) break;
         }
     }
 }
@@ -311,58 +436,56 @@ static size_t write_callback(
     return len;
 }
 
-static void req_update(request_t *req)
+// Start the network transfer of a request.
+static void start_request(request_t *req)
 {
     int r;
     char *tmp;
-    assert(g.curlm); // Check that request_init was called!
-    if (req->done) return;
-    if (!req->handle && g.nb < MAX_NB) {
-        req->handle = curl_easy_init();
-        utstring_init(&req->data_buf);
-        utstring_init(&req->header_buf);
-        curl_easy_setopt(req->handle, CURLOPT_WRITEFUNCTION, write_callback);
-        curl_easy_setopt(req->handle, CURLOPT_WRITEDATA, &req->data_buf);
-        curl_easy_setopt(req->handle, CURLOPT_HEADERDATA, &req->header_buf);
-        curl_easy_setopt(req->handle, CURLOPT_URL, req->url);
-        curl_easy_setopt(req->handle, CURLOPT_FAILONERROR, 1);
-        curl_easy_setopt(req->handle, CURLOPT_PRIVATE, req);
-        curl_easy_setopt(req->handle, CURLOPT_FOLLOWLOCATION, 1);
-        curl_easy_setopt(req->handle, CURLOPT_SSL_VERIFYPEER, 0);
-        curl_easy_setopt(req->handle, CURLOPT_SSL_VERIFYHOST, 0);
-        // curl_easy_setopt(req->handle, CURLOPT_VERBOSE, 1);
-        if (req->etag) {
-            r = asprintf(&tmp, "If-None-Match: \"%s\"", req->etag);
-            if (r == -1) LOG_E("Error");
-            req->headers = curl_slist_append(req->headers, tmp);
-            free(tmp);
-        }
-        if (req->headers)
-            curl_easy_setopt(req->handle, CURLOPT_HTTPHEADER, req->headers);
-
-        curl_multi_add_handle(g.curlm, req->handle);
-        g.nb++;
+    req->handle = get_handle();
+    utstring_init(&req->data_buf);
+    utstring_init(&req->header_buf);
+    curl_easy_setopt(req->handle, CURLOPT_WRITEFUNCTION, write_callback);
+    curl_easy_setopt(req->handle, CURLOPT_WRITEDATA, &req->data_buf);
+    curl_easy_setopt(req->handle, CURLOPT_HEADERDATA, &req->header_buf);
+    curl_easy_setopt(req->handle, CURLOPT_URL, req->url);
+    curl_easy_setopt(req->handle, CURLOPT_FAILONERROR, 1);
+    curl_easy_setopt(req->handle, CURLOPT_PRIVATE, req);
+    curl_easy_setopt(req->handle, CURLOPT_FOLLOWLOCATION, 1);
+    curl_easy_setopt(req->handle, CURLOPT_SSL_VERIFYPEER, 0);
+    curl_easy_setopt(req->handle, CURLOPT_SSL_VERIFYHOST, 0);
+    curl_easy_setopt(req->handle, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(req->handle, CURLOPT_HTTP_VERSION,
+                     (long)CURL_HTTP_VERSION_2TLS);
+    // Prefer waiting for an existing connection that can multiplex
+    // over opening a new one.
+    curl_easy_setopt(req->handle, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(req->handle, CURLOPT_CONNECTTIMEOUT_MS,
+                     g.connect_timeout);
+    curl_easy_setopt(req->handle, CURLOPT_TIMEOUT_MS, g.timeout);
+    // curl_easy_setopt(req->handle, CURLOPT_VERBOSE, 1);
+    if (req->etag) {
+        r = asprintf(&tmp, "If-None-Match: \"%s\"", req->etag);
+        if (r == -1) LOG_E("Error");
+        req->headers = curl_slist_append(req->headers, tmp);
+        free(tmp);
     }
+    if (req->headers)
+        curl_easy_setopt(req->handle, CURLOPT_HTTPHEADER, req->headers);
 
-    update();
+    curl_multi_add_handle(g.curlm, req->handle);
+    g.nb++;
 }
 
-static const char *request_get_file(request_t *req, int *status_code)
+static void req_update(request_t *req)
 {
-    FILE *file;
-    if (!req->local_path) {
-        req_update(req);
-        if (req->done && req->status_code / 100 == 2) {
-            req->local_path = create_local_path(req->url, NULL);
-            file = fopen(req->local_path, "wb");
-            if (!file) perror(NULL);
-            assert(file);
-            fwrite(utstring_body(&req->data_buf), 1, req->size, file);
-            fclose(file);
-        }
+    assert(g.curlm); // Check that request_init was called!
+    if (req->done) {
+        // Keep the background revalidations running.
+        if (g.revalidations) update();
+        return;
     }
-    if (status_code) *status_code = req->status_code;
-    return req->local_path;
+    if (!req->handle && g.nb < g.max_nb) start_request(req);
+    update();
 }
 
 const void *request_get_data(request_t *req, int *size, int *status_code)
@@ -373,9 +496,17 @@ const void *request_get_data(request_t *req, int *size, int *status_code)
         if (size) *size = 0;
         return NULL;
     }
-    // Local file, copy it into the data buffer.
-    if (!req->data && req->local_path) {
-        req->data = read_file(req->local_path, &req->size);
+    // Data in the disk cache.
+    if (!req->data && req->cached) {
+        req->data = disk_cache_read(g.cache, req->url, &req->size);
+        // The cache entry got evicted or corrupted, request it again.
+        if (!req->data) {
+            request_make_fresh(req);
+            req->cached = false;
+            req->done = false;
+            req->status_code = 0;
+            return request_get_data(req, size, status_code);
+        }
     }
     if (size) *size = req->size;
     return req->data;
@@ -7,12 +7,81 @@
  * repository.
  */
 
+#include <stdint.h>
 
 typedef struct request request_t;
 
+/*
+ * Enum: REQUEST_FLAGS
+ *
+ * Values:
+ *   REQUEST_STALE_WHILE_REVALIDATE - If we have an expired copy of the data
+ *       in the cache, return it immediately and check in the background if
+ *       it is still valid.  If the data changed, the cache and the request
+ *       data are replaced, the previous data pointer stays valid until the
+ *       request is deleted.
+ */
+enum {
+    REQUEST_STALE_WHILE_REVALIDATE = 1 << 0,
+};
+
 void request_init(const char *cache_dir);
 request_t *request_create(const char *url);
+
+/*
+ * Function: request_create2
+ * Same as request_create, but accepts a union of <REQUEST_FLAGS>.
+ */
+request_t *request_create2(const char *url, int flags);
 void request_delete(request_t *req);
 const void *request_get_data(request_t *req, int *size, int *status_code);
 // Don't use cache even if we have a local copy.
 void request_make_fresh(request_t *req);
+
+/*
+ * Function: request_get_cache_stats
+ * Get the statistics of the requests disk cache.
+ *
+ * Parameters:
+ *   nb_hits   - Get the number of requests found in the cache.
+ *   nb_misses - Get the number of requests not found in the cache.
+ *   size      - Get the total size of the cached data.
+ */
+void request_get_cache_stats(int *nb_hits, int *nb_misses, int64_t *size);
+
+/*
+ * Function: request_set_limits
+ * Set the max number of concurrent requests.
+ *
+ * Parameters:
+ *   max_connections      - Max number of requests running at the same time.
+ *   max_host_connections - Max number of connections to a single host,
+ *                          zero for no limit.  With HTTP/2 several requests
+ *                          can share the same connection.
+ */
+void request_set_limits(int max_connections, int max_host_connections);
+
+/*
+ * Function: request_set_timeouts
+ * Set the timeouts of the new requests.
+ *
+ * A request that times out returns the status code 598.
+ *
+ * Parameters:
+ *   connect_timeout - Max time to connect to the server (sec), zero to use
+ *                     the default value.
+ *   timeout         - Max total time of a request (sec), zero for no limit.
+ */
+void request_set_timeouts(double connect_timeout, double timeout);
+
+/*
+ * Function: request_get_stats
+ * Get the statistics of the finished network requests.
+ *
+ * Parameters:
+ *   nb_requests - Get the number of finished requests.
+ *   bytes       - Get the total number of bytes downloaded.
+ *   latency     - Get the averaged time to first byte of the last requests
+ *                 (sec).
+ */
+void request_get_stats(int *nb_requests, int64_t *bytes, double *latency);
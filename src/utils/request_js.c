@@ -11,8 +11,6 @@
 
 #ifdef __EMSCRIPTEN__
 
-#define MAX_NB  16 // Max number of concurrent requests.
-
 struct request
 {
     char        *url;
@@ -21,18 +19,52 @@ struct request
     bool        done;
     void        *data;
     int         size;
+    double      start_time;
 };
 
 
 static struct {
     int nb;     // Number of current running requests.
-} g = {};
+    int max_nb; // Max number of concurrent requests.
+
+    int nb_done;
+    int64_t nb_bytes;
+    double latency;
+} g = {
+    .max_nb = 16,
+};
 
 void request_init(const char *cache_dir)
 {
     // Ignore the cache dir with emscripten.
 }
 
+void request_get_cache_stats(int *nb_hits, int *nb_misses, int64_t *size)
+{
+    // The cache is handled by the browser.
+    if (nb_hits) *nb_hits = 0;
+    if (nb_misses) *nb_misses = 0;
+    if (size) *size = 0;
+}
+
+void request_set_limits(int max_connections, int max_host_connections)
+{
+    // The connections are handled by the browser.
+    g.max_nb = max(max_connections, 1);
+}
+
+void request_set_timeouts(double connect_timeout, double timeout)
+{
+    // Not supported by emscripten_async_wget2_data.
+}
+
+void request_get_stats(int *nb_requests, int64_t *bytes, double *latency)
+{
+    if (nb_requests) *nb_requests = g.nb_done;
+    if (bytes) *bytes = g.nb_bytes;
+    if (latency) *latency = g.latency;
+}
+
 request_t *request_create(const char *url)
 {
     request_t *req = calloc(1, sizeof(*req));
@@ -40,6 +72,12 @@ request_t *request_create(const char *url)
     return req;
 }
 
+request_t *request_create2(const char *url, int flags)
+{
+    // The cache is handled by the browser.
+    return request_create(url);
+}
+
 void request_delete(request_t *req)
 {
     if (!req) return;
@@ -78,6 +116,12 @@ static void onload(unsigned int _, void *arg, void *data, unsigned int size)
     req->size = size;
     req->done = true;
     g.nb--;
+
+    // We don't get the time to first byte, so use the total time instead.
+    if (!g.nb_done) g.latency = sys_get_unix_time() - req->start_time;
+    g.latency = mix(g.latency, sys_get_unix_time() - req->start_time, 0.1);
+    g.nb_bytes += size;
+    g.nb_done++;
 }
 
 static void onerror(unsigned int _, void *arg, int err, const char *msg)
@@ -98,11 +142,12 @@ static void onprogress(unsigned int _, void *arg, int nb_bytes, int size)
 const void *request_get_data(request_t *req, int *size, int *status_code)
 {
     int handle;
-    if (!req->done && !req->handle && g.nb < MAX_NB) {
+    if (!req->done && !req->handle && g.nb < g.max_nb) {
         handle = emscripten_async_wget2_data(
                 req->url, "GET", NULL, req, false,
                 onload, onerror, onprogress);
         req->handle = handle + 1; // So that we cannot get 0.
+        req->start_time = sys_get_unix_time();
         g.nb++;
     }
     if (size) *size = req->size;
@@ -110,6 +110,37 @@ uint8_t *img_read_from_mem(const void *data, int size,
     return stbi_load_from_memory(data, size, w, h, bpp, *bpp);
 }
 
+uint8_t *img_read_from_mem_scaled(const void *data, int size, int shift,
+                                  int *w, int *h, int *bpp)
+{
+    WebPDecoderConfig config;
+    uint8_t *img;
+
+    // Only webp support scaling at decode time.  Downscaling the other
+    // formats after the decoding would cost more than it saves, so we
+    // just decode them at full resolution.
+    if (!shift || !WebPGetInfo(data, size, w, h))
+        return img_read_from_mem(data, size, w, h, bpp);
+    *w = max(1, *w >> shift);
+    *h = max(1, *h >> shift);
+    *bpp = 4;
+    img = malloc(*w * *h * 4);
+    WebPInitDecoderConfig(&config);
+    config.options.use_scaling = 1;
+    config.options.scaled_width = *w;
+    config.options.scaled_height = *h;
+    config.output.colorspace = MODE_RGBA;
+    config.output.is_external_memory = 1;
+    config.output.u.RGBA.rgba = img;
+    config.output.u.RGBA.stride = *w * 4;
+    config.output.u.RGBA.size = *w * *h * 4;
+    if (WebPDecode(data, size, &config) != VP8_STATUS_OK) {
+        free(img);
+        return NULL;
+    }
+    return img;
+}
+
 void img_write(const uint8_t *img, int w, int h, int bpp, const char *path)
 {
     stbi_write_png(path, w, h, bpp, img, 0);
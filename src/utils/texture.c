@@ -8,10 +8,14 @@
  */
 
 #include "texture.h"
+#include "bc1.h"
 #include "gl.h"
 
+#include "utlist.h"
+
 #include <assert.h>
 #include <math.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -21,9 +25,80 @@ static struct {
                      int *w, int *h, int *bpp);
 } g_callback = {};
 
+// Registry of all the textures that have their own OpenGL storage, sorted
+// from the least recently used to the most recently used, with the total
+// size per category.
+static struct {
+    texture_t   *textures;
+    int64_t     size[TEX_CAT_COUNT];
+    int         frame;
+} g_registry = {.frame = 1};
+
+// Set by the tests to skip all the OpenGL calls, so that the textures can
+// be used without an OpenGL context.
+static bool g_stub_gl = false;
+
+#define TGL(line) do { if (!g_stub_gl) GL(line); } while (0)
+
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#   define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+
+typedef struct atlas_page atlas_page_t;
+struct atlas_page {
+    atlas_page_t    *next, *prev;
+    texture_t       *tex;
+    int             nb_used;
+    uint8_t         *used; // One value per slot.
+};
+
+struct texture_atlas {
+    int             page_size;
+    int             w, h, bpp;
+    int             nb_cols;    // Number of slots per row of a page.
+    int             nb_slots;   // Number of slots per page.
+    atlas_page_t    *pages;
+    int             category;
+    const void      *owner;
+};
+
 static inline bool is_pow2(int n) {return (n & (n - 1)) == 0;}
 static inline int next_pow2(int x) {return pow(2, ceil(log(x) / log(2)));}
 
+static void gen_texture(uint32_t *id)
+{
+    static uint32_t stub_id = 0;
+    if (g_stub_gl) *id = ++stub_id;
+    else GL(glGenTextures(1, id));
+}
+
+static void registry_remove(texture_t *tex)
+{
+    if (!tex->size) return;
+    DL_DELETE2(g_registry.textures, tex, reg_prev, reg_next);
+    g_registry.size[tex->category] -= tex->size;
+    tex->size = 0;
+}
+
+static void registry_add(texture_t *tex, int size)
+{
+    registry_remove(tex);
+    tex->size = size;
+    tex->last_used = g_registry.frame;
+    g_registry.size[tex->category] += size;
+    DL_APPEND2(g_registry.textures, tex, reg_prev, reg_next);
+}
+
+// Move a texture to the end of the registry list.
+static void registry_touch(texture_t *tex)
+{
+    if (tex->last_used == g_registry.frame) return;
+    tex->last_used = g_registry.frame;
+    if (!tex->size) return;
+    DL_DELETE2(g_registry.textures, tex, reg_prev, reg_next);
+    DL_APPEND2(g_registry.textures, tex, reg_prev, reg_next);
+}
+
 
 static void blit(const uint8_t *src, int src_w, int src_h, int bpp,
                  uint8_t *dst, int dst_w, int dst_h,
@@ -50,6 +125,7 @@ void texture_set_data(texture_t *tex, const void *data, int w, int h, int bpp)
 {
     uint8_t *buff0 = NULL;
     int data_type = GL_UNSIGNED_BYTE;
+    int size;
     assert(tex->id);
 
     tex->w = w;
@@ -66,19 +142,24 @@ void texture_set_data(texture_t *tex, const void *data, int w, int h, int bpp)
         blit(data, w, h, bpp, buff0, tex->tex_w, tex->tex_h, 0, 0, w, h);
         data = buff0;
     }
-    GL(glActiveTexture(GL_TEXTURE0));
-    GL(glBindTexture(GL_TEXTURE_2D, tex->id));
-    GL(glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
-    GL(glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+    TGL(glActiveTexture(GL_TEXTURE0));
+    TGL(glBindTexture(GL_TEXTURE_2D, tex->id));
+    TGL(glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
+    TGL(glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
             (tex->flags & TF_MIPMAP)? GL_LINEAR_MIPMAP_NEAREST : GL_LINEAR));
-    GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
-    GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
-    GL(glTexImage2D(GL_TEXTURE_2D, 0, tex->format, tex->tex_w, tex->tex_h,
+    TGL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+    TGL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+    TGL(glTexImage2D(GL_TEXTURE_2D, 0, tex->format, tex->tex_w, tex->tex_h,
                 0, tex->format, data_type, data));
     free(buff0);
 
     if (tex->flags & TF_MIPMAP)
-        GL(glGenerateMipmap(GL_TEXTURE_2D));
+        TGL(glGenerateMipmap(GL_TEXTURE_2D));
+
+    // The mipmaps add a third of the size of the texture.
+    size = tex->tex_w * tex->tex_h * bpp;
+    if (tex->flags & TF_MIPMAP) size += size / 3;
+    registry_add(tex, size);
 }
 
 texture_t *texture_create(int w, int h, int bpp)
@@ -91,20 +172,78 @@ texture_t *texture_create(int w, int h, int bpp)
     tex->w = w;
     tex->h = h;
     tex->format = (int[]){0, 0, 0, GL_RGB, GL_RGBA}[bpp];
-    GL(glGenTextures(1, &tex->id));
+    gen_texture(&tex->id);
     return tex;
 }
 
+static void atlas_release_slot(texture_t *tex);
+
 void texture_release(texture_t *tex)
 {
     if (!tex) return;
     tex->ref--;
     if (tex->ref) return;
+    if (tex->atlas) {
+        atlas_release_slot(tex);
+        free(tex);
+        return;
+    }
+    registry_remove(tex);
     free(tex->url);
-    GL(glDeleteTextures(1, &tex->id));
+    if (tex->id) TGL(glDeleteTextures(1, &tex->id));
     free(tex);
 }
 
+void texture_set_owner(texture_t *tex, int category, const void *owner)
+{
+    assert(category >= 0 && category < TEX_CAT_COUNT);
+    g_registry.size[tex->category] -= tex->size;
+    g_registry.size[category] += tex->size;
+    tex->category = category;
+    tex->owner = owner;
+}
+
+int64_t texture_get_memory(int category, const void *owner)
+{
+    const texture_t *tex;
+    int64_t ret = 0;
+    int i;
+
+    if (!owner) {
+        for (i = 0; i < TEX_CAT_COUNT; i++) {
+            if (category == -1 || category == i) ret += g_registry.size[i];
+        }
+        return ret;
+    }
+    DL_FOREACH2(g_registry.textures, tex, reg_next) {
+        if (tex->owner != owner) continue;
+        if (category != -1 && tex->category != category) continue;
+        ret += tex->size;
+    }
+    return ret;
+}
+
+int texture_end_frame(int64_t max_size)
+{
+    texture_t *tex, *tmp;
+    int nb = 0;
+
+    if (!max_size) goto end;
+    DL_FOREACH_SAFE2(g_registry.textures, tex, tmp, reg_next) {
+        if (texture_get_memory(-1, NULL) <= max_size) break;
+        // All the following textures have also been used in this frame.
+        if (tex->last_used == g_registry.frame) break;
+        if (!tex->url) continue; // Cannot be re-created.
+        registry_remove(tex);
+        TGL(glDeleteTextures(1, &tex->id));
+        tex->id = 0;
+        nb++;
+    }
+end:
+    g_registry.frame++;
+    return nb;
+}
+
 texture_t *texture_from_data(const void *data, int img_w, int img_h, int bpp,
                              int x, int y, int w, int h, int flags)
 {
@@ -115,7 +254,7 @@ texture_t *texture_from_data(const void *data, int img_w, int img_h, int bpp,
     tex = calloc(1, sizeof(*tex));
     tex->ref = 1;
     tex->flags = flags;
-    GL(glGenTextures(1, &tex->id));
+    gen_texture(&tex->id);
 
     if (x != 0 || y != 0 || w != img_w || h != img_h) {
         img = calloc(w * h, bpp);
@@ -129,6 +268,42 @@ texture_t *texture_from_data(const void *data, int img_w, int img_h, int bpp,
     return tex;
 }
 
+bool texture_bc1_supported(void)
+{
+    static int ret = -1;
+    const char *exts;
+    if (ret == -1) {
+        exts = g_stub_gl ? NULL : (const char*)glGetString(GL_EXTENSIONS);
+        // Desktop GL and WebGL don't use the same extension name.
+        ret = exts && (strstr(exts, "texture_compression_s3tc") ||
+                       strstr(exts, "compressed_texture_s3tc"));
+    }
+    return ret;
+}
+
+texture_t *texture_from_bc1(const void *data, int w, int h, int flags)
+{
+    texture_t *tex;
+    assert(is_pow2(w) && is_pow2(h) && w >= 4 && h >= 4);
+    tex = calloc(1, sizeof(*tex));
+    tex->ref = 1;
+    tex->flags = flags & ~TF_MIPMAP;
+    tex->w = tex->tex_w = w;
+    tex->h = tex->tex_h = h;
+    tex->format = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+    gen_texture(&tex->id);
+    TGL(glActiveTexture(GL_TEXTURE0));
+    TGL(glBindTexture(GL_TEXTURE_2D, tex->id));
+    TGL(glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
+    TGL(glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR));
+    TGL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+    TGL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+    TGL(glCompressedTexImage2D(GL_TEXTURE_2D, 0, tex->format, w, h, 0,
+                               bc1_get_size(w, h), data));
+    registry_add(tex, bc1_get_size(w, h));
+    return tex;
+}
+
 texture_t *texture_from_url(const char *url, int flags)
 {
     texture_t *tex;
@@ -144,13 +319,199 @@ bool texture_load(texture_t *tex, int *code)
 {
     int w, h, bpp = 0;
     void *img;
-    if (tex->id) return true;
+    if (tex->id) {
+        registry_touch(tex);
+        return true;
+    }
     assert(tex->url);
     assert(g_callback.load);
     img = g_callback.load(g_callback.user, tex->url, code, &w, &h, &bpp);
     if (!img) return false;
-    GL(glGenTextures(1, &tex->id));
+    gen_texture(&tex->id);
     texture_set_data(tex, img, w, h, bpp);
     free(img);
     return true;
 }
+
+texture_atlas_t *texture_atlas_create(int page_size, int w, int h, int bpp)
+{
+    texture_atlas_t *atlas;
+    assert(is_pow2(page_size) && w <= page_size && h <= page_size);
+    atlas = calloc(1, sizeof(*atlas));
+    atlas->page_size = page_size;
+    atlas->w = w;
+    atlas->h = h;
+    atlas->bpp = bpp;
+    atlas->nb_cols = page_size / w;
+    atlas->nb_slots = atlas->nb_cols * (page_size / h);
+    return atlas;
+}
+
+static atlas_page_t *atlas_add_page(texture_atlas_t *atlas)
+{
+    atlas_page_t *page;
+    page = calloc(1, sizeof(*page));
+    page->used = calloc(atlas->nb_slots, 1);
+    page->tex = calloc(1, sizeof(*page->tex));
+    page->tex->ref = 1;
+    page->tex->category = atlas->category;
+    page->tex->owner = atlas->owner;
+    gen_texture(&page->tex->id);
+    texture_set_data(page->tex, NULL, atlas->page_size, atlas->page_size,
+                     atlas->bpp);
+    DL_APPEND(atlas->pages, page);
+    return page;
+}
+
+texture_t *texture_atlas_add(texture_atlas_t *atlas, const void *data)
+{
+    atlas_page_t *page;
+    texture_t *tex;
+    int slot;
+
+    DL_FOREACH(atlas->pages, page) {
+        if (page->nb_used < atlas->nb_slots) break;
+    }
+    if (!page) page = atlas_add_page(atlas);
+    for (slot = 0; page->used[slot]; slot++) {}
+    page->used[slot] = 1;
+    page->nb_used++;
+
+    tex = calloc(1, sizeof(*tex));
+    tex->ref = 1;
+    tex->atlas = atlas;
+    tex->page = page->tex;
+    tex->id = page->tex->id;
+    tex->format = page->tex->format;
+    tex->w = tex->tex_w = atlas->w;
+    tex->h = tex->tex_h = atlas->h;
+    tex->x = (slot % atlas->nb_cols) * atlas->w;
+    tex->y = (slot / atlas->nb_cols) * atlas->h;
+
+    tex->category = atlas->category;
+    tex->owner = atlas->owner;
+
+    TGL(glActiveTexture(GL_TEXTURE0));
+    TGL(glBindTexture(GL_TEXTURE_2D, tex->id));
+    TGL(glPixelStorei(GL_UNPACK_ALIGNMENT, 1));
+    TGL(glTexSubImage2D(GL_TEXTURE_2D, 0, tex->x, tex->y, tex->w, tex->h,
+                        tex->format, GL_UNSIGNED_BYTE, data));
+    TGL(glPixelStorei(GL_UNPACK_ALIGNMENT, 4));
+    return tex;
+}
+
+void texture_atlas_set_owner(texture_atlas_t *atlas, int category,
+                             const void *owner)
+{
+    atlas_page_t *page;
+    atlas->category = category;
+    atlas->owner = owner;
+    DL_FOREACH(atlas->pages, page) {
+        texture_set_owner(page->tex, category, owner);
+    }
+}
+
+static void atlas_release_slot(texture_t *tex)
+{
+    texture_atlas_t *atlas = tex->atlas;
+    atlas_page_t *page;
+    int slot;
+
+    DL_FOREACH(atlas->pages, page) {
+        if (page->tex == tex->page) break;
+    }
+    assert(page);
+    slot = tex->y / atlas->h * atlas->nb_cols + tex->x / atlas->w;
+    assert(page->used[slot]);
+    page->used[slot] = 0;
+    page->nb_used--;
+    if (page->nb_used) return;
+    // The page texture can still be referenced by the renderer until the
+    // end of the frame.
+    DL_DELETE(atlas->pages, page);
+    texture_release(page->tex);
+    free(page->used);
+    free(page);
+}
+
+void texture_atlas_get_stats(const texture_atlas_t *atlas,
+                             int *nb_pages, int *nb_used)
+{
+    const atlas_page_t *page;
+    *nb_pages = 0;
+    *nb_used = 0;
+    DL_FOREACH(atlas->pages, page) {
+        (*nb_pages)++;
+        *nb_used += page->nb_used;
+    }
+}
+
+/******** TESTS ***********************************************************/
+
+#if COMPILE_TESTS
+
+#include "tests.h"
+
+static uint8_t *test_load(void *user, const char *url, int *code,
+                          int *w, int *h, int *bpp)
+{
+    *w = 16;
+    *h = 16;
+    *bpp = 4;
+    if (code) *code = 200;
+    return calloc(16 * 16, 4);
+}
+
+static void test_texture_registry(void)
+{
+    const int size = 16 * 16 * 4;
+    texture_t *a, *b, *c;
+    uint8_t img[16 * 16 * 4] = {};
+    typeof(g_callback) callback = g_callback;
+    typeof(g_registry) registry = g_registry;
+
+    // Run on an empty registry, without OpenGL.
+    memset(&g_registry, 0, sizeof(g_registry));
+    g_registry.frame = 1;
+    g_stub_gl = true;
+    texture_set_load_callback(NULL, test_load);
+
+    a = texture_from_url("a", 0);
+    b = texture_from_url("b", 0);
+    c = texture_from_data(img, 16, 16, 4, 0, 0, 16, 16, 0);
+    texture_set_owner(a, TEX_CAT_PLANET, a);
+    texture_set_owner(c, TEX_CAT_LABEL, NULL);
+    assert(texture_get_memory(-1, NULL) == 3 * size);
+    assert(texture_get_memory(TEX_CAT_LABEL, NULL) == size);
+    assert(texture_get_memory(TEX_CAT_PLANET, a) == size);
+    assert(texture_get_memory(-1, b) == 0);
+    assert(texture_end_frame(0) == 0);
+
+    // Only b is used: a is the least recently used re-creatable texture.
+    assert(texture_load(b, NULL));
+    assert(texture_end_frame(2 * size) == 1);
+    assert(a->id == 0 && b->id && c->id);
+    assert(texture_get_memory(TEX_CAT_PLANET, NULL) == 0);
+
+    // a gets loaded again, and b is evicted.  c cannot be re-created, so
+    // we stay over the budget.
+    assert(texture_load(a, NULL));
+    assert(texture_get_memory(TEX_CAT_PLANET, a) == size);
+    assert(texture_end_frame(size) == 1);
+    assert(a->id && b->id == 0);
+    assert(texture_get_memory(-1, NULL) == 2 * size);
+
+    texture_release(a);
+    texture_release(b);
+    texture_release(c);
+    assert(texture_get_memory(-1, NULL) == 0);
+    assert(!g_registry.textures);
+
+    g_stub_gl = false;
+    g_callback = callback;
+    g_registry = registry;
+}
+
+TEST_REGISTER(NULL, test_texture_registry, TEST_AUTO);
+
+#endif
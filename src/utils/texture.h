@@ -16,6 +16,15 @@ enum {
     TF_LAZY_LOAD        = 1 << 2
 };
 
+// Categories of the textures, for the GPU memory accounting.
+enum {
+    TEX_CAT_OTHER = 0,
+    TEX_CAT_HIPS,
+    TEX_CAT_LABEL,
+    TEX_CAT_PLANET,
+    TEX_CAT_COUNT
+};
+
 /*
  * Type: texture_t
  * Represent an OpenGL texture.
@@ -38,6 +47,15 @@ enum {
  *   url    - For async texture: url source of the image.
  *   border - Set to 1 to use a UV mapping that does not include the last
  *            pixel.  (experimental).
+ *   atlas  - For textures stored in an atlas: the atlas.
+ *   page   - For textures stored in an atlas: the page texture.  The id
+ *            of the texture is the id of the page.
+ *   x, y   - For textures stored in an atlas: position in the page.
+ *   category - One of the TEX_CAT values, for the memory accounting.
+ *   owner  - Optional owner of the texture, for the memory accounting.
+ *   size   - Bytes used on the GPU by the texture, zero if it doesn't have
+ *            its own OpenGL storage (not loaded yet, or in an atlas).
+ *   last_used - Last frame the texture was loaded or used.
  */
 typedef struct texture {
     uint32_t        id;
@@ -47,8 +65,27 @@ typedef struct texture {
     int             flags;
     char            *url;
     int             border;
+    struct texture_atlas *atlas;
+    struct texture  *page;
+    int             x, y;
+    int             category;
+    const void      *owner;
+    int             size;
+    int             last_used;
+    struct texture  *reg_next, *reg_prev; // Registry list, oldest first.
 } texture_t;
 
+/*
+ * Type: texture_atlas_t
+ * Store many textures of the same size into a few big textures (pages).
+ *
+ * The textures of an atlas share the OpenGL texture of their page, so that
+ * the renderer can draw all the textures of a page with a single draw
+ * call.  Releasing a texture frees its slot, and a page is deleted as soon
+ * as it doesn't contain any texture anymore.
+ */
+typedef struct texture_atlas texture_atlas_t;
+
 /*
  * Function: texture_set_load_callback
  * Set the callback function that will be used for asynchronous textures.
@@ -71,6 +108,107 @@ texture_t *texture_create(int w, int h, int bpp);
 texture_t *texture_from_data(const void *data, int img_w, int img_h, int bpp,
                              int x, int y, int w, int h, int flags);
 texture_t *texture_from_url(const char *url, int flags);
+
+/*
+ * Function: texture_bc1_supported
+ * Return whether the OpenGL context supports BC1 (DXT1) textures.
+ */
+bool texture_bc1_supported(void);
+
+/*
+ * Function: texture_from_bc1
+ * Create a texture from BC1 compressed data.
+ *
+ * Parameters:
+ *   data  - Data created with <bc1_encode>.
+ *   w     - Width of the image, must be a power of two.
+ *   h     - Height of the image, must be a power of two.
+ *   flags - Texture creation flags.  Mipmaps are not supported.
+ */
+texture_t *texture_from_bc1(const void *data, int w, int h, int flags);
 bool texture_load(texture_t *tex, int *code);
 void texture_set_data(texture_t *tex, const void *data, int w, int h, int bpp);
 void texture_release(texture_t *tex);
+
+/*
+ * Function: texture_set_owner
+ * Set the category and owner of a texture, for the memory accounting.
+ *
+ * Parameters:
+ *   tex      - A texture.
+ *   category - One of the TEX_CAT values.
+ *   owner    - Any pointer identifying the owner, or NULL.
+ */
+void texture_set_owner(texture_t *tex, int category, const void *owner);
+
+/*
+ * Function: texture_get_memory
+ * Get the GPU memory used by the textures.
+ *
+ * Parameters:
+ *   category - One of the TEX_CAT values, or -1 for all the categories.
+ *   owner    - Only count the textures of this owner, or NULL for all.
+ *
+ * Return:
+ *   The size in bytes.
+ */
+int64_t texture_get_memory(int category, const void *owner);
+
+/*
+ * Function: texture_end_frame
+ * Enforce the GPU memory budget of the textures.
+ *
+ * Must be called once per frame, after the rendering.  If the textures use
+ * more than max_size bytes, the least recently used textures that can be
+ * re-created (the ones loaded from an url) and that were not used during
+ * the frame are deleted.  They will be loaded again by <texture_load> the
+ * next time they are needed.
+ *
+ * Parameters:
+ *   max_size - Budget in bytes, zero for no limit.
+ *
+ * Return:
+ *   The number of textures deleted.
+ */
+int texture_end_frame(int64_t max_size);
+
+/*
+ * Function: texture_atlas_create
+ * Create a new texture atlas.
+ *
+ * Parameters:
+ *   page_size - Width and height of the pages, must be a power of two.
+ *   w         - Width of the textures.
+ *   h         - Height of the textures.
+ *   bpp       - Number of bytes per pixel of the textures.
+ */
+texture_atlas_t *texture_atlas_create(int page_size, int w, int h, int bpp);
+
+/*
+ * Function: texture_atlas_set_owner
+ * Set the category and owner of the pages of an atlas.
+ *
+ * See <texture_set_owner>.
+ */
+void texture_atlas_set_owner(texture_atlas_t *atlas, int category,
+                             const void *owner);
+
+/*
+ * Function: texture_atlas_add
+ * Upload an image into a free slot of an atlas.
+ *
+ * Parameters:
+ *   atlas - A texture atlas.
+ *   data  - Image data, with the size and bpp of the atlas.
+ *
+ * Return:
+ *   A new texture, to be released with <texture_release>.
+ */
+texture_t *texture_atlas_add(texture_atlas_t *atlas, const void *data);
+
+/*
+ * Function: texture_atlas_get_stats
+ * Get the number of pages and of used slots of an atlas.
+ */
+void texture_atlas_get_stats(const texture_atlas_t *atlas,
+                             int *nb_pages, int *nb_used);
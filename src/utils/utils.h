@@ -131,6 +131,19 @@ uint8_t *img_read(const char *path, int *w, int *h, int *bpp);
 uint8_t *img_read_from_mem(const void *data, int size,
                            int *w, int *h, int *bpp);
 
+/*
+ * Function: img_read_from_mem_scaled
+ * Read a png/jpeg/webp image from memory at a reduced resolution.
+ *
+ * Only webp images support scaling during the decoding, the other formats
+ * are always decoded at their full resolution.
+ *
+ * Parameters:
+ *   shift - Divide the size of the image by 2^shift.
+ */
+uint8_t *img_read_from_mem_scaled(const void *data, int size, int shift,
+                                  int *w, int *h, int *bpp);
+
 /*
  * Function: img_write
  * Write an image to file.
@@ -8,137 +8,332 @@
  */
 
 #include "worker.h"
-#include "uthash.h"
 
+#include <assert.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
 enum {
-    WORKER_RUNNING = 1,
+    WORKER_QUEUED = 1,
+    WORKER_RUNNING,
     WORKER_FINISHED,
 };
 
-// How many threads in the pool
-#define THREADS_COUNT 2
-
 #ifdef HAVE_PTHREAD
 
 #include <pthread.h>
+#include <unistd.h>
+
+// Growable ring buffer of workers.  The owner thread pops from the front,
+// so that the workers run in the order they were added, and the other
+// threads steal from the back.
+typedef struct {
+    pthread_mutex_t lock;
+    worker_t **items;
+    int start;
+    int size;
+    int capacity;
+} deque_t;
 
 typedef struct thread_t {
     pthread_t id;
-    bool ready;
+    int index;
+    deque_t queue;
 } thread_t;
 
 static struct {
-    thread_t threads[THREADS_COUNT];
-    pthread_mutex_t rlock;
-    pthread_cond_t global_cond;
-    worker_t *waiting_worker;
-    bool stop;
-    bool initialized;
-    worker_t *workers; // Hash map of workers.
+    thread_t *threads;
+    int nb_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // Signaled when some workers are added.
+    int nb_queued;
+    unsigned int next_queue;
+    bool stop; // Set to stop the threads, even if there are queued workers.
 } g = {
-    .rlock = PTHREAD_MUTEX_INITIALIZER,
-    .global_cond = PTHREAD_COND_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
 };
 
+// Index of the pool thread we are running in, -1 for other threads.
+static __thread int g_thread_index = -1;
+
+static int get_state(const worker_t *w)
+{
+    return __atomic_load_n(&w->state, __ATOMIC_ACQUIRE);
+}
+
+static void set_state(worker_t *w, int state)
+{
+    __atomic_store_n(&w->state, state, __ATOMIC_RELEASE);
+}
+
+static worker_t **deque_at(deque_t *q, int i)
+{
+    return &q->items[(q->start + i) % q->capacity];
+}
+
+static void deque_push(deque_t *q, worker_t *w)
+{
+    worker_t **items;
+    int i, capacity;
+    if (q->size == q->capacity) {
+        capacity = q->capacity ? q->capacity * 2 : 64;
+        items = calloc(capacity, sizeof(*items));
+        for (i = 0; i < q->size; i++) items[i] = *deque_at(q, i);
+        free(q->items);
+        q->items = items;
+        q->capacity = capacity;
+        q->start = 0;
+    }
+    *deque_at(q, q->size++) = w;
+}
+
+static worker_t *deque_pop_front(deque_t *q)
+{
+    worker_t *w;
+    if (!q->size) return NULL;
+    w = *deque_at(q, 0);
+    q->start = (q->start + 1) % q->capacity;
+    q->size--;
+    return w;
+}
+
+static worker_t *deque_pop_back(deque_t *q)
+{
+    if (!q->size) return NULL;
+    return *deque_at(q, --q->size);
+}
+
+static bool deque_remove(deque_t *q, worker_t *w)
+{
+    int i;
+    for (i = 0; i < q->size; i++) {
+        if (*deque_at(q, i) != w) continue;
+        for (; i < q->size - 1; i++)
+            *deque_at(q, i) = *deque_at(q, i + 1);
+        q->size--;
+        return true;
+    }
+    return false;
+}
+
+// Pop a worker from a thread queue, and mark it as running.
+static worker_t *take_worker(thread_t *thread, bool steal)
+{
+    worker_t *w;
+    pthread_mutex_lock(&thread->queue.lock);
+    w = steal ? deque_pop_back(&thread->queue) :
+                deque_pop_front(&thread->queue);
+    if (w) set_state(w, WORKER_RUNNING);
+    pthread_mutex_unlock(&thread->queue.lock);
+    if (w) {
+        pthread_mutex_lock(&g.lock);
+        g.nb_queued--;
+        pthread_mutex_unlock(&g.lock);
+    }
+    return w;
+}
+
+static void run_worker(worker_t *w)
+{
+    w->ret = w->fn(w);
+    // After this point the worker can be released by its owner.
+    set_state(w, WORKER_FINISHED);
+}
+
 // The only part of the code that can run in different threads.
 static void *thread_func(void *args)
 {
+    thread_t *thread = args;
     worker_t *w;
-    thread_t *thread = (thread_t*)args;
-    int r;
+    int i;
+    bool stop;
 
-    thread->ready = true;
+    g_thread_index = thread->index;
     while (true) {
-        pthread_mutex_lock(&g.rlock);
-        while (g.waiting_worker == NULL && !g.stop)
-            pthread_cond_wait(&g.global_cond, &g.rlock);
-        if (g.stop) {
-            pthread_mutex_unlock(&g.rlock);
-            break;
+        // Don't take any new worker once we have been asked to stop, the
+        // queued ones are moved to the new threads.
+        if (__atomic_load_n(&g.stop, __ATOMIC_ACQUIRE)) break;
+        w = take_worker(thread, false);
+        // Nothing in our queue, try to steal from the other threads.
+        for (i = 1; !w && i < g.nb_threads; i++) {
+            w = take_worker(&g.threads[(thread->index + i) % g.nb_threads],
+                            true);
         }
-        thread->ready = false;
-        w = g.waiting_worker;
-        g.waiting_worker = NULL;
-        pthread_mutex_unlock(&g.rlock);
-
-        r = w->fn(w);
-
-        pthread_mutex_lock(&g.rlock);
-        w->ret = r;
-        w->state = WORKER_FINISHED;
-        thread->ready = true;
-        pthread_mutex_unlock(&g.rlock);
+        if (w) {
+            run_worker(w);
+            continue;
+        }
+        pthread_mutex_lock(&g.lock);
+        while (g.nb_queued == 0 && !g.stop)
+            pthread_cond_wait(&g.cond, &g.lock);
+        stop = g.stop;
+        pthread_mutex_unlock(&g.lock);
+        if (stop) break;
     }
     return NULL;
 }
 
-static void g_init(void)
+static int get_nb_cores(void)
+{
+    long nb = sysconf(_SC_NPROCESSORS_ONLN);
+    return nb > 0 ? nb : 2;
+}
+
+static void start_threads(int nb)
 {
     int i;
-    for (i = 0; i < THREADS_COUNT; i++)
+    g.stop = false;
+    g.nb_threads = nb;
+    g.threads = calloc(nb, sizeof(*g.threads));
+    for (i = 0; i < nb; i++) {
+        g.threads[i].index = i;
+        pthread_mutex_init(&g.threads[i].queue.lock, NULL);
+    }
+    for (i = 0; i < nb; i++)
         pthread_create(&g.threads[i].id, NULL, thread_func, &g.threads[i]);
-    g.initialized = true;
+}
+
+static void g_init(void)
+{
+    if (!g.threads) start_threads(get_nb_cores());
+}
+
+void worker_set_threads_count(int nb)
+{
+    int i, old_nb = g.nb_threads;
+    thread_t *old = g.threads;
+    worker_t *w;
+
+    if (nb <= 0) nb = get_nb_cores();
+    if (old && nb == old_nb) return;
+
+    if (old) {
+        pthread_mutex_lock(&g.lock);
+        __atomic_store_n(&g.stop, true, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&g.cond);
+        pthread_mutex_unlock(&g.lock);
+        for (i = 0; i < old_nb; i++) pthread_join(old[i].id, NULL);
+    }
+
+    start_threads(nb);
+
+    // Move the queued workers to the new threads.
+    for (i = 0; i < old_nb; i++) {
+        while ((w = deque_pop_front(&old[i].queue))) {
+            w->queue = i % nb;
+            pthread_mutex_lock(&g.threads[w->queue].queue.lock);
+            deque_push(&g.threads[w->queue].queue, w);
+            pthread_mutex_unlock(&g.threads[w->queue].queue.lock);
+        }
+        free(old[i].queue.items);
+        pthread_mutex_destroy(&old[i].queue.lock);
+    }
+    free(old);
+    pthread_mutex_lock(&g.lock);
+    pthread_cond_broadcast(&g.cond);
+    pthread_mutex_unlock(&g.lock);
+}
+
+int worker_get_threads_count(void)
+{
+    g_init();
+    return g.nb_threads;
 }
 
 void worker_init(worker_t *w, int (*fn)(worker_t *w))
 {
-    if (!g.initialized) g_init();
+    g_init();
     w->state = 0;
     w->ret = 0;
     w->fn = fn;
 }
 
-static bool is_thread_ready(void)
+void worker_add(worker_t *w)
 {
-    int i;
-    if (g.waiting_worker != NULL) return false;
-    for (i = 0; i < THREADS_COUNT; i++) {
-        if (g.threads[i].ready) {
-            return true;
-        }
+    thread_t *thread;
+    assert(w->state == 0);
+    g_init();
+    // Workers added from a pool thread go into its own queue.
+    if (g_thread_index >= 0) w->queue = g_thread_index;
+    else w->queue = __atomic_fetch_add(&g.next_queue, 1, __ATOMIC_RELAXED)
+                    % g.nb_threads;
+    thread = &g.threads[w->queue];
+    pthread_mutex_lock(&thread->queue.lock);
+    set_state(w, WORKER_QUEUED);
+    deque_push(&thread->queue, w);
+    pthread_mutex_unlock(&thread->queue.lock);
+
+    pthread_mutex_lock(&g.lock);
+    g.nb_queued++;
+    pthread_cond_signal(&g.cond);
+    pthread_mutex_unlock(&g.lock);
+}
+
+bool worker_cancel(worker_t *w)
+{
+    thread_t *thread;
+    bool ret = false;
+    if (get_state(w) != WORKER_QUEUED) return false;
+    thread = &g.threads[w->queue];
+    pthread_mutex_lock(&thread->queue.lock);
+    if (get_state(w) == WORKER_QUEUED && deque_remove(&thread->queue, w)) {
+        set_state(w, 0);
+        ret = true;
     }
-    return false;
+    pthread_mutex_unlock(&thread->queue.lock);
+    if (ret) {
+        pthread_mutex_lock(&g.lock);
+        g.nb_queued--;
+        pthread_mutex_unlock(&g.lock);
+    }
+    return ret;
 }
 
 int worker_iter(worker_t *w)
 {
-    pthread_mutex_lock(&g.rlock);
-    if (w->state == 0) {
-        if (is_thread_ready()) {
-            w->state = WORKER_RUNNING;
-            g.waiting_worker = w;
-            pthread_cond_signal(&g.global_cond);
-        }
-    }
-    pthread_mutex_unlock(&g.rlock);
-    return w->state == WORKER_FINISHED;
+    if (get_state(w) == 0) worker_add(w);
+    return get_state(w) == WORKER_FINISHED;
 }
 
 bool worker_is_running(worker_t *w)
 {
-    bool ret;
-    pthread_mutex_lock(&g.rlock);
-    ret = w->state == WORKER_RUNNING;
-    pthread_mutex_unlock(&g.rlock);
-    return ret;
+    int state = get_state(w);
+    return state == WORKER_QUEUED || state == WORKER_RUNNING;
 }
 
 #else // No pthread, basic non threaded implementations.
 
+void worker_set_threads_count(int nb)
+{
+}
+
+int worker_get_threads_count(void)
+{
+    return 0;
+}
+
 void worker_init(worker_t *w, int (*fn)(worker_t *w))
 {
     memset(w, 0, sizeof(*w));
     w->fn = fn;
 }
 
+void worker_add(worker_t *w)
+{
+    w->ret = w->fn(w);
+    w->state = WORKER_FINISHED;
+}
+
+bool worker_cancel(worker_t *w)
+{
+    return false;
+}
+
 int worker_iter(worker_t *w)
 {
-    if (w->state) return 1;
-    w->fn(w);
-    w->state = 1;
+    if (!w->state) worker_add(w);
     return 1;
 }
 
@@ -148,3 +343,51 @@ bool worker_is_running(worker_t *w)
 }
 
 #endif
+
+/******** TESTS ***********************************************************/
+
+#if COMPILE_TESTS && defined(HAVE_PTHREAD)
+
+#include "tests.h"
+
+static int test_worker_fn(worker_t *w)
+{
+    int *counter = w->user;
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+static void test_worker(void)
+{
+    const int n = 1000;
+    worker_t *workers = calloc(n, sizeof(*workers));
+    bool *canceled = calloc(n, sizeof(*canceled));
+    int i, nb_canceled = 0, counter = 0;
+
+    worker_set_threads_count(3);
+    assert(worker_get_threads_count() == 3);
+    for (i = 0; i < n; i++) {
+        worker_init(&workers[i], test_worker_fn);
+        workers[i].user = &counter;
+        worker_add(&workers[i]);
+    }
+    for (i = n - 1; i >= 0; i -= 2) {
+        canceled[i] = worker_cancel(&workers[i]);
+        nb_canceled += canceled[i];
+    }
+    // Changing the number of threads keeps the queued workers.
+    worker_set_threads_count(2);
+    for (i = 0; i < n; i++) {
+        if (canceled[i]) continue;
+        while (!worker_iter(&workers[i])) usleep(100);
+        assert(workers[i].ret == 1);
+    }
+    assert(counter == n - nb_canceled);
+    worker_set_threads_count(0);
+    free(workers);
+    free(canceled);
+}
+
+TEST_REGISTER(NULL, test_worker, TEST_AUTO);
+
+#endif
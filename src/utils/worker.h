@@ -12,8 +12,13 @@
  * Some basic threading functions.
  *
  * A worker is simply a task that run in a thread pool.  We can create a worker
- * with <worker_init> and then run it by calling <worker_iter> as many times
- * as we want, until it returns a non zero value.
+ * with <worker_init> and then queue it with <worker_add>.  The function
+ * <worker_iter> can also be called as many times as we want, until it
+ * returns a non zero value.
+ *
+ * The pool uses one queue per thread.  Idle threads steal work from the
+ * other threads queues, so that all the threads stay busy as long as there
+ * are queued workers.
  */
 
 #include <stdbool.h>
@@ -26,21 +31,59 @@ struct worker
     void *user;
     int ret;
     int state;
+    int queue; // Index of the thread queue we were added to.
 };
 
+/*
+ * Function: worker_set_threads_count
+ * Set the number of threads in the pool.
+ *
+ * The current threads stop after their running worker, without taking
+ * the queued ones, that are then moved to the new threads.  This blocks
+ * until the running workers have finished.
+ *
+ * Parameters:
+ *   nb - Number of threads, or zero to use the number of cores.
+ */
+void worker_set_threads_count(int nb);
+
+/*
+ * Function: worker_get_threads_count
+ * Return the number of threads in the pool.
+ */
+int worker_get_threads_count(void);
+
 /*
  * Function: worker_init
  * Initialize the worker struct to run a given function in a thread.
  */
 void worker_init(worker_t *w, int (*fn)(worker_t *w));
 
+/*
+ * Function: worker_add
+ * Queue a worker so that it runs as soon as a thread is available.
+ *
+ * The worker must not be released until it has finished or has been
+ * canceled.
+ */
+void worker_add(worker_t *w);
+
+/*
+ * Function: worker_cancel
+ * Remove a worker from the queue if it didn't start yet.
+ *
+ * Return:
+ *   true if the worker was canceled, false if it is already running or
+ *   has finished.
+ */
+bool worker_cancel(worker_t *w);
+
 /*
  * Function: worker_iter
  * Execute the worker function.
  *
- * This will attempt to start the worker function in a separate thread.
- * If the function is already running or if no thread is ready, it does
- * nothing.
+ * This queues the worker the first time it is called, and then does
+ * nothing until the worker has finished.
  *
  * We can call this in a loop until it returns a non zero value to make it
  * work like a simple future object.
@@ -52,6 +95,6 @@ int worker_iter(worker_t *worker);
 
 /*
  * Function: worker_is_running
- * Return whether a worker is currently running.
+ * Return whether a worker is currently queued or running.
  */
 bool worker_is_running(worker_t *worker);
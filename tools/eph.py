@@ -20,6 +20,10 @@ UNIT_VMAG            = 3 << 16
 UNIT_ARCSEC          = 5 << 16 | 1 | 2 | 4
 UNIT_RAD_PER_YEAR    = 7 << 16
 
+# Compressed blocks codecs: must be exactly the same as in src/eph-file.h!
+CODEC_ZLIB           = 0
+CODEC_LZ4            = 1
+
 
 def ensure_dir(file_path):
     directory = os.path.dirname(file_path)
@@ -54,7 +58,25 @@ def col_get_size(col):
     assert False
 
 
-def create_tile(data, chunk_type, nuniq, path, columns):
+def compress(data, codec):
+    if codec == CODEC_ZLIB:
+        return zlib.compress(data)
+    if codec == CODEC_LZ4:
+        import lz4.block
+        return lz4.block.compress(data, store_size=False)
+    assert False
+
+
+def decompress(data, size, codec):
+    if codec == CODEC_ZLIB:
+        return zlib.decompress(data)
+    if codec == CODEC_LZ4:
+        import lz4.block
+        return lz4.block.decompress(data, uncompressed_size=size)
+    assert False
+
+
+def create_tile(data, chunk_type, nuniq, path, columns, codec=CODEC_ZLIB):
     order = int(log(nuniq / 4, 2) / 2);
     pix = nuniq - 4 * (1 << (2 * order));
     path = '%s/Norder%d/Dir%d/Npix%d.eph' % (
@@ -85,7 +107,7 @@ def create_tile(data, chunk_type, nuniq, path, columns):
             buf += struct.pack(t, v)
     data = shuffle_bytes(buf, row_size)
 
-    comp_data = zlib.compress(data)
+    comp_data = compress(data, codec)
 
     ret = 'EPHE'
     ret += struct.pack('I', 2) # File version
@@ -96,7 +118,8 @@ def create_tile(data, chunk_type, nuniq, path, columns):
     chunk += header
 
     chunk += struct.pack('I', len(data))
-    chunk += struct.pack('I', len(comp_data))
+    # The codec is stored in the 4 high bits of the compressed size.
+    chunk += struct.pack('I', len(comp_data) | codec << 28)
     chunk += comp_data
 
     ret += chunk_type
@@ -124,8 +147,9 @@ def read_tile(path):
         type = type.strip('\0')
         cols.append(dict(id=id, type=type, unit=unit, ofs=ofs, size=size))
     data_len, comp_data_len = struct.unpack('II', f.read(8))
-    comp_data = f.read(comp_data_len)
-    data = zlib.decompress(comp_data)
+    codec = comp_data_len >> 28
+    comp_data = f.read(comp_data_len & ((1 << 28) - 1))
+    data = decompress(comp_data, data_len, codec)
     data = shuffle_bytes(data, nb_sources)
     ret = []
     for i in range(nb_sources):
@@ -12,6 +12,7 @@
 # This script generates the eph format stars survey from HIP and BSC catalog.
 
 from math import *
+import argparse
 import collections
 import gzip
 import hashlib
@@ -26,6 +27,13 @@ from utils import ensure_dir, download, parse, DD2R
 
 MAX_SOURCES_PER_TILE = 1024
 
+CODECS = {'zlib': eph.CODEC_ZLIB, 'lz4': eph.CODEC_LZ4}
+
+parser = argparse.ArgumentParser()
+parser.add_argument('--codec', choices=sorted(CODECS), default='zlib',
+                    help='compression of the tiles data')
+args = parser.parse_args()
+
 Star = collections.namedtuple('Star',
         ['hip', 'hd', 'vmag', 'ra', 'de', 'plx', 'pra', 'pde', 'bv'])
 
@@ -86,7 +94,7 @@ COLUMNS = [
 for nuniq, stars in tiles.items():
     stars = sorted(stars, key=lambda x: x.hip * 1000000 + x.hd)
     eph.create_tile(stars, chunk_type='STAR', nuniq=nuniq, path=out_dir,
-                    columns=COLUMNS)
+                    columns=COLUMNS, codec=CODECS[args.codec])
 
 # Also generate the properties file.
 with open(os.path.join(out_dir, 'properties'), 'w') as out: